@@ -1,10 +1,33 @@
 #ifndef CHARSET_H
 #define CHARSET_H
 
-int init_charset(char *name);
-char *utf2ascii(char *src, char *dest, int size);
-char *ascii2utf(char *src, char *dest, int size);
+/*
+ * A local 8-bit charset. c2u gives the unicode of bytes 0x80-0xff;
+ * the byte for unicode u is u2c_lo[u2c_hi[u >> 8] - 1][u & 0xff]
+ * (none if u2c_hi is 0 or the byte is 0). The tables are made by
+ * mkcharset at build time and are read-only. utf8 has none.
+ */
+typedef struct _charset {
 
-#endif
+	const char *name;
+	const unsigned short *c2u;
+	const unsigned char *u2c_hi;
+	const unsigned char *const *u2c_lo;
+
+} charset;
+
+extern const charset charsets[];	/* ends with a NULL name */
 
+/*
+ * The charset called name ("-" and "_" are the same), or NULL.
+ */
+const charset *charset_find(const char *name);
 
+/*
+ * Convert between utf-8 and cs. At most size bytes and a '\0' are
+ * written; what can't be converted becomes '?'. Return dest.
+ */
+char *cs_from_utf(const charset *cs, const char *src, char *dest, int size);
+char *cs_to_utf(const charset *cs, const char *src, char *dest, int size);
+
+#endif
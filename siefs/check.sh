@@ -0,0 +1,185 @@
+#!/bin/sh
+#
+# make check: slink and siefs against the phone emulator
+#
+# Each scenario starts sieemu on a fresh phone tree in a scratch
+# directory. The siefs part needs FUSE and is skipped where it
+# can't be mounted. Exits 1 if a scenario failed.
+
+T=${TMPDIR:-/tmp}/siefs-check.$$
+EMU=$T/tty
+pids=
+failed=0
+
+SLINK_DEVICE=$EMU
+SIEFS_TRACE=
+export SLINK_DEVICE SIEFS_TRACE
+
+stop() {
+	for p in $pids; do
+		kill $p 2>/dev/null
+		wait $p 2>/dev/null
+	done
+	pids=
+}
+
+# sieemu on a fresh phone tree $1 with its tty at $2, options after
+emulate() {
+	dir=$1
+	tty=$2
+	shift 2
+	rm -rf $dir $tty
+	mkdir -p $dir/Misc $dir/Pictures $dir/telecom/pb $dir/telecom/cal
+	./sieemu -l $tty "$@" $dir 2>>$T/emu.log >/dev/null &
+	pids="$pids $!"
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		test -e $tty && return 0
+		sleep 1
+	done
+	echo "sieemu didn't start" >&2
+	return 1
+}
+
+# the only phone, at $EMU
+phone() {
+	stop
+	emulate $T/phone $EMU "$@"
+}
+
+# wait for siefs to show up on mountpoint $1
+mounted() {
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		test -e $1/.siefs/ctl && return 0
+		sleep 1
+	done
+	return 1
+}
+
+result() {
+	if test $1 -eq 0; then
+		echo "PASS: $2"
+	else
+		echo "FAIL: $2"
+		failed=1
+	fi
+}
+
+vcards() {
+	i=1
+	while test $i -le $1; do
+		printf 'BEGIN:VCARD\r\nVERSION:2.1\r\nN:Person%d;Test\r\nEND:VCARD\r\n' $i > $T/phone/telecom/pb/$i.vcf
+		i=`expr $i + 1`
+	done
+}
+
+trap 'stop; rm -rf $T' 0
+trap 'exit 1' 1 2 15
+mkdir -p $T || exit 1
+dd if=/dev/urandom of=$T/big bs=1024 count=200 2>/dev/null
+
+# transfers, and the line dropped once in the middle of one
+phone
+./slink p $T/big /Misc/big.bin >>$T/log 2>&1 && cmp -s $T/big $T/phone/Misc/big.bin
+result $? "put"
+./slink g /Misc/big.bin $T/got >>$T/log 2>&1 && cmp -s $T/big $T/got
+result $? "get"
+
+phone -x -6
+cp $T/big $T/phone/Pictures/big.bin
+rm -f $T/got
+./slink g /Pictures/big.bin $T/got >>$T/log 2>&1 && cmp -s $T/big $T/got
+result $? "reconnect during get"
+phone -x -6
+./slink p $T/big /Misc/big.bin >>$T/log 2>&1 && cmp -s $T/big $T/phone/Misc/big.bin
+result $? "reconnect during put"
+
+# a batch: deletes, mkdirs, a move and a chmod in several folders
+phone
+for f in f1 f2 f3; do echo $f > $T/phone/Misc/$f; echo $f > $T/phone/$f; done
+cat > $T/ops <<EOF
+c /Misc/n1
+d /Misc/f1
+c /Misc/n1/x
+d /f1
+m /Misc/f2 /Pictures/f2
+a /f2 0640
+d /Misc/f3
+EOF
+./slink x $T/ops >>$T/log 2>&1 &&
+	test -d $T/phone/Misc/n1/x && test ! -e $T/phone/Misc/f1 &&
+	test ! -e $T/phone/f1 && test -f $T/phone/Pictures/f2 &&
+	test ! -e $T/phone/Misc/f2 && test ! -e $T/phone/Misc/f3
+result $? "batch"
+
+# mkdir -p of several folders, rm -r of a tree
+./slink c /a/b/c /a/d /e >>$T/log 2>&1 &&
+	test -d $T/phone/a/b/c && test -d $T/phone/a/d && test -d $T/phone/e
+result $? "mkdirs"
+mkdir -p $T/phone/a/b/c $T/phone/a/d
+for d in a a/b a/b/c a/d; do echo x > $T/phone/$d/f; done
+./slink r /a >>$T/log 2>&1 && test ! -e $T/phone/a && test -d $T/phone/e
+result $? "rmtree"
+
+# IrMC sync: a full fetch, then only the changes
+phone
+vcards 50
+./slink s pb $T/pb1.vcf $T/pb.irmc >>$T/log 2>&1 &&
+	test `grep -c BEGIN:VCARD $T/pb1.vcf` -eq 50
+result $? "irmc full sync"
+sleep 2
+printf 'BEGIN:VCARD\r\nVERSION:2.1\r\nN:Changed;Test\r\nEND:VCARD\r\n' > $T/phone/telecom/pb/7.vcf
+rm $T/phone/telecom/pb/8.vcf
+./slink s pb $T/pb2.vcf $T/pb.irmc >>$T/log 2>&1 &&
+	test `grep -c BEGIN:VCARD $T/pb2.vcf` -eq 49 && grep -q Changed $T/pb2.vcf &&
+	! grep -q 'Person8;' $T/pb2.vcf
+result $? "irmc changes"
+
+# siefs: files through the spool, ctl commands, the IrMC files
+if test -w /dev/fuse && { command -v fusermount3 || command -v fusermount; } >/dev/null 2>&1; then
+	umnt=`command -v fusermount3 || command -v fusermount`
+	phone
+	vcards 10
+	mkdir -p $T/mnt $T/irmc
+	./siefs -o irmc=$T/irmc $EMU $T/mnt 2>>$T/log
+	mounted $T/mnt
+
+	cp $T/big $T/mnt/Misc/s.bin && cmp -s $T/big $T/mnt/Misc/s.bin &&
+		cmp -s $T/big $T/phone/Misc/s.bin
+	result $? "siefs write and read back"
+	echo "mkdirs /x/y /z" > $T/mnt/.siefs/ctl &&
+		test -d $T/phone/x/y && test -d $T/phone/z
+	result $? "siefs ctl mkdirs"
+	echo x > $T/phone/x/y/f
+	echo "rmtree /x" > $T/mnt/.siefs/ctl && test ! -e $T/phone/x
+	result $? "siefs ctl rmtree"
+	echo "reconnect" > $T/mnt/.siefs/ctl && ls $T/mnt/Misc | grep -q s.bin
+	result $? "siefs reconnect"
+	test `grep -c BEGIN:VCARD $T/mnt/telecom/pb.vcf` -eq 10 &&
+		! sh -c "echo x > $T/mnt/telecom/pb.vcf" 2>/dev/null
+	result $? "siefs irmc"
+	$umnt -u $T/mnt
+
+	# one siefs serving two phones
+	phone
+	emulate $T/phone2 $T/tty2
+	mkdir -p $T/mnt2
+	./siefs $EMU $T/mnt $T/tty2 $T/mnt2 2>>$T/log
+	mounted $T/mnt && mounted $T/mnt2 &&
+		echo one > $T/mnt/Misc/a && echo two > $T/mnt2/Misc/b &&
+		test "`cat $T/mnt/Misc/a $T/mnt2/Misc/b`" = "one
+two" &&
+		test "`cat $T/phone/Misc/a $T/phone2/Misc/b`" = "one
+two"
+	result $? "siefs with two phones"
+	$umnt -u $T/mnt
+	$umnt -u $T/mnt2
+else
+	echo "SKIP: siefs (no FUSE to mount with)"
+fi
+
+stop
+if test $failed -ne 0; then
+	echo "logs: $T/log $T/emu.log"
+	trap - 0
+fi
+exit $failed
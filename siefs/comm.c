@@ -10,19 +10,51 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <errno.h>
 #include "comm.h"
+#include "fault.h"
+#include "stats.h"
 
 #define DEFSPEED 19200
 #define DEFTIMEOUT 30
 #define COMMFLAGS (PARODD | HUPCL | CS8 | CLOCAL | CREAD)
 
+/* telnet (RFC 854, RFC 2217) */
+#define IAC 255
+#define DONT 254
+#define DO 253
+#define WONT 252
+#define WILL 251
+#define SB 250
+#define SE 240
+#define TELOPT_BINARY 0
+#define TELOPT_SGA 3
+#define TELOPT_COMPORT 44
+#define CPO_SET_BAUDRATE 1
+#define CPO_SET_DATASIZE 2
+#define CPO_SET_PARITY 3
+#define CPO_SET_STOPSIZE 4
+
+#define TN_DATA 0
+#define TN_IAC 1
+#define TN_OPT 2
+#define TN_SB 3
+#define TN_SBIAC 4
+
 int commflags(int speed) {
 
 	int i;
@@ -30,7 +62,7 @@ int commflags(int speed) {
 		int speed;
 		int value;
 	}
-	r[] = { { 2400, B2400 }, { 9600, B9600 }, { 19200, B19200 }, 
+	r[] = { { 2400, B2400 }, { 9600, B9600 }, { 19200, B19200 },
 	      { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
 	      { 230400, B230400 }, { 0, 0 } };
 
@@ -41,20 +73,674 @@ int commflags(int speed) {
 
 }
 
+/* tty backend */
+
+static int tty_setup(hcomm *h, int raw) {
+
+	struct termios tio;
+	int f;
+
+	bzero(&tio, sizeof(tio));
+	if (raw) {
+		cfmakeraw(&tio);
+		tio.c_cflag |= CLOCAL | CREAD;
+	} else {
+		f = commflags(h->speed);
+		if (f == -1) return -1;
+		tio.c_cflag = f;
+		tio.c_iflag = IGNPAR | IGNBRK;
+		tio.c_oflag = 0;
+		tio.c_lflag = 0;
+	}
+	tio.c_cc[VTIME]  = h->timeout;
+	tio.c_cc[VMIN] = 0;
+
+	tcflush(h->fd, TCIOFLUSH);
+	if (tcsetattr(h->fd, TCSANOW, &tio) != 0)
+		return -1;
+
+	return 0;
+}
+
+static int tty_open(hcomm *h) {
+
+	h->fd = open(h->path, O_RDWR | O_NOCTTY | O_EXCL);
+	if (h->fd < 0) return -1;
+	return tty_setup(h, 0);
+}
+
+static int tty_setspeed(hcomm *h, int speed) {
+
+	struct termios tio;
+	int f;
+	int fd = h->fd;
+
+	f = commflags(speed);
+	if (f == -1) return -1;
+	tcgetattr(fd, &tio);
+	tio.c_cflag = f;
+	if (tcsetattr(fd, TCSANOW, &tio) != 0)
+		return -1;
+
+	return 0;
+}
+
+static int tty_settimeout(hcomm *h, int timeout) {
+
+	struct termios tio;
+	int fd = h->fd;
+
+	tcgetattr(fd, &tio);
+	tio.c_cc[VTIME]    = timeout;
+	if (tcsetattr(fd, TCSANOW, &tio) != 0)
+		return -1;
+
+	return 0;
+}
+
+static int fd_read(hcomm *h, void *buf, int len) {
+
+	int c;
+
+	c = read(h->fd, buf, len);
+	if (c < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+	if (c == 0 && (h->nonblock || h->ops->polled)) {
+		/* nothing to wait for: hangup */
+		errno = EIO;
+		return -1;
+	}
+	return c;
+}
+
+static int fd_write(hcomm *h, void *buf, int len) {
+
+	int c;
+
+	c = write(h->fd, buf, len);
+	if (c < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+	return c;
+}
+
+static void tty_close(hcomm *h) {
+
+	tcsendbreak(h->fd, 0);
+	close(h->fd);
+}
+
+static const commops tty_ops = {
+	"tty:", 0, tty_open, tty_setspeed, tty_settimeout,
+	fd_read, fd_write, tty_close
+};
+
+/* pty backend: a terminal without a line, eg. an emulator */
+
+static int pty_open(hcomm *h) {
+
+	h->fd = open(h->path, O_RDWR | O_NOCTTY);
+	if (h->fd < 0) return -1;
+	return tty_setup(h, 1);
+}
+
+static int nop_setspeed(hcomm *h, int speed) {
+
+	return 0;
+}
+
+static void fd_close(hcomm *h) {
+
+	close(h->fd);
+}
+
+static const commops pty_ops = {
+	"pty:", 0, pty_open, nop_setspeed, tty_settimeout,
+	fd_read, fd_write, fd_close
+};
+
+/* socket backends */
+
+static int nop_settimeout(hcomm *h, int timeout) {
+
+	return 0;
+}
+
+static int tcp_connect(hcomm *h) {
+
+	struct addrinfo hints, *ai, *a;
+	char *host, *port;
+	int fd = -1, on = 1;
+
+	host = strdup(h->path);
+	port = strrchr(host, ':');
+	if (port == NULL) {
+		free(host);
+		errno = EINVAL;
+		return -1;
+	}
+	*(port++) = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &ai) != 0) {
+		free(host);
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+
+	for (a = ai; a != NULL; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd < 0) continue;
+		if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	free(host);
+	if (fd < 0) return -1;
+
+	/* frames are small and latency is everything */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	h->fd = fd;
+	return 0;
+}
+
+static const commops tcp_ops = {
+	"tcp:", 1, tcp_connect, nop_setspeed, nop_settimeout,
+	fd_read, fd_write, fd_close
+};
+
+static int unix_connect(hcomm *h) {
+
+	struct sockaddr_un sa;
+	int fd;
+
+	if (strlen(h->path) >= sizeof(sa.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, h->path);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	h->fd = fd;
+	return 0;
+}
+
+static const commops unix_ops = {
+	"unix:", 1, unix_connect, nop_setspeed, nop_settimeout,
+	fd_read, fd_write, fd_close
+};
+
+/* rfc2217: telnet with com port control */
+
+/* write all of buf, waiting if the socket is full */
+static int sock_writeall(hcomm *h, unsigned char *buf, int len) {
+
+	struct pollfd pfd;
+	int c, n = 0;
+
+	while (n < len) {
+		c = write(h->fd, buf+n, len-n);
+		if (c < 0 && errno != EAGAIN && errno != EINTR)
+			return -1;
+		if (c > 0) {
+			n += c;
+			continue;
+		}
+		pfd.fd = h->fd;
+		pfd.events = POLLOUT;
+		poll(&pfd, 1, 1000);
+	}
+
+	return n;
+}
+
+static int cpo_set(hcomm *h, int cmd, unsigned char *v, int len) {
+
+	unsigned char buf[16];
+	int i, n = 0;
+
+	buf[n++] = IAC;
+	buf[n++] = SB;
+	buf[n++] = TELOPT_COMPORT;
+	buf[n++] = cmd;
+	for (i=0; i<len; i++) {
+		buf[n++] = v[i];
+		if (v[i] == IAC) buf[n++] = IAC;
+	}
+	buf[n++] = IAC;
+	buf[n++] = SE;
+
+	return (sock_writeall(h, buf, n) == n) ? 0 : -1;
+}
+
+static int rfc2217_setspeed(hcomm *h, int speed) {
+
+	unsigned char v[4];
+
+	v[0] = speed >> 24;
+	v[1] = speed >> 16;
+	v[2] = speed >> 8;
+	v[3] = speed;
+	return cpo_set(h, CPO_SET_BAUDRATE, v, 4);
+}
+
+static int rfc2217_open(hcomm *h) {
+
+	static unsigned char nego[] = {
+		IAC, WILL, TELOPT_BINARY, IAC, DO, TELOPT_BINARY,
+		IAC, WILL, TELOPT_SGA, IAC, DO, TELOPT_SGA,
+		IAC, WILL, TELOPT_COMPORT
+	};
+	unsigned char v;
+
+	if (tcp_connect(h) != 0)
+		return -1;
+	h->tstate = TN_DATA;
+
+	if (sock_writeall(h, nego, sizeof(nego)) != sizeof(nego))
+		return -1;
+	v = 8;
+	cpo_set(h, CPO_SET_DATASIZE, &v, 1);
+	v = 1;		/* no parity */
+	cpo_set(h, CPO_SET_PARITY, &v, 1);
+	v = 1;		/* one stop bit */
+	cpo_set(h, CPO_SET_STOPSIZE, &v, 1);
+
+	return rfc2217_setspeed(h, h->speed);
+}
+
+/* strip telnet commands from buf, returns the data length left */
+static int telnet_filter(hcomm *h, unsigned char *buf, int n) {
+
+	int i, m = 0;
+	unsigned char c;
+
+	for (i=0; i<n; i++) {
+		c = buf[i];
+		switch (h->tstate) {
+
+			case TN_DATA:
+				if (c == IAC)
+					h->tstate = TN_IAC;
+				else
+					buf[m++] = c;
+				break;
+
+			case TN_IAC:
+				if (c == IAC) {
+					buf[m++] = c;
+					h->tstate = TN_DATA;
+				} else if (c == SB) {
+					h->tstate = TN_SB;
+				} else if (c >= WILL && c <= DONT) {
+					h->tstate = TN_OPT;
+				} else {
+					h->tstate = TN_DATA;
+				}
+				break;
+
+			case TN_OPT:
+				h->tstate = TN_DATA;
+				break;
+
+			case TN_SB:
+				if (c == IAC) h->tstate = TN_SBIAC;
+				break;
+
+			case TN_SBIAC:
+				h->tstate = (c == SE) ? TN_DATA : TN_SB;
+				break;
+		}
+	}
+
+	return m;
+}
+
+static int rfc2217_read(hcomm *h, void *buf, int len) {
+
+	int c;
+
+	c = fd_read(h, buf, len);
+	if (c <= 0) return c;
+	return telnet_filter(h, buf, c);
+}
+
+static int rfc2217_write(hcomm *h, void *buf, int len) {
+
+	unsigned char *s = buf, *d, *tmp;
+	int i;
+
+	/* escape IAC bytes; the whole buffer goes out at once so the
+	   caller never sees a partial escaped write */
+	tmp = d = malloc(len * 2);
+	if (tmp == NULL) return -1;
+	for (i=0; i<len; i++) {
+		*(d++) = s[i];
+		if (s[i] == IAC) *(d++) = IAC;
+	}
+	i = sock_writeall(h, tmp, d - tmp);
+	free(tmp);
+
+	return (i < 0) ? -1 : len;
+}
+
+static const commops rfc2217_ops = {
+	"rfc2217:", 1, rfc2217_open, rfc2217_setspeed, nop_settimeout,
+	rfc2217_read, rfc2217_write, fd_close
+};
+
+/* replay backend: plays a capture back as the phone. What the host
+   sends is checked against the capture, and what the phone sent is
+   released through a pipe as soon as the host has sent everything
+   that came before it. */
+
+typedef struct {
+
+	unsigned char *data;	/* whole capture */
+	long len;
+	long pos;		/* next record */
+	long txpos;		/* bytes of the current tx record matched */
+	unsigned char *out;	/* rx data not yet in the pipe */
+	int outlen;
+	int wfd;		/* pipe, write end */
+	int records, total;
+	long differ, extra;
+
+} replay;
+
+#define REC_TYPE(p) ((p)[0])
+#define REC_LEN(p) ((p)[5] | ((p)[6] << 8))
+#define REC_DATA(p) ((p) + CAP_HDRLEN)
+
+static unsigned char *record(replay *r) {
+
+	unsigned char *p = r->data + r->pos;
+
+	if (r->pos + CAP_HDRLEN > r->len || r->pos + CAP_HDRLEN + REC_LEN(p) > r->len)
+		return NULL;
+	return p;
+}
+
+static void next_record(replay *r) {
+
+	r->pos += CAP_HDRLEN + REC_LEN(r->data + r->pos);
+	r->txpos = 0;
+	r->records++;
+}
+
+/* push pending rx data into the pipe */
+static void topup(replay *r) {
+
+	int c;
+
+	while (r->outlen > 0) {
+		c = write(r->wfd, r->out, r->outlen);
+		if (c <= 0) break;
+		r->out += c;
+		r->outlen -= c;
+	}
+}
+
+/* release everything the phone sent up to the next thing from the host */
+static void release(replay *r) {
+
+	unsigned char *p;
+
+	topup(r);
+	while (r->outlen == 0 && (p = record(r)) != NULL) {
+		if (REC_TYPE(p) == CAP_TX || REC_TYPE(p) == CAP_OPEN)
+			break;
+		if (REC_TYPE(p) == CAP_RX) {
+			r->out = REC_DATA(p);
+			r->outlen = REC_LEN(p);
+		}
+		next_record(r);
+		topup(r);
+	}
+}
+
+static int replay_load(hcomm *h) {
+
+	replay *r;
+	FILE *f;
+	long n;
+	unsigned char *p;
+
+	f = fopen(h->path, "r");
+	if (f == NULL) return -1;
+	r = (replay *) malloc(sizeof(replay));
+	memset(r, 0, sizeof(replay));
+	fseek(f, 0, SEEK_END);
+	r->len = ftell(f);
+	rewind(f);
+	r->data = malloc(r->len ? r->len : 1);
+	n = fread(r->data, 1, r->len, f);
+	fclose(f);
+
+	if (n != r->len || r->len < CAP_MAGICLEN ||
+		memcmp(r->data, CAP_MAGIC, CAP_MAGICLEN) != 0)
+	{
+		free(r->data);
+		free(r);
+		errno = EINVAL;
+		return -1;
+	}
+
+	r->pos = CAP_MAGICLEN;
+	while ((p = record(r)) != NULL) {
+		r->total++;
+		r->pos += CAP_HDRLEN + REC_LEN(p);
+	}
+	r->pos = CAP_MAGICLEN;
+	r->wfd = -1;
+	h->priv = r;
+	return 0;
+}
+
+static int replay_open(hcomm *h) {
+
+	replay *r;
+	unsigned char *p;
+	int fds[2];
+
+	if (h->priv == NULL && replay_load(h) != 0)
+		return -1;
+	r = h->priv;
+
+	/* the session continues after the next (re)open */
+	r->outlen = 0;
+	while ((p = record(r)) != NULL) {
+		next_record(r);
+		if (REC_TYPE(p) == CAP_OPEN) break;
+	}
+
+	if (pipe(fds) != 0) return -1;
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	h->fd = fds[0];
+	r->wfd = fds[1];
+	release(r);
+
+	return 0;
+}
+
+static int replay_read(hcomm *h, void *buf, int len) {
+
+	topup(h->priv);
+	return fd_read(h, buf, len);
+}
+
+static int replay_write(hcomm *h, void *buf, int len) {
+
+	replay *r = h->priv;
+	unsigned char *s = buf, *p;
+	int i;
+
+	for (i=0; i<len; i++) {
+		p = record(r);
+		if (p == NULL || REC_TYPE(p) != CAP_TX) {
+			r->extra++;		/* the phone wasn't expecting anything */
+			continue;
+		}
+		if (REC_DATA(p)[r->txpos] != s[i])
+			r->differ++;
+		if (++r->txpos == REC_LEN(p)) {
+			next_record(r);
+			release(r);
+		}
+	}
+
+	return len;
+}
+
+static void replay_close(hcomm *h) {
+
+	replay *r = h->priv;
+
+	close(h->fd);
+	close(r->wfd);
+	r->wfd = -1;
+}
+
+static void replay_destroy(hcomm *h) {
+
+	replay *r = h->priv;
+
+	if (r == NULL) return;
+	fprintf(stderr, "replay: %i of %i records, %li bytes sent differ, %li unexpected\n",
+		r->records, r->total, r->differ, r->extra);
+	free(r->data);
+	free(r);
+	h->priv = NULL;
+}
+
+static const commops replay_ops = {
+	"replay:", 1, replay_open, nop_setspeed, nop_settimeout,
+	replay_read, replay_write, replay_close, replay_destroy
+};
+
+static const commops *backends[] = {
+	&tty_ops, &pty_ops, &tcp_ops, &unix_ops, &rfc2217_ops, &replay_ops, NULL
+};
+
+/* split a device string into backend and path */
+static const commops *backend(const char *device, const char **path) {
+
+	int i, l;
+
+	for (i=0; backends[i] != NULL; i++) {
+		l = strlen(backends[i]->scheme);
+		if (strncmp(device, backends[i]->scheme, l) == 0) {
+			device += l;
+			if (strncmp(device, "//", 2) == 0 && backends[i]->polled)
+				device += 2;
+			*path = device;
+			return backends[i];
+		}
+	}
+
+	*path = device;
+	return &tty_ops;
+}
+
+const char *comm_node(const char *device) {
+
+	const commops *ops;
+	const char *path;
+
+	ops = backend(device, &path);
+	return (ops == &tcp_ops || ops == &rfc2217_ops || ops == &replay_ops) ? NULL : path;
+}
+
+/* capture */
+
+static void cap_record(hcomm *h, int type, void *data, int len) {
+
+	struct timeval tv;
+	unsigned char hdr[CAP_HDRLEN];
+	long long t;
+	unsigned long dt;
+	int l;
+
+	gettimeofday(&tv, NULL);
+	t = (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+	dt = (h->capt != 0 && t > h->capt) ? t - h->capt : 0;
+	h->capt = t;
+
+	do {
+		l = (len > 0xffff) ? 0xffff : len;
+		hdr[0] = type;
+		hdr[1] = dt;
+		hdr[2] = dt >> 8;
+		hdr[3] = dt >> 16;
+		hdr[4] = dt >> 24;
+		hdr[5] = l;
+		hdr[6] = l >> 8;
+		fwrite(hdr, 1, CAP_HDRLEN, h->cap);
+		fwrite(data, 1, l, h->cap);
+		data = (char *)data + l;
+		len -= l;
+		dt = 0;
+	} while (len > 0);
+}
+
+#define CAPTURE(h, type, data, len) \
+	do { if ((h)->cap != NULL) cap_record((h), (type), (data), (len)); } while (0)
+
 hcomm *comm_open(char *device) {
 
 	hcomm *h;
-	int fd;
-	struct termios tio;
-	
-	fd = open(device, O_RDWR | O_NOCTTY | O_EXCL);
-	if (fd < 0) return NULL;
+	const char *path;
 
 	h = (hcomm *)malloc(sizeof(hcomm));
+	h->ops = backend(device, &path);
 	h->device = strdup(device);
-	h->fd = fd;
+	h->path = strdup(path);
 	h->speed = DEFSPEED;
 	h->timeout = DEFTIMEOUT;
+	h->nonblock = 0;
+	h->tstate = TN_DATA;
+	h->fault = NULL;
+	h->cap = NULL;
+	h->capt = 0;
+	h->priv = NULL;
+	h->fd = -1;
+
+	/* a backend failing half way may have its fd open, as in
+	   comm_restore() */
+	if (h->ops->open(h) != 0) {
+		if (h->fd >= 0) close(h->fd);
+		if (h->ops->destroy != NULL) h->ops->destroy(h);
+		free(h->device);
+		free(h->path);
+		free(h);
+		return NULL;
+	}
+
+	if (getenv("SIEFS_FAULT") != NULL &&
+		comm_fault(h, getenv("SIEFS_FAULT")) != 0)
+	{
+		comm_close(h);
+		return NULL;
+	}
+
+	if (getenv("SIEFS_CAPTURE") != NULL) {
+		h->cap = fopen(getenv("SIEFS_CAPTURE"), "w");
+		if (h->cap == NULL) {
+			comm_close(h);
+			return NULL;
+		}
+		fwrite(CAP_MAGIC, 1, CAP_MAGICLEN, h->cap);
+		CAPTURE(h, CAP_OPEN, NULL, 0);
+	}
+
 	return h;
 
 }
@@ -67,17 +753,15 @@ int comm_getspeed(hcomm *h) {
 
 int comm_setspeed(hcomm *h, int speed) {
 
-	struct termios tio;
-	int i, f;
-	int fd = h->fd;
-
-	f = commflags(speed);
-	if (f == -1) return -1;
-	tcgetattr(fd, &tio);
-	tio.c_cflag = f;
-	if (tcsetattr(fd, TCSANOW, &tio) != 0)
+	if (commflags(speed) == -1)
+		return -1;
+	if (h->ops->setspeed(h, speed) != 0)
 		return -1;
 
+	if (h->cap != NULL) {
+		unsigned char v[4] = { speed, speed >> 8, speed >> 16, speed >> 24 };
+		CAPTURE(h, CAP_SPEED, v, 4);
+	}
 	h->speed = speed;
 	return 0;
 }
@@ -90,12 +774,7 @@ int comm_gettimeout(hcomm *h) {
 
 int comm_settimeout(hcomm *h, int timeout) {
 
-	struct termios tio;
-	int fd = h->fd;
-
-	tcgetattr(fd, &tio);
-	tio.c_cc[VTIME]    = timeout;
-	if (tcsetattr(fd, TCSANOW, &tio) != 0)
+	if (h->ops->settimeout(h, timeout) != 0)
 		return -1;
 
 	h->timeout = timeout;
@@ -104,43 +783,102 @@ int comm_settimeout(hcomm *h, int timeout) {
 
 int comm_restore(hcomm *h) {
 
-	struct termios tio;
-	int fd = h->fd;
-	int f;
-
-	if (fd >= 0) close(fd);
+	if (h->fd >= 0) h->ops->close(h);
 	h->fd = -1;
-	fd = open(h->device, O_RDWR | O_NOCTTY | O_EXCL);
-	if (fd < 0) return -1;
-	h->fd = fd;
-
-	bzero(&tio, sizeof(tio));
-	f = commflags(h->speed);
-	if (f == -1) return -1;
-	tio.c_cflag = f;
-	tio.c_iflag = IGNPAR | IGNBRK;
-	tio.c_oflag = 0;
-	tio.c_lflag = 0;
-	tio.c_cc[VTIME]  = h->timeout;
-	tio.c_cc[VMIN] = 0;
-
-	tcflush(fd, TCIOFLUSH);
-	if (tcsetattr(fd, TCSANOW, &tio) != 0)
+	h->nonblock = 0;
+	h->tstate = TN_DATA;
+	if (h->ops->open(h) != 0) {
+		if (h->fd >= 0) close(h->fd);
+		h->fd = -1;
 		return -1;
+	}
+	CAPTURE(h, CAP_OPEN, NULL, 0);
 
 	return 0;
 
 }
-	
+
+/* wait for input up to the timeout, for backends without VTIME */
+static int wait_input(hcomm *h) {
+
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = h->fd;
+	pfd.events = POLLIN;
+	do {
+		r = poll(&pfd, 1, h->timeout * 100);
+	} while (r < 0 && errno == EINTR);
+
+	return r;
+}
+
+/* single read through the fault shim */
+static int xread(hcomm *h, void *buf, int len, int *raw) {
+
+	int c;
+
+	c = h->ops->read(h, buf, len);
+	*raw = c;
+	if (c > 0 && h->fault != NULL)
+		c = fault_rx(h->fault, buf, c, len);
+	if (c > 0) {
+		stats_count(ST_BYTES_RX, c);
+		CAPTURE(h, CAP_RX, buf, c);
+	}
+
+	return c;
+}
+
+/* single write through the fault shim */
+static int xwrite(hcomm *h, void *buf, int len) {
+
+	unsigned char *tmp;
+	struct pollfd pfd;
+	int c, n, m = 0;
+
+	if (h->fault == NULL) {
+		c = h->ops->write(h, buf, len);
+		if (c > 0) {
+			stats_count(ST_BYTES_TX, c);
+			CAPTURE(h, CAP_TX, buf, c);
+		}
+		return c;
+	}
+	stats_count(ST_BYTES_TX, len);
+	CAPTURE(h, CAP_TX, buf, len);
+
+	/* the damaged copy goes out whole, the caller sees len done */
+	tmp = malloc(2 * len);
+	if (tmp == NULL) return -1;
+	n = fault_tx(h->fault, buf, len, tmp);
+	while (m < n) {
+		c = h->ops->write(h, tmp+m, n-m);
+		if (c < 0) {
+			free(tmp);
+			return -1;
+		}
+		if (c == 0) {
+			pfd.fd = h->fd;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, 1000);
+		}
+		m += c;
+	}
+	free(tmp);
+
+	return len;
+}
+
 int comm_rx(hcomm *h, void *buf, int len) {
 
-	int c, n=0;
-	int fd = h->fd;
+	int c, raw, n=0;
 
 	while (n < len){
-		c = read(fd, buf+n, len-n);
+		if (h->ops->polled && wait_input(h) <= 0) break;
+		c = xread(h, buf+n, len-n, &raw);
 		if (c < 0) return -1;
-		if (c == 0) break;
+		if (raw == 0 && ! h->ops->polled) break;
 		n += c;
 	}
 
@@ -150,10 +888,9 @@ int comm_rx(hcomm *h, void *buf, int len) {
 int comm_tx(hcomm *h, void *buf, int len) {
 
 	int c, n=0;
-	int fd = h->fd;
-	
+
 	while (n < len){
-		c = write(fd, buf+n, len-n);
+		c = xwrite(h, buf+n, len-n);
 		if (c < 0) return -1;
 		if (c == 0) break;
 		n += c;
@@ -176,7 +913,7 @@ int comm_printf(hcomm *h, const char *fmt, ...) {
 	n = comm_tx(h, buf, n);
 	free(buf);
 	return n;
-}	
+}
 
 int comm_getline(hcomm *h, char *buf, int size) {
 
@@ -192,14 +929,58 @@ int comm_getline(hcomm *h, char *buf, int size) {
 
 	return n;
 }
-	
+
+int comm_fd(hcomm *h) {
+
+	return h->fd;
+}
+
+int comm_setblocking(hcomm *h, int on) {
+
+	int f;
+
+	f = fcntl(h->fd, F_GETFL);
+	if (f < 0) return -1;
+	f = on ? (f & ~O_NONBLOCK) : (f | O_NONBLOCK);
+	h->nonblock = ! on;
+	return fcntl(h->fd, F_SETFL, f);
+}
+
+int comm_read(hcomm *h, void *buf, int len) {
+
+	int raw;
+
+	return xread(h, buf, len, &raw);
+}
+
+int comm_write(hcomm *h, void *buf, int len) {
+
+	return xwrite(h, buf, len);
+}
+
+int comm_fault(hcomm *h, const char *spec) {
+
+	fault *f = NULL;
+
+	if (spec != NULL) {
+		f = fault_parse(spec);
+		if (f == NULL) return -1;
+	}
+	if (h->fault != NULL) fault_free(h->fault);
+	h->fault = f;
+
+	return 0;
+}
+
 int comm_close(hcomm *h) {
 
-	tcsendbreak(h->fd, 0);
-	close(h->fd);
+	if (h->fd >= 0) h->ops->close(h);
+	if (h->ops->destroy != NULL) h->ops->destroy(h);
+	if (h->fault != NULL) fault_free(h->fault);
+	if (h->cap != NULL) fclose(h->cap);
 	free(h->device);
+	free(h->path);
 	free(h);
 	return 0;
 
 }
-
@@ -9,15 +9,72 @@
 #ifndef COMM_H
 #define COMM_H
 
+#include <stdio.h>
+
+struct _hcomm;
+struct _fault;
+
+/* a communication backend */
+typedef struct _commops {
+
+	const char *scheme;	/* device string prefix, eg. "tcp:" */
+	int polled;		/* no VTIME, timeouts are done with poll() */
+	int (*open)(struct _hcomm *h);		/* (re)open h->path into h->fd */
+	int (*setspeed)(struct _hcomm *h, int speed);
+	int (*settimeout)(struct _hcomm *h, int timeout);
+	/* single transfer: bytes done, 0 if nothing could be done now,
+	   -1 on error (a hangup is EIO) */
+	int (*read)(struct _hcomm *h, void *buf, int len);
+	int (*write)(struct _hcomm *h, void *buf, int len);
+	void (*close)(struct _hcomm *h);
+	void (*destroy)(struct _hcomm *h);	/* free priv, may be NULL */
+
+} commops;
+
 typedef struct _hcomm {
 
 	char *device;
+	char *path;		/* device without the scheme */
+	const commops *ops;
 	int fd;
 	int speed;
-	int timeout;
+	int timeout;		/* 1/10 s */
+	int nonblock;
+	int tstate;		/* telnet parser state (rfc2217) */
+	struct _fault *fault;	/* injected line errors, or NULL */
+	FILE *cap;		/* capture file, or NULL */
+	long long capt;		/* time of the last capture record, us */
+	void *priv;		/* backend state */
 
 } hcomm;
 
+/*
+ * Capture files: CAP_MAGIC, then records of
+ *   type (1 byte), microseconds since the previous record (4),
+ *   length (2), data
+ * all little endian. Data is as seen by the transport layer:
+ * received after and sent before any injected faults.
+ */
+#define CAP_MAGIC "SIECAP\0\1"
+#define CAP_MAGICLEN 8
+#define CAP_OPEN 'o'		/* device (re)opened */
+#define CAP_RX 'r'
+#define CAP_TX 't'
+#define CAP_SPEED 's'		/* data is the new speed, 4 bytes */
+#define CAP_HDRLEN 7
+
+/*
+ * Device strings:
+ *   /dev/ttyS0, tty:/dev/ttyS0	serial port
+ *   pty:/dev/pts/3			pseudo terminal (speed is ignored)
+ *   tcp:host:port			raw TCP, eg. ser2net
+ *   rfc2217:host:port		telnet com port control (RFC 2217)
+ *   unix:/path			Unix socket
+ *   replay:/path/to/capture	plays a capture back as the phone
+ *
+ * With SIEFS_CAPTURE set, comm_open() records the session to that
+ * file.
+ */
 hcomm *comm_open(char *device);
 int comm_restore(hcomm *h);
 int comm_setspeed(hcomm *h, int speed);
@@ -30,4 +87,28 @@ int comm_printf(hcomm *h, const char *fmt, ...);
 int comm_getline(hcomm *h, char *buf, int size);
 int comm_close(hcomm *h);
 
+/*
+ * File system node behind a device string (to watch for hotplug),
+ * NULL for network backends.
+ */
+const char *comm_node(const char *device);
+
+/*
+ * Damage the data passing through h as described by spec (see
+ * fault.h), NULL to stop. comm_open() takes the spec from the
+ * SIEFS_FAULT environment variable.
+ */
+int comm_fault(hcomm *h, const char *spec);
+
+/*
+ * For event driven users: comm_fd() returns a descriptor to wait
+ * on, comm_read()/comm_write() do a single transfer and return 0
+ * instead of blocking when the port is in non-blocking mode. A
+ * hangup makes comm_read() fail with EIO.
+ */
+int comm_fd(hcomm *h);
+int comm_setblocking(hcomm *h, int on);
+int comm_read(hcomm *h, void *buf, int len);
+int comm_write(hcomm *h, void *buf, int len);
+
 #endif
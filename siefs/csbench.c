@@ -0,0 +1,144 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* csbench.c - check and time the charset conversions */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "charset.h"
+
+#define NAMES 64
+
+static double now() {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* bytes whose conversion comes back the same */
+static int roundtrip(const charset *cs, int *defined) {
+
+	char src[2], utf[8], back[4];
+	int c, bad = 0;
+
+	*defined = 0;
+	for (c=0x80; c<0x100; c++) {
+		if (cs->c2u[c - 0x80] == 0) continue;
+		(*defined)++;
+		src[0] = c;
+		src[1] = '\0';
+		cs_to_utf(cs, src, utf, sizeof(utf) - 1);
+		cs_from_utf(cs, utf, back, sizeof(back) - 1);
+		if ((unsigned char)back[0] != c || back[1] != '\0') {
+			if (bad++ == 0)
+				fprintf(stderr, "%s: 0x%02x comes back as 0x%02x\n",
+					cs->name, c, (unsigned char)back[0]);
+		}
+	}
+
+	return bad;
+}
+
+/* local names like a phone has: mostly ascii, every k-th byte (if
+   k > 0) one of the charset's letters */
+static void names(const charset *cs, char local[NAMES][64], int k) {
+
+	static const char *base[] = {
+		"Pictures/DSC%05i.jpg", "Sounds/ring_%i.mid", "Misc/notes %i.txt",
+		"Video/clip%i.3gp"
+	};
+	int i, j, c = 0x80;
+
+	for (i=0; i<NAMES; i++) {
+		sprintf(local[i], base[i % 4], 1000 + i * 37);
+		for (j=0; k > 0 && cs->c2u != NULL && local[i][j] != '\0'; j++) {
+			if (j % k != k - 1) continue;
+			while (cs->c2u[(c - 0x80) & 0x7f] == 0) c++;
+			local[i][j] = 0x80 | ((c++ - 0x80) & 0x7f);
+		}
+	}
+}
+
+/* MB/s of converting names to utf-8 and back, n rounds */
+static void run(const charset *cs, int k, int n, double *to, double *from) {
+
+	char local[NAMES][64], utf[NAMES][256], back[256];
+	long bytes = 0;
+	double t;
+	int r, i;
+
+	names(cs, local, k);
+	for (i=0; i<NAMES; i++) {
+		cs_to_utf(cs, local[i], utf[i], 255);
+		bytes += strlen(local[i]);
+	}
+
+	t = now();
+	for (r=0; r<n; r++)
+		for (i=0; i<NAMES; i++)
+			cs_to_utf(cs, local[i], back, 255);
+	*to = bytes * (double)n / (now() - t) / 1e6;
+
+	t = now();
+	for (r=0; r<n; r++)
+		for (i=0; i<NAMES; i++)
+			cs_from_utf(cs, utf[i], back, 255);
+	*from = bytes * (double)n / (now() - t) / 1e6;
+}
+
+static void usage() {
+
+	fprintf(stderr, "Usage: csbench [-n rounds] [charset...]\n\n"
+		"Checks that every byte of the charsets (all by default) converts to\n"
+		"utf-8 and back, and prints the conversion speed in MB/s of local\n"
+		"names: all ascii, and with every 4th byte outside it.\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+
+	const charset *cs;
+	double ato, afrom, mto, mfrom;
+	int c, i, n = 20000, defined, bad, pages, r = 0;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+			case 'n': n = atoi(optarg); break;
+			default: usage();
+		}
+	}
+
+	printf("%-12s %6s %6s %8s %8s %8s %8s %6s\n", "charset", "chars", "table",
+		"ascii>u", "u>ascii", "mixed>u", "u>mixed", "bad");
+	for (i=0; charsets[i].name != NULL; i++) {
+		cs = &charsets[i];
+		if (optind < argc) {
+			for (c=optind; c<argc && charset_find(argv[c]) != cs; c++);
+			if (c == argc) continue;
+		}
+
+		bad = defined = pages = 0;
+		if (cs->c2u != NULL) {
+			bad = roundtrip(cs, &defined);
+			for (c=0; c<256; c++)
+				if (cs->u2c_hi[c] > pages) pages = cs->u2c_hi[c];
+		}
+		run(cs, 0, n, &ato, &afrom);
+		run(cs, 4, n, &mto, &mfrom);
+		printf("%-12s %6i %6i %8.0f %8.0f %8.0f %8.0f %6i\n", cs->name, defined,
+			cs->c2u ? 256 * (pages + 1) : 0, ato, afrom, mto, mfrom, bad);
+		r |= (bad != 0);
+	}
+
+	exit(r);
+}
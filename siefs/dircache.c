@@ -0,0 +1,457 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* directory listing cache with single-flight fetches */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include "dircache.h"
+#include "stats.h"
+
+/* find path and move it to the front, called with c->mx held */
+static dcentry *lookup(dircache *c, const char *path) {
+
+	dcentry **pp, *d;
+
+	for (pp = &c->head; *pp != NULL; pp = &(*pp)->next) {
+		d = *pp;
+		if (strcasecmp(d->path, path) == 0) {
+			*pp = d->next;
+			d->next = c->head;
+			c->head = d;
+			return d;
+		}
+	}
+
+	return NULL;
+}
+
+static void drop(dcentry *d) {
+
+	free(d->path);
+	free(d->list);
+	free(d->names);
+	free(d);
+}
+
+/* convert the names of a new listing of d, called with c->mx held;
+   pointers and strings share one block */
+static void localize(dircache *c, dcentry *d) {
+
+	char *s, buf[256];
+	int i, l = 0;
+
+	free(d->names);
+	d->names = NULL;
+	if (c->cs == NULL)
+		return;
+
+	for (i=0; i<d->size; i++)
+		l += strlen(cs_from_utf(c->cs, d->list[i].name, buf, sizeof(buf) - 1)) + 1;
+	d->names = (char **) malloc(d->size * sizeof(char *) + l + 1);
+	if (d->names == NULL)
+		return;
+	s = (char *) (d->names + d->size);
+	for (i=0; i<d->size; i++) {
+		d->names[i] = s;
+		s += strlen(cs_from_utf(c->cs, d->list[i].name, s, sizeof(buf) - 1)) + 1;
+	}
+}
+
+/* make room for a new entry, called with c->mx held;
+   returns 1 if an entry was dropped */
+static int evict(dircache *c) {
+
+	dcentry **pp, **victim = NULL;
+
+	if (c->count - c->pinned < c->max)
+		return 0;
+
+	/* least recently used one which nobody is fetching */
+	for (pp = &c->head; *pp != NULL; pp = &(*pp)->next) {
+		if (! (*pp)->fetching && ! (*pp)->pinned)
+			victim = pp;
+	}
+	if (victim != NULL) {
+		dcentry *d = *victim;
+		*victim = d->next;
+		drop(d);
+		c->count--;
+		return 1;
+	}
+
+	return 0;
+}
+
+dircache *dc_create(int max) {
+
+	dircache *c;
+
+	c = (dircache *) malloc(sizeof(dircache));
+	if (c == NULL) return NULL;
+	memset(c, 0, sizeof(dircache));
+	pthread_mutex_init(&c->mx, NULL);
+	pthread_cond_init(&c->cv, NULL);
+	c->max = (max > 0) ? max : 1;
+
+	return c;
+}
+
+void dc_destroy(dircache *c) {
+
+	dcentry *d;
+
+	while ((d = c->head) != NULL) {
+		c->head = d->next;
+		drop(d);
+	}
+	pthread_mutex_destroy(&c->mx);
+	pthread_cond_destroy(&c->cv);
+	free(c);
+}
+
+/* tell the change hook about entry o which is now n (NULL if
+   gone), called with c->mx held; returns 1 if it changed */
+static int changed(dircache *c, dcentry *d, obexdirentry *o, obexdirentry *n) {
+
+	if (n != NULL && n->isdir == o->isdir && n->size == o->size && n->mtime == o->mtime)
+		return 0;
+	if (c->changed != NULL)
+		c->changed(d->path, o->name, n == NULL || n->isdir != o->isdir, c->charg);
+	return 1;
+}
+
+/* compare the listing of d with a new one */
+static void compare(dircache *c, dcentry *d, obexdirentry *list, int size) {
+
+	int i, j;
+
+	for (i=0; i<d->size; i++) {
+		for (j=0; j<size; j++) {
+			if (strcasecmp(d->list[i].name, list[j].name) == 0)
+				break;
+		}
+		changed(c, d, &d->list[i], (j < size) ? &list[j] : NULL);
+	}
+}
+
+dcentry *dc_get(dircache *c, const char *path, int ttl, dc_fetch fetch, void *arg) {
+
+	dcentry *d;
+	obexdirentry *list = NULL;
+	int size = 0, r, er, gen, waited = 0;
+
+	pthread_mutex_lock(&c->mx);
+	while (1) {
+		d = lookup(c, path);
+		if (d == NULL) break;
+		if (d->fetching) {
+			pthread_cond_wait(&c->cv, &c->mx);
+			waited = 1;
+			continue;
+		}
+		if (waited) {
+			/* somebody fetched it for us, take it as it is */
+			stats_count(ST_DC_SHARED, 1);
+			if (d->error == 0) return d;
+			errno = d->error;
+			pthread_mutex_unlock(&c->mx);
+			return NULL;
+		}
+		if (d->time != 0 && (d->pinned || time(NULL) - d->time < ttl)) {
+			stats_count(ST_DC_HITS, 1);
+			return d;
+		}
+		if (d->time != 0 && d->fetched && c->revalidate != NULL) {
+			/* expired, but not known to be wrong: serve it */
+			stats_count(ST_DC_STALE, 1);
+			if (! d->refreshing) {
+				d->refreshing = 1;
+				c->revalidate(d->path, c->gen, c->rvarg);
+			}
+			return d;
+		}
+		break;
+	}
+
+	if (d == NULL) {
+		evict(c);
+		d = (dcentry *) malloc(sizeof(dcentry));
+		memset(d, 0, sizeof(dcentry));
+		d->path = strdup(path);
+		d->next = c->head;
+		c->head = d;
+		c->count++;
+	}
+	stats_count(ST_DC_MISSES, 1);
+	d->fetching = 1;
+	gen = c->gen;
+	pthread_mutex_unlock(&c->mx);
+
+	r = fetch(path, &list, &size, arg);
+	er = errno;
+
+	pthread_mutex_lock(&c->mx);
+	d->fetching = 0;
+	if (r < 0) {
+		d->error = er ? er : EIO;
+		d->time = 0;
+	} else {
+		if (d->fetched && c->changed != NULL)
+			compare(c, d, list, size);
+		free(d->list);
+		d->list = list;
+		d->size = size;
+		localize(c, d);
+		d->error = 0;
+		d->fetched = 1;
+		d->time = (gen == c->gen) ? time(NULL) : 0;
+	}
+	pthread_cond_broadcast(&c->cv);
+
+	if (r < 0) {
+		pthread_mutex_unlock(&c->mx);
+		errno = er;
+		return NULL;
+	}
+
+	return d;
+}
+
+void dc_background(dircache *c, dc_revalidate fn, void *arg) {
+
+	pthread_mutex_lock(&c->mx);
+	c->revalidate = fn;
+	c->rvarg = arg;
+	pthread_mutex_unlock(&c->mx);
+}
+
+void dc_charset(dircache *c, const charset *cs) {
+
+	pthread_mutex_lock(&c->mx);
+	c->cs = cs;
+	pthread_mutex_unlock(&c->mx);
+}
+
+void dc_notify(dircache *c, dc_changed fn, void *arg) {
+
+	pthread_mutex_lock(&c->mx);
+	c->changed = fn;
+	c->charg = arg;
+	pthread_mutex_unlock(&c->mx);
+}
+
+/* merge a fresh listing into d, called with c->mx held */
+static int merge(dircache *c, dcentry *d, obexdirentry *list, int size) {
+
+	obexdirentry *m, *o, *n;
+	char *used;
+	int i, j, count = 0, changes = 0;
+
+	m = (obexdirentry *) malloc((size ? size : 1) * sizeof(obexdirentry));
+	used = (char *) calloc(size ? size : 1, 1);
+
+	/* known entries first, in their old order */
+	for (i=0; i<d->size; i++) {
+		o = &d->list[i];
+		for (j=0; j<size; j++) {
+			if (! used[j] && strcasecmp(o->name, list[j].name) == 0)
+				break;
+		}
+		if (j == size) {
+			changes += changed(c, d, o, NULL);	/* removed */
+			continue;
+		}
+		n = &list[j];
+		used[j] = 1;
+		changes += changed(c, d, o, n);
+		m[count++] = *n;
+	}
+
+	for (j=0; j<size; j++) {
+		if (! used[j]) {
+			changes++;		/* new */
+			m[count++] = list[j];
+		}
+	}
+
+	free(used);
+	free(d->list);
+	d->list = m;
+	d->size = count;
+	localize(c, d);
+
+	return changes;
+}
+
+int dc_update(dircache *c, const char *path, int gen, obexdirentry *list, int size) {
+
+	dcentry *d;
+	int r = -1;
+
+	pthread_mutex_lock(&c->mx);
+	d = lookup(c, path);
+	if (d != NULL) {
+		d->refreshing = 0;
+		if (list != NULL && ! d->fetching) {
+			r = merge(c, d, list, size);
+			d->error = 0;
+			/* stay invalid if something changed meanwhile */
+			if (d->time != 0 && gen == c->gen)
+				d->time = time(NULL);
+		}
+	}
+	pthread_mutex_unlock(&c->mx);
+	free(list);
+
+	return r;
+}
+
+dcentry *dc_peek(dircache *c, const char *path) {
+
+	dcentry *d;
+
+	pthread_mutex_lock(&c->mx);
+	d = lookup(c, path);
+	if (d == NULL)
+		pthread_mutex_unlock(&c->mx);
+
+	return d;
+}
+
+void dc_unlock(dircache *c) {
+
+	pthread_mutex_unlock(&c->mx);
+}
+
+obexdirentry *dc_find(dcentry *d, const char *name) {
+
+	int i;
+
+	for (i=0; i<d->size; i++) {
+		if (strcasecmp(name, d->list[i].name) == 0)
+			return &d->list[i];
+	}
+
+	return NULL;
+}
+
+int dc_isdir(dircache *c, const char *path) {
+
+	dcentry *d;
+	int l, r = 0;
+
+	l = strlen(path);
+	pthread_mutex_lock(&c->mx);
+	for (d = c->head; d != NULL; d = d->next) {
+		if (d->time != 0 && strncasecmp(d->path, path, l) == 0 &&
+			(d->path[l] == '\0' || d->path[l] == '/'))
+		{
+			r = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&c->mx);
+
+	return r;
+}
+
+int dc_pin(dircache *c, const char *path, int pin) {
+
+	dcentry *d;
+
+	pthread_mutex_lock(&c->mx);
+	d = lookup(c, path);
+	if (d == NULL) {
+		pthread_mutex_unlock(&c->mx);
+		errno = ENOENT;
+		return -1;
+	}
+	if (pin && ! d->pinned) c->pinned++;
+	if (! pin && d->pinned) c->pinned--;
+	d->pinned = pin;
+	while (c->count - c->pinned > c->max && evict(c));
+	pthread_mutex_unlock(&c->mx);
+
+	return 0;
+}
+
+char *dc_pinned(dircache *c) {
+
+	dcentry *d;
+	char *s;
+	int l = 1;
+
+	pthread_mutex_lock(&c->mx);
+	for (d = c->head; d != NULL; d = d->next) {
+		if (d->pinned) l += strlen(d->path) + 1;
+	}
+	s = (char *) malloc(l);
+	s[0] = '\0';
+	for (d = c->head; d != NULL; d = d->next) {
+		if (d->pinned) {
+			strcat(s, d->path);
+			strcat(s, "\n");
+		}
+	}
+	pthread_mutex_unlock(&c->mx);
+
+	return s;
+}
+
+void dc_resize(dircache *c, int max) {
+
+	pthread_mutex_lock(&c->mx);
+	c->max = (max > 0) ? max : 1;
+	while (c->count - c->pinned > c->max && evict(c));
+	pthread_mutex_unlock(&c->mx);
+}
+
+void dc_invalidate(dircache *c, const char *path) {
+
+	dcentry *d;
+
+	pthread_mutex_lock(&c->mx);
+	c->gen++;
+	for (d = c->head; d != NULL; d = d->next) {
+		if (path == NULL || strcasecmp(d->path, path) == 0)
+			d->time = 0;
+	}
+	pthread_mutex_unlock(&c->mx);
+}
+
+void dc_forget(dircache *c, const char *dir, const char *name) {
+
+	dcentry *d;
+	int i, l;
+
+	l = strlen(dir);
+	if (l == 1) l = 0;	/* the root */
+	pthread_mutex_lock(&c->mx);
+	c->gen++;
+	for (d = c->head; d != NULL; d = d->next) {
+		if (strcasecmp(d->path, dir) == 0) {
+			for (i=0; i<d->size; i++)
+				if (strcasecmp(name, d->list[i].name) == 0) break;
+			if (i == d->size) continue;
+			d->size--;
+			memmove(&d->list[i], &d->list[i+1], (d->size - i) * sizeof(obexdirentry));
+			if (d->names != NULL)
+				memmove(&d->names[i], &d->names[i+1], (d->size - i) * sizeof(char *));
+		} else if (strncasecmp(d->path, dir, l) == 0 && d->path[l] == '/' &&
+			strncasecmp(d->path + l + 1, name, strlen(name)) == 0 &&
+			(d->path[l + 1 + strlen(name)] == '\0' || d->path[l + 1 + strlen(name)] == '/'))
+		{
+			d->time = 0;
+		}
+	}
+	pthread_mutex_unlock(&c->mx);
+}
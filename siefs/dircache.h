@@ -0,0 +1,185 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <time.h>
+#include <pthread.h>
+#include "obex.h"
+#include "charset.h"
+
+/*
+ * Fetch a directory listing into a malloc'ed array. Called without
+ * the cache lock held. Returns -1 and sets errno on error.
+ */
+typedef int (*dc_fetch)(const char *path, obexdirentry **list, int *size, void *arg);
+
+/*
+ * Queue a background refresh of path, which must end with a call
+ * to dc_update(c, path, gen, ...). Called with the cache locked,
+ * so it must not block.
+ */
+typedef void (*dc_revalidate)(const char *path, int gen, void *arg);
+
+/*
+ * Report that name in dir differs in a new listing: gone is set
+ * if it was removed or changed between file and directory, else
+ * its size or time changed. Called with the cache locked.
+ */
+typedef void (*dc_changed)(const char *dir, const char *name, int gone, void *arg);
+
+typedef struct _dcentry {
+
+	char *path;
+	obexdirentry *list;
+	int size;
+	char **names;		/* of list, in the local charset; NULL if same */
+	time_t time;		/* when fetched, 0 if invalid */
+	int fetching;		/* a listing is on its way */
+	int refreshing;		/* a background refresh is queued */
+	int fetched;		/* list holds a real listing */
+	int error;		/* errno of the last fetch, 0 if ok */
+	int pinned;		/* never evicted, never expires */
+	struct _dcentry *next;
+
+} dcentry;
+
+typedef struct _dircache {
+
+	pthread_mutex_t mx;
+	pthread_cond_t cv;	/* broadcast when a fetch is finished */
+	dcentry *head;		/* most recently used first */
+	int count;
+	int max;		/* not counting pinned entries */
+	int pinned;
+	int gen;		/* bumped by dc_invalidate() */
+	dc_revalidate revalidate;
+	void *rvarg;
+	dc_changed changed;
+	void *charg;
+	const charset *cs;	/* of the local names, NULL if utf-8 */
+
+} dircache;
+
+/*
+ * Create a cache for up to max directories.
+ */
+dircache *dc_create(int max);
+void dc_destroy(dircache *c);
+
+
+/*
+ * Serve expired listings as they are and refresh them with fn
+ * (stale-while-revalidate). Listings marked out of date by
+ * dc_invalidate() are still fetched synchronously.
+ */
+void dc_background(dircache *c, dc_revalidate fn, void *arg);
+
+
+/*
+ * Call fn for every entry which a fetch or a refresh finds
+ * different from the listing it replaces.
+ */
+void dc_notify(dircache *c, dc_changed fn, void *arg);
+
+
+/*
+ * Keep the names of the listed entries converted to cs too, see
+ * dc_name(). Must be set before the first listing.
+ */
+void dc_charset(dircache *c, const charset *cs);
+
+
+/*
+ * Name of entry i of d in the local charset.
+ */
+#define dc_name(d, i) ((d)->names ? (d)->names[i] : (d)->list[i].name)
+
+
+/*
+ * Get the listing of path, calling fetch() if it isn't cached or
+ * is older than ttl seconds. Concurrent callers missing on the
+ * same path wait for a single fetch and share its result.
+ * Returns the entry with the cache locked (see dc_unlock()), or
+ * NULL with errno set.
+ */
+dcentry *dc_get(dircache *c, const char *path, int ttl, dc_fetch fetch, void *arg);
+
+
+/*
+ * Apply a background refresh result: entries keep their order,
+ * new ones are appended. list is taken over; NULL means the
+ * refresh failed. gen is the one passed to the revalidate hook.
+ * Returns the number of new, removed and changed entries, -1 if
+ * path is no longer cached.
+ */
+int dc_update(dircache *c, const char *path, int gen, obexdirentry *list, int size);
+
+
+/*
+ * Look up path without fetching, regardless of age. Returns the
+ * entry with the cache locked, or NULL.
+ */
+dcentry *dc_peek(dircache *c, const char *path);
+
+
+/*
+ * Release the lock taken by dc_get()/dc_peek().
+ */
+void dc_unlock(dircache *c);
+
+
+/*
+ * Find name in a listing, case insensitively.
+ */
+obexdirentry *dc_find(dcentry *d, const char *name);
+
+
+/*
+ * True if path is a cached directory or a parent of one.
+ */
+int dc_isdir(dircache *c, const char *path);
+
+
+/*
+ * Pin (pin=1) or unpin a cached directory. A pinned listing is
+ * never evicted and doesn't expire; only dc_invalidate() makes it
+ * fetched again. Returns -1 with errno ENOENT if path isn't cached.
+ */
+int dc_pin(dircache *c, const char *path, int pin);
+
+
+/*
+ * Paths of the pinned directories, one per line, malloc'ed.
+ */
+char *dc_pinned(dircache *c);
+
+
+/*
+ * Change the number of directories kept, evicting if needed.
+ */
+void dc_resize(dircache *c, int max);
+
+
+/*
+ * Mark path (all directories if NULL) out of date. A fetch
+ * already in progress still wakes up its waiters, but its result
+ * isn't reused after that.
+ */
+void dc_invalidate(dircache *c, const char *path);
+
+
+/*
+ * Take name out of the cached listing of dir after it was deleted
+ * here, so the listing needn't be fetched again, and mark what was
+ * cached below it out of date.
+ */
+void dc_forget(dircache *c, const char *dir, const char *name);
+
+#endif
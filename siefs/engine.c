@@ -0,0 +1,578 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* event driven bfb/obex engine */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include "comm.h"
+#include "transport.h"
+#include "engine.h"
+#include "stats.h"
+#include "trace.h"
+
+#define ACKSEQ "\x16\x02\x14\x01\xfe"
+#define ACKLEN 5
+#define BLKMAX 0x20
+#define RETRIES 3
+#define QUIET 200	/* ms of silence that ends a flush */
+
+#define ENG_IDLE 0
+#define ENG_TX 1	/* writing our frame */
+#define ENG_ACK 2	/* waiting for the phone to ack it */
+#define ENG_RX 3	/* receiving a frame */
+#define ENG_TXACK 4	/* acking the received frame */
+#define ENG_DRAIN 5	/* discarding input until the line is quiet */
+#define ENG_DONE 6
+
+//#define DBG(x...) fprintf(stderr, x);
+#define DBG(x...)
+
+static long long now_ms() {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void touch(eng_req *r) {
+
+	r->deadline = now_ms() + r->b->timeout * 100;
+}
+
+static void watch(engine *e, eng_req *r, int out) {
+
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+	ev.data.ptr = r;
+	epoll_ctl(e->epfd, EPOLL_CTL_MOD, comm_fd(r->b->h), &ev);
+}
+
+static void complete(engine *e, eng_req *r, int result, int error) {
+
+	eng_req **pp;
+
+	DBG("eng: done %i\n", result);
+	for (pp = &e->active; *pp != NULL; pp = &(*pp)->link) {
+		if (*pp == r) {
+			*pp = r->link;
+			break;
+		}
+	}
+	epoll_ctl(e->epfd, EPOLL_CTL_DEL, comm_fd(r->b->h), NULL);
+	comm_setblocking(r->b->h, 1);
+	r->b->active = NULL;
+	if (result >= 0 && r->tfail != 0)
+		r->b->retry_ms += now_ms() - r->tfail;
+	if (result >= 0)
+		stats_time(ST_EXCHANGE, stats_now() - r->tstart);
+	TRACE(TR_EXCHANGE, r->attempt, NULL, r->reqlen, result, stats_now() - r->tstart);
+
+	r->state = ENG_DONE;
+	r->result = result;
+	r->error = error;
+	if (r->done) r->done(r);
+}
+
+static void drain(eng_req *r, int next) {
+
+	DBG("eng: flush\n");
+	r->state = ENG_DRAIN;
+	r->next = next;
+	r->hdrlen = 0;
+	r->fpos = 0;
+	r->deadline = now_ms() + QUIET;
+}
+
+static void start_rx(eng_req *r) {
+
+	r->state = ENG_RX;
+	r->hdrlen = 0;
+	r->fpos = 0;
+	touch(r);
+}
+
+static void flush_out(engine *e, eng_req *r) {
+
+	int n;
+
+	while (r->outpos < r->outlen) {
+		n = comm_write(r->b->h, r->out + r->outpos, r->outlen - r->outpos);
+		if (n < 0) {
+			complete(e, r, -1, EIO);
+			return;
+		}
+		if (n == 0) {
+			watch(e, r, 1);
+			return;
+		}
+		r->outpos += n;
+	}
+	watch(e, r, 0);
+
+	if (r->state == ENG_TX) {
+		if (r->b->linktype != LINK_QWE3) {
+			r->state = ENG_ACK;
+			r->hdrlen = 0;
+			touch(r);
+		} else if (r->resp) {
+			start_rx(r);
+		} else {
+			complete(e, r, r->reqlen, 0);
+		}
+	} else if (r->state == ENG_TXACK) {
+		if (r->dup)
+			start_rx(r);
+		else
+			complete(e, r, r->flen - 7, 0);
+	}
+}
+
+/* something went wrong (why is one of TR_CRC...): flush the line
+   and try again */
+static void retry(engine *e, eng_req *r, int why) {
+
+	r->b->retries++;
+	stats_count(ST_RETRIES, 1);
+	TRACE(TR_RETRY, why, NULL, r->attempt, r->state, 0);
+	if (r->tfail == 0) r->tfail = now_ms();
+	if (++r->attempt >= RETRIES) {
+		DBG("eng: failed\n");
+		complete(e, r, -1, EIO);
+		return;
+	}
+	DBG(" --- trying %i time...\n", r->attempt+1);
+	drain(r, (r->state == ENG_ACK || r->state == ENG_TX) ? ENG_TX : ENG_RX);
+}
+
+static void resume(engine *e, eng_req *r) {
+
+	if (r->next == ENG_TX) {
+		/* re-ack whatever the phone sent last, then repeat our frame */
+		r->state = ENG_TX;
+		r->outpos = 0;
+		touch(r);
+		flush_out(e, r);
+	} else {
+		start_rx(r);
+	}
+}
+
+static void frame(engine *e, eng_req *r) {
+
+	tra_connection *b = r->b;
+	unsigned char *ws = b->buffer;
+	int len = r->flen - 7;
+	unsigned short csum;
+
+	csum = ws[r->flen-2] | (ws[r->flen-1] << 8);
+	if (csum != crc16(ws+2, len+3)) {
+		DBG("CRC error\n");
+		stats_count(ST_CRC_ERRORS, 1);
+		retry(e, r, TR_CRC);
+		return;
+	}
+
+	if (ws[2] == b->iseq) {
+		/* it's previous block, just reacknowledge it */
+		DBG("reack prev\n");
+		stats_count(ST_FRAMES_DUP, 1);
+		r->dup = 1;
+		r->attempt = 0;
+	} else {
+		b->iseq = ws[2];
+		stats_count(ST_FRAMES_RX, 1);
+		r->dup = 0;
+		memcpy(r->resp, ws+5, len);
+	}
+
+	r->state = ENG_TXACK;
+	r->out = (unsigned char *)ACKSEQ;
+	r->outlen = ACKLEN;
+	r->outpos = 0;
+	touch(r);
+	flush_out(e, r);
+}
+
+static void block(engine *e, eng_req *r) {
+
+	tra_connection *b = r->b;
+	unsigned char *d = r->blk;
+	int l = r->blkwant;
+
+	if (r->state == ENG_ACK) {
+		if (l != 2 || d[0] != 0x01 || d[1] != 0xfe) {
+			DBG("waitack: garbage\n");
+			retry(e, r, TR_NOACK);
+		} else if (r->resp) {
+			DBG("<ack\n");
+			r->attempt = 0;
+			start_rx(r);
+		} else {
+			DBG("<ack\n");
+			complete(e, r, r->reqlen, 0);
+		}
+		return;
+	}
+
+	if (r->fpos == 0) {
+		if (d[0] == 0x01)
+			return;		/* stray ack */
+		if (l < 5 || (d[0] | 1) != 0x03 || (d[0] ^ d[1]) != 0xff) {
+			retry(e, r, TR_GARBAGE);
+			return;
+		}
+		r->flen = (d[3] << 8) + d[4];
+		if (r->flen > r->respsize) {
+			DBG("too small buffer size\n");
+			complete(e, r, -1, EMSGSIZE);
+			return;
+		}
+		r->flen += 7;
+		if (b->buflen < r->flen+16) {
+			free(b->buffer);
+			b->buffer = malloc(b->buflen = r->flen+32);
+		}
+	}
+
+	if (r->fpos + l > r->flen) {
+		retry(e, r, TR_GARBAGE);
+		return;
+	}
+	memcpy(b->buffer + r->fpos, d, l);
+	r->fpos += l;
+	if (r->fpos == r->flen)
+		frame(e, r);
+}
+
+static void feed_bfb(engine *e, eng_req *r, unsigned char *s, int n) {
+
+	int l;
+
+	while (n > 0 && (r->state == ENG_ACK || r->state == ENG_RX)) {
+		if (r->hdrlen < 3) {
+			r->hdr[r->hdrlen++] = *(s++);
+			n--;
+			if (r->hdrlen == 3) {
+				l = r->hdr[1];
+				if (r->hdr[0] != 0x16 || l < 1 || l > BLKMAX ||
+					(l ^ 0x16) != r->hdr[2])
+				{
+					retry(e, r, TR_GARBAGE);
+					return;
+				}
+				r->blkwant = l;
+				r->blklen = 0;
+			}
+			continue;
+		}
+
+		l = r->blkwant - r->blklen;
+		if (l > n) l = n;
+		memcpy(r->blk + r->blklen, s, l);
+		r->blklen += l;
+		s += l;
+		n -= l;
+		if (r->blklen == r->blkwant) {
+			DBG("rx%i ", r->blkwant);
+			r->hdrlen = 0;
+			block(e, r);
+		}
+	}
+}
+
+static void feed_qwe(engine *e, eng_req *r, unsigned char *s, int n) {
+
+	unsigned char *p = r->resp;
+	int l;
+
+	if (r->state != ENG_RX)
+		return;
+
+	while (n > 0) {
+		l = (r->fpos < 3) ? 3 - r->fpos : r->flen - r->fpos;
+		if (l > n) l = n;
+		memcpy(p + r->fpos, s, l);
+		r->fpos += l;
+		s += l;
+		n -= l;
+
+		if (r->fpos == 3) {
+			r->flen = (p[1] << 8) + p[2];
+			if (r->flen > r->respsize || r->flen < 3) {
+				complete(e, r, -1, EMSGSIZE);
+				return;
+			}
+		}
+		if (r->fpos >= 3 && r->fpos == r->flen) {
+			complete(e, r, r->flen, 0);
+			return;
+		}
+	}
+}
+
+static void input(engine *e, eng_req *r) {
+
+	unsigned char buf[256];
+	int n, want;
+
+	while (r->state == ENG_ACK || r->state == ENG_RX || r->state == ENG_DRAIN) {
+		/* the response may follow the ack immediately; don't
+		   swallow it when the request ends with the ack */
+		want = sizeof(buf);
+		if (r->state == ENG_ACK && r->b->linktype != LINK_QWE3)
+			want = (r->hdrlen < 3) ? 3 - r->hdrlen : r->blkwant - r->blklen;
+		n = comm_read(r->b->h, buf, want);
+		if (n < 0) {
+			complete(e, r, -1, EIO);
+			return;
+		}
+		if (n == 0)
+			return;
+
+		if (r->state == ENG_DRAIN) {
+			r->deadline = now_ms() + QUIET;
+			continue;
+		}
+		touch(r);
+		if (r->b->linktype == LINK_QWE3)
+			feed_qwe(e, r, buf, n);
+		else
+			feed_bfb(e, r, buf, n);
+	}
+}
+
+static void expire(engine *e, eng_req *r) {
+
+	if (r->state != ENG_DRAIN)
+		stats_count(ST_TIMEOUTS, 1);
+
+	switch (r->state) {
+
+		case ENG_DRAIN:
+			resume(e, r);
+			break;
+
+		case ENG_ACK:
+			DBG("waitack: got no ack\n");
+			/* fall through */
+		case ENG_RX:
+			if (r->b->linktype == LINK_QWE3)
+				complete(e, r, -1, ETIMEDOUT);
+			else
+				retry(e, r, (r->state == ENG_ACK) ? TR_NOACK : TR_TIMEOUT);
+			break;
+
+		default:
+			complete(e, r, -1, ETIMEDOUT);
+			break;
+	}
+}
+
+/* turn the request into bytes on the wire */
+static int build(eng_req *r) {
+
+	tra_connection *b = r->b;
+	unsigned char *ws, *o, *p;
+	unsigned short csum;
+	int len, n, l;
+
+	if (r->req == NULL) {
+		r->outlen = r->outpos = 0;
+		return 0;
+	}
+
+	if (b->linktype == LINK_QWE3) {
+		r->out = r->req;
+		r->outlen = r->reqlen;
+		r->outpos = 0;
+		return 0;
+	}
+
+	len = r->reqlen;
+	if (b->buflen < len+16) {
+		free(b->buffer);
+		b->buffer = malloc(b->buflen = len+32);
+	}
+	ws = b->buffer;
+	ws[0] = (b->seq == 0) ? 0x02 : 0x03;
+	ws[1] = ~ws[0];
+	ws[2] = (b->seq)++;
+	ws[3] = (unsigned char) (len >> 8);
+	ws[4] = (unsigned char) (len & 0xff);
+	memcpy(ws+5, r->req, len);
+	csum = crc16(ws+2, len+3);
+	ws[5+len] = (unsigned char) (csum & 0xff);
+	ws[5+len+1] = (unsigned char) (csum >> 8);
+
+	/* ack + frame split into blocks; a retry sends it from the start */
+	n = ACKLEN + len + 7 + 3 * ((len + 7 + BLKMAX - 1) / BLKMAX);
+	if (b->obuflen < n) {
+		free(b->obuf);
+		b->obuf = malloc(b->obuflen = n);
+		if (b->obuf == NULL) {
+			b->obuflen = 0;
+			return -1;
+		}
+	}
+
+	o = b->obuf;
+	memcpy(o, ACKSEQ, ACKLEN);
+	o += ACKLEN;
+	p = ws;
+	n = len + 7;
+	while (n > 0) {
+		l = (n > BLKMAX) ? BLKMAX : n;
+		*(o++) = 0x16;
+		*(o++) = l;
+		*(o++) = 0x16 ^ l;
+		memcpy(o, p, l);
+		o += l;
+		p += l;
+		n -= l;
+	}
+
+	r->out = b->obuf;
+	r->outlen = o - b->obuf;
+	r->outpos = ACKLEN;
+	return 0;
+}
+
+engine *eng_create(void) {
+
+	engine *e;
+
+	e = (engine *) malloc(sizeof(engine));
+	if (e == NULL) return NULL;
+	e->epfd = epoll_create(4);
+	if (e->epfd < 0) {
+		free(e);
+		return NULL;
+	}
+	e->active = NULL;
+
+	return e;
+}
+
+void eng_destroy(engine *e) {
+
+	while (e->active != NULL)
+		complete(e, e->active, -1, ECANCELED);
+	close(e->epfd);
+	free(e);
+}
+
+void eng_init(eng_req *r, tra_connection *b, void *req, int reqlen,
+	void *resp, int respsize) {
+
+	memset(r, 0, sizeof(eng_req));
+	r->b = b;
+	r->req = req;
+	r->reqlen = reqlen;
+	r->resp = resp;
+	r->respsize = respsize;
+}
+
+int eng_submit(engine *e, eng_req *r) {
+
+	struct epoll_event ev;
+
+	if (r->b->active != NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (build(r) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = r;
+	if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, comm_fd(r->b->h), &ev) < 0)
+		return -1;
+	comm_setblocking(r->b->h, 0);
+
+	r->b->active = r;
+	r->link = e->active;
+	e->active = r;
+	r->attempt = 0;
+	r->tfail = 0;
+	r->tstart = stats_now();
+	if (r->req != NULL)
+		stats_count(ST_FRAMES_TX, 1);
+	r->result = 0;
+	r->error = 0;
+	touch(r);
+
+	if (r->req != NULL) {
+		DBG("eng: send %i bytes\n", r->reqlen);
+		r->state = ENG_TX;
+		flush_out(e, r);
+	} else {
+		start_rx(r);
+	}
+
+	return 0;
+}
+
+int eng_run(engine *e, int maxwait) {
+
+	struct epoll_event ev[8];
+	eng_req *r, *rn;
+	long long t, wait;
+	int i, n, done = 0;
+
+	if (e->active == NULL)
+		return 0;
+
+	t = now_ms();
+	wait = maxwait;
+	for (r = e->active; r != NULL; r = r->link) {
+		if (wait < 0 || r->deadline - t < wait)
+			wait = (r->deadline > t) ? r->deadline - t : 0;
+	}
+
+	n = epoll_wait(e->epfd, ev, 8, (int)wait);
+	for (i=0; i<n; i++) {
+		r = ev[i].data.ptr;
+		if (r->state == ENG_DONE) continue;
+		if (ev[i].events & EPOLLOUT)
+			flush_out(e, r);
+		if (r->state != ENG_DONE && (ev[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)))
+			input(e, r);
+		if (r->state == ENG_DONE) done++;
+	}
+
+	t = now_ms();
+	for (r = e->active; r != NULL; r = rn) {
+		rn = r->link;
+		if (t >= r->deadline) {
+			expire(e, r);
+			if (r->state == ENG_DONE) done++;
+		}
+	}
+
+	return done;
+}
+
+int eng_wait(engine *e, eng_req *r) {
+
+	while (r->state != ENG_DONE)
+		eng_run(e, -1);
+
+	errno = r->error;
+	return r->result;
+}
@@ -0,0 +1,96 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "transport.h"
+
+typedef struct _eng_req {
+
+	/* filled in by the caller (see eng_init()) */
+	tra_connection *b;
+	void *req;		/* request, NULL to receive only */
+	int reqlen;
+	void *resp;		/* response buffer, NULL to send only */
+	int respsize;
+	void (*done)(struct _eng_req *r);
+	void *arg;
+
+	/* result: response length (request length for send only),
+	   or -1 with error set to errno value */
+	int result;
+	int error;
+
+	/* engine state */
+	int state;
+	int next;		/* state after draining input */
+	int attempt;
+	int dup;		/* got a repeated frame, ack it again */
+	unsigned char *out;
+	int outlen, outpos;
+	unsigned char hdr[3];
+	int hdrlen;
+	unsigned char blk[32];
+	int blklen, blkwant;
+	int flen, fpos;
+	long long deadline;
+	long long tfail;	/* first error, 0 if none */
+	long long tstart;	/* submitted, us */
+	struct _eng_req *link;
+
+} eng_req;
+
+typedef struct _engine {
+
+	int epfd;
+	eng_req *active;
+
+} engine;
+
+
+/*
+ * Create/destroy an engine. An engine drives any number of
+ * connections (one request in flight on each) from the thread
+ * calling eng_run().
+ */
+engine *eng_create(void);
+void eng_destroy(engine *e);
+
+
+/*
+ * Prepare a request: send req (if not NULL), wait for the ack,
+ * then receive a frame into resp (if not NULL).
+ */
+void eng_init(eng_req *r, tra_connection *b, void *req, int reqlen,
+	void *resp, int respsize);
+
+
+/*
+ * Start a request. The first bytes are written immediately,
+ * the rest happens in eng_run(). Returns -1 if the connection
+ * is busy with another request.
+ */
+int eng_submit(engine *e, eng_req *r);
+
+
+/*
+ * Wait up to maxwait ms (-1 means until the next deadline) for
+ * link events and advance all requests. r->done is called for
+ * every request completed. Returns number of completed requests.
+ */
+int eng_run(engine *e, int maxwait);
+
+
+/*
+ * Run the engine until r is complete. Returns r->result and sets
+ * errno.
+ */
+int eng_wait(engine *e, eng_req *r);
+
+#endif
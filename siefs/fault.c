@@ -0,0 +1,233 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* fault injection for the serial link, for testing retry handling */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "fault.h"
+
+#define F_DROP 1
+#define F_CORRUPT 2
+#define F_DUP 3
+#define F_DELAY 4
+
+//#define DBG(x...) fprintf(stderr, x);
+#define DBG(x...)
+
+static double chance(fault *f) {
+
+	return rand_r(&f->rnd) / (RAND_MAX + 1.0);
+}
+
+static int hit(fault *f, double p) {
+
+	return p > 0 && chance(f) < p;
+}
+
+static int action(const char *s) {
+
+	if (strcmp(s, "drop") == 0) return F_DROP;
+	if (strcmp(s, "corrupt") == 0) return F_CORRUPT;
+	if (strcmp(s, "dup") == 0) return F_DUP;
+	if (strcmp(s, "delay") == 0) return F_DELAY;
+	return -1;
+}
+
+static int load_script(fault *f, const char *path) {
+
+	FILE *fp;
+	char line[128], dir[8], act[16];
+	faultstep *s, **tail = &f->script;
+	int ms, k;
+	long n;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) return -1;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#' || line[0] == '\n') continue;
+		ms = 0;
+		k = sscanf(line, "%7s %li %15s %i", dir, &n, act, &ms);
+		if (k < 3 || action(act) < 0 ||
+			(strcmp(dir, "rx") != 0 && strcmp(dir, "tx") != 0))
+		{
+			fclose(fp);
+			errno = EINVAL;
+			return -1;
+		}
+		s = (faultstep *) malloc(sizeof(faultstep));
+		s->dir = (dir[0] == 't') ? FAULT_TX : FAULT_RX;
+		s->n = n;
+		s->action = action(act);
+		s->ms = ms;
+		s->next = NULL;
+		*tail = s;
+		tail = &s->next;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+fault *fault_parse(const char *spec) {
+
+	fault *f;
+	char *buf, *p, *v, *save;
+	int r = 0;
+
+	f = (fault *) malloc(sizeof(fault));
+	memset(f, 0, sizeof(fault));
+	f->rnd = 1;
+	f->dirs = (1 << FAULT_RX) | (1 << FAULT_TX);
+
+	buf = strdup(spec);
+	for (p = strtok_r(buf, ":", &save); p != NULL && r == 0; p = strtok_r(NULL, ":", &save)) {
+		v = strchr(p, '=');
+		if (v == NULL) {
+			r = -1;
+			break;
+		}
+		*(v++) = '\0';
+		if (strcmp(p, "seed") == 0) f->rnd = strtoul(v, NULL, 0);
+		else if (strcmp(p, "drop") == 0) f->drop = atof(v);
+		else if (strcmp(p, "corrupt") == 0) f->corrupt = atof(v);
+		else if (strcmp(p, "dup") == 0) f->dup = atof(v);
+		else if (strcmp(p, "fdrop") == 0) f->fdrop = atof(v);
+		else if (strcmp(p, "fdup") == 0) f->fdup = atof(v);
+		else if (strcmp(p, "delay") == 0) {
+			f->delay = atof(v);
+			f->delayms = strchr(v, '@') ? atoi(strchr(v, '@') + 1) : 100;
+		}
+		else if (strcmp(p, "dir") == 0) {
+			if (strcmp(v, "rx") == 0) f->dirs = 1 << FAULT_RX;
+			else if (strcmp(v, "tx") == 0) f->dirs = 1 << FAULT_TX;
+			else if (strcmp(v, "both") != 0) r = -1;
+		}
+		else if (strcmp(p, "script") == 0) r = load_script(f, v);
+		else r = -1;
+	}
+	free(buf);
+
+	if (r != 0) {
+		if (errno != ENOENT) errno = EINVAL;
+		fault_free(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+void fault_free(fault *f) {
+
+	faultstep *s;
+
+	while ((s = f->script) != NULL) {
+		f->script = s->next;
+		free(s);
+	}
+	free(f);
+}
+
+/* scripted action for this transfer, 0 if none */
+static int scripted(fault *f, int dir, int *ms) {
+
+	faultstep *s;
+
+	for (s = f->script; s != NULL; s = s->next) {
+		if (s->dir == dir && s->n == f->count[dir]) {
+			*ms = s->ms;
+			return s->action;
+		}
+	}
+
+	return 0;
+}
+
+/* copy n bytes from src to dst (room for size, not overlapping src),
+   damaging them */
+static int damage(fault *f, int dir, const unsigned char *src, int n,
+	unsigned char *dst, int size) {
+
+	int i, m = 0, a, ms = 0;
+
+	f->count[dir]++;
+	a = scripted(f, dir, &ms);
+
+	if (! (f->dirs & (1 << dir)) && a == 0) {
+		memcpy(dst, src, n);
+		return n;
+	}
+
+	if (a == F_DELAY || (a == 0 && hit(f, f->delay))) {
+		DBG("fault: %s delay\n", dir ? "tx" : "rx");
+		f->injected++;
+		usleep((a ? ms : f->delayms) * 1000);
+	}
+	if (a == F_DROP || (a == 0 && hit(f, f->fdrop))) {
+		DBG("fault: %s frame drop\n", dir ? "tx" : "rx");
+		f->injected++;
+		return 0;
+	}
+	if (a == F_CORRUPT && n > 0) {
+		memcpy(dst, src, n);
+		dst[rand_r(&f->rnd) % n] ^= 1 << (rand_r(&f->rnd) % 8);
+		f->injected++;
+		return n;
+	}
+	if (a == F_DUP || (a == 0 && hit(f, f->fdup))) {
+		if (2 * n <= size) {
+			DBG("fault: %s frame dup\n", dir ? "tx" : "rx");
+			memcpy(dst, src, n);
+			memcpy(dst + n, src, n);
+			f->injected++;
+			return 2 * n;
+		}
+	}
+
+	for (i=0; i<n; i++) {
+		if (hit(f, f->drop)) {
+			f->injected++;
+			continue;
+		}
+		dst[m] = src[i];
+		if (hit(f, f->corrupt)) {
+			dst[m] ^= 1 << (rand_r(&f->rnd) % 8);
+			f->injected++;
+		}
+		m++;
+		if (m < size && hit(f, f->dup)) {
+			dst[m] = dst[m-1];
+			m++;
+			f->injected++;
+		}
+	}
+
+	return m;
+}
+
+int fault_rx(fault *f, unsigned char *buf, int n, int size) {
+
+	unsigned char *tmp;
+
+	tmp = malloc(n);
+	if (tmp == NULL) return n;
+	memcpy(tmp, buf, n);
+	n = damage(f, FAULT_RX, tmp, n, buf, size);
+	free(tmp);
+
+	return n;
+}
+
+int fault_tx(fault *f, const unsigned char *buf, int len, unsigned char *out) {
+
+	return damage(f, FAULT_TX, buf, len, out, 2 * len);
+}
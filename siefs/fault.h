@@ -0,0 +1,69 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#ifndef FAULT_H
+#define FAULT_H
+
+#define FAULT_RX 0
+#define FAULT_TX 1
+
+/* a scripted fault: act on the n-th transfer in one direction */
+typedef struct _faultstep {
+
+	int dir;
+	long n;
+	int action;
+	int ms;			/* delay */
+	struct _faultstep *next;
+
+} faultstep;
+
+typedef struct _fault {
+
+	unsigned int rnd;	/* random state, from seed= */
+	int dirs;		/* bit mask of directions to damage */
+	/* per byte probabilities */
+	double drop, corrupt, dup;
+	/* per transfer (a written frame or a read chunk) */
+	double fdrop, fdup, delay;
+	int delayms;
+	faultstep *script;
+	long count[2];		/* transfers seen */
+	long injected;		/* faults done */
+
+} fault;
+
+/*
+ * Parse a fault spec: items separated by ':'
+ *
+ *   seed=N		random seed (default 1)
+ *   dir=rx|tx|both	direction to damage (default both)
+ *   drop=P corrupt=P dup=P	byte probabilities
+ *   fdrop=P fdup=P	transfer probabilities
+ *   delay=P@MS		delay a transfer by MS ms with probability P
+ *   script=FILE	lines of "rx|tx <n> drop|corrupt|dup|delay <ms>"
+ *
+ * Returns NULL with errno set if the spec is bad.
+ */
+fault *fault_parse(const char *spec);
+void fault_free(fault *f);
+
+/*
+ * Damage n bytes just read into buf (of size bytes). Returns the
+ * number of bytes left, which may be 0.
+ */
+int fault_rx(fault *f, unsigned char *buf, int n, int size);
+
+/*
+ * Damage len bytes about to be written into out (of at least
+ * 2*len bytes). Returns the number of bytes to write, 0 to lose
+ * them all.
+ */
+int fault_tx(fault *f, const unsigned char *buf, int len, unsigned char *out);
+
+#endif
@@ -0,0 +1,255 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* inode numbers for the low-level FUSE interface */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include "inode.h"
+
+/* FNV-1a of the lowercased path */
+static itino hash(const char *path) {
+
+	itino h = 14695981039346656037ULL;
+
+	while (*path)
+		h = (h ^ (unsigned char)tolower(*(path++))) * 1099511628211ULL;
+
+	return h;
+}
+
+static inode *find_ino(itable *t, itino ino) {
+
+	inode *n;
+
+	for (n = t->byino[ino % IT_BUCKETS]; n != NULL; n = n->inext) {
+		if (n->ino == ino)
+			return n;
+	}
+
+	return NULL;
+}
+
+static inode *find_path(itable *t, const char *path) {
+
+	inode *n;
+
+	for (n = t->bypath[hash(path) % IT_BUCKETS]; n != NULL; n = n->pnext) {
+		if (strcasecmp(n->path, path) == 0)
+			return n;
+	}
+
+	return NULL;
+}
+
+static void link_path(itable *t, inode *n) {
+
+	inode **pp = &t->bypath[hash(n->path) % IT_BUCKETS];
+
+	n->pnext = *pp;
+	*pp = n;
+}
+
+static void unlink_path(itable *t, inode *n) {
+
+	inode **pp;
+
+	for (pp = &t->bypath[hash(n->path) % IT_BUCKETS]; *pp != NULL; pp = &(*pp)->pnext) {
+		if (*pp == n) {
+			*pp = n->pnext;
+			break;
+		}
+	}
+}
+
+static inode *add(itable *t, const char *path, itino ino) {
+
+	inode *n;
+
+	/* taken by another path or reserved: the next free one */
+	while (ino <= IT_ROOT || find_ino(t, ino) != NULL)
+		ino++;
+
+	n = (inode *) malloc(sizeof(inode));
+	n->ino = ino;
+	n->path = strdup(path);
+	n->nlookup = 0;
+	n->inext = t->byino[ino % IT_BUCKETS];
+	t->byino[ino % IT_BUCKETS] = n;
+	link_path(t, n);
+	t->count++;
+
+	return n;
+}
+
+itable *it_create() {
+
+	itable *t;
+	inode *root;
+
+	t = (itable *) calloc(1, sizeof(itable));
+	if (t == NULL) return NULL;
+	pthread_mutex_init(&t->mx, NULL);
+
+	/* the root is never forgotten */
+	root = (inode *) calloc(1, sizeof(inode));
+	root->ino = IT_ROOT;
+	root->path = strdup("/");
+	root->nlookup = 1;
+	t->byino[IT_ROOT % IT_BUCKETS] = root;
+	link_path(t, root);
+	t->count = 1;
+
+	return t;
+}
+
+void it_destroy(itable *t) {
+
+	inode *n;
+	int i;
+
+	for (i=0; i<IT_BUCKETS; i++) {
+		while ((n = t->byino[i]) != NULL) {
+			t->byino[i] = n->inext;
+			free(n->path);
+			free(n);
+		}
+	}
+	pthread_mutex_destroy(&t->mx);
+	free(t);
+}
+
+itino it_lookup(itable *t, const char *path) {
+
+	inode *n;
+	itino ino;
+
+	pthread_mutex_lock(&t->mx);
+	n = find_path(t, path);
+	if (n == NULL)
+		n = add(t, path, hash(path));
+	n->nlookup++;
+	ino = n->ino;
+	pthread_mutex_unlock(&t->mx);
+
+	return ino;
+}
+
+itino it_peek(itable *t, const char *path) {
+
+	inode *n;
+	itino ino;
+
+	pthread_mutex_lock(&t->mx);
+	n = find_path(t, path);
+	ino = n ? n->ino : 0;
+	pthread_mutex_unlock(&t->mx);
+
+	return ino;
+}
+
+int it_path(itable *t, itino ino, char *buf, int size) {
+
+	inode *n;
+	int l, r = -1;
+
+	pthread_mutex_lock(&t->mx);
+	n = find_ino(t, ino);
+	if (n == NULL || n->path == NULL) {
+		errno = ESTALE;
+	} else if ((l = strlen(n->path)) >= size) {
+		errno = ENAMETOOLONG;
+	} else {
+		memcpy(buf, n->path, l + 1);
+		r = 0;
+	}
+	pthread_mutex_unlock(&t->mx);
+
+	return r;
+}
+
+void it_forget(itable *t, itino ino, unsigned long long count) {
+
+	inode **pp, *n;
+
+	if (ino == IT_ROOT)
+		return;
+
+	pthread_mutex_lock(&t->mx);
+	for (pp = &t->byino[ino % IT_BUCKETS]; *pp != NULL; pp = &(*pp)->inext) {
+		n = *pp;
+		if (n->ino != ino) continue;
+		n->nlookup = (n->nlookup > count) ? n->nlookup - count : 0;
+		if (n->nlookup == 0) {
+			*pp = n->inext;
+			if (n->path != NULL) {
+				unlink_path(t, n);
+				free(n->path);
+			}
+			free(n);
+			t->count--;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&t->mx);
+}
+
+void it_unlink(itable *t, const char *path) {
+
+	inode *n;
+
+	pthread_mutex_lock(&t->mx);
+	n = find_path(t, path);
+	if (n != NULL && n->ino != IT_ROOT) {
+		unlink_path(t, n);
+		free(n->path);
+		n->path = NULL;
+	}
+	pthread_mutex_unlock(&t->mx);
+}
+
+void it_rename(itable *t, const char *path, const char *newpath) {
+
+	inode *n, *moved = NULL, *next;
+	int i, l = strlen(path);
+	char *s;
+
+	it_unlink(t, newpath);
+
+	pthread_mutex_lock(&t->mx);
+
+	/* take path and everything below it out of the path hash... */
+	for (i=0; i<IT_BUCKETS; i++) {
+		for (n = t->byino[i]; n != NULL; n = n->inext) {
+			if (n->path == NULL || n->ino == IT_ROOT ||
+				strncasecmp(n->path, path, l) != 0 ||
+				(n->path[l] != '\0' && n->path[l] != '/'))
+				continue;
+			unlink_path(t, n);
+			n->pnext = moved;
+			moved = n;
+		}
+	}
+
+	/* ...and put them back under the new name */
+	for (n = moved; n != NULL; n = next) {
+		next = n->pnext;
+		s = (char *) malloc(strlen(newpath) + strlen(n->path + l) + 1);
+		strcpy(s, newpath);
+		strcat(s, n->path + l);
+		free(n->path);
+		n->path = s;
+		link_path(t, n);
+	}
+
+	pthread_mutex_unlock(&t->mx);
+}
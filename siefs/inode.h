@@ -0,0 +1,76 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#ifndef INODE_H
+#define INODE_H
+
+#include <pthread.h>
+
+#define IT_BUCKETS 256		/* 4k per table, a phone has a few hundred files */
+#define IT_ROOT 1		/* inode number of "/" */
+
+typedef unsigned long long itino;
+
+typedef struct _inode {
+
+	itino ino;
+	char *path;		/* utf-8, NULL once unlinked */
+	unsigned long long nlookup;	/* references held by the kernel */
+	struct _inode *inext;	/* in the inode number hash */
+	struct _inode *pnext;	/* in the path hash */
+
+} inode;
+
+typedef struct _itable {
+
+	pthread_mutex_t mx;
+	inode *byino[IT_BUCKETS];
+	inode *bypath[IT_BUCKETS];
+	int count;
+
+} itable;
+
+/*
+ * Inode numbers for phone paths. A path keeps its number as long
+ * as the kernel remembers it (until it_forget() drops the last
+ * lookup), and gets the same number again later unless another
+ * path took it meanwhile, since numbers derive from the path.
+ * Paths compare case insensitively, like on the phone.
+ */
+itable *it_create();
+void it_destroy(itable *t);
+
+/*
+ * Number of path, added if needed, counting one lookup.
+ */
+itino it_lookup(itable *t, const char *path);
+
+/*
+ * Number of path if it is known, else 0. Counts nothing.
+ */
+itino it_peek(itable *t, const char *path);
+
+/*
+ * Copy the path of ino to buf (size bytes). Returns -1 with errno
+ * ESTALE if ino is unknown, ENAMETOOLONG if it doesn't fit.
+ */
+int it_path(itable *t, itino ino, char *buf, int size);
+
+/*
+ * The kernel dropped n lookups of ino.
+ */
+void it_forget(itable *t, itino ino, unsigned long long n);
+
+/*
+ * path was moved to newpath (with everything below it) or
+ * deleted. Inodes stay valid until forgotten.
+ */
+void it_rename(itable *t, const char *path, const char *newpath);
+void it_unlink(itable *t, const char *path);
+
+#endif
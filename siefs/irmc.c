@@ -0,0 +1,478 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* IrMC sync of the phone book and calendar into a local store */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include "irmc.h"
+
+#define STORE_MAGIC "siefs-irmc 1"
+#define CAL_HEAD "BEGIN:VCALENDAR\r\nVERSION:1.0\r\n"
+#define CAL_TAIL "END:VCALENDAR\r\n"
+
+static const char *db_name[IRMC_STORES] = { "pb", "cal" };
+static const char *db_ext[IRMC_STORES] = { "vcf", "vcs" };
+
+const char *irmc_file(int db) {
+
+	return (db == IRMC_CAL) ? "cal.vcs" : "pb.vcf";
+}
+
+/* the record store */
+
+/* index of luid, or -1 - where it would go */
+static int find(irmcstore *s, const char *luid) {
+
+	int lo = 0, hi = s->count - 1, mid, c;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		c = strcmp(s->recs[mid].luid, luid);
+		if (c == 0)
+			return mid;
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return -1 - lo;
+}
+
+static void drop(irmcstore *s, const char *luid) {
+
+	int i;
+
+	if ((i = find(s, luid)) < 0)
+		return;
+	s->bytes -= s->recs[i].len;
+	free(s->recs[i].luid);
+	free(s->recs[i].data);
+	s->count--;
+	memmove(&s->recs[i], &s->recs[i+1], (s->count - i) * sizeof(irmcrec));
+	s->changed = time(NULL);
+	s->dirty = 1;
+}
+
+/* a copy of data as record luid */
+static void put(irmcstore *s, const char *luid, const char *data, int len) {
+
+	int i;
+
+	if ((i = find(s, luid)) >= 0) {
+		if (s->recs[i].len == len && memcmp(s->recs[i].data, data, len) == 0)
+			return;
+		s->bytes -= s->recs[i].len;
+		free(s->recs[i].data);
+	} else {
+		i = -1 - i;
+		if (s->count == s->size) {
+			s->size = s->size ? 2 * s->size : 64;
+			s->recs = realloc(s->recs, s->size * sizeof(irmcrec));
+		}
+		memmove(&s->recs[i+1], &s->recs[i], (s->count - i) * sizeof(irmcrec));
+		s->recs[i].luid = strdup(luid);
+		s->count++;
+	}
+	s->recs[i].data = malloc(len + 1);
+	memcpy(s->recs[i].data, data, len);
+	s->recs[i].data[len] = '\0';
+	s->recs[i].len = len;
+	s->bytes += len;
+	s->changed = time(NULL);
+	s->dirty = 1;
+}
+
+static void clear(irmcstore *s) {
+
+	int i;
+
+	for (i=0; i<s->count; i++) {
+		free(s->recs[i].luid);
+		free(s->recs[i].data);
+	}
+	s->count = 0;
+	s->bytes = 0;
+	s->cc = -1;
+	*s->sn = *s->did = '\0';
+	s->dirty = 1;
+}
+
+/* written to a new file which then takes the old one's place */
+static int save(irmcstore *s) {
+
+	char *tmp;
+	FILE *f;
+	int i, r;
+
+	if (s->file == NULL || ! s->dirty)
+		return 0;
+	tmp = malloc(strlen(s->file) + 5);
+	sprintf(tmp, "%s.new", s->file);
+	f = fopen(tmp, "wb");
+	if (f == NULL) {
+		free(tmp);
+		return -1;
+	}
+	fprintf(f, "%s\nSN:%s\nDID:%s\nCC:%li\nCHANGED:%li\nRECORDS:%i\n", STORE_MAGIC,
+		s->sn, s->did, s->cc, (long)s->changed, s->count);
+	for (i=0; i<s->count; i++) {
+		fprintf(f, "%s %i\n", s->recs[i].luid, s->recs[i].len);
+		fwrite(s->recs[i].data, 1, s->recs[i].len, f);
+		fputc('\n', f);
+	}
+	r = (fclose(f) == 0) ? rename(tmp, s->file) : -1;
+	if (r < 0)
+		unlink(tmp);
+	else
+		s->dirty = 0;
+	free(tmp);
+
+	return r;
+}
+
+/* a "key:value" line of the store's head */
+static int field(FILE *f, const char *key, char *value, int size) {
+
+	char line[256];
+	int l = strlen(key);
+
+	if (fgets(line, sizeof(line), f) == NULL || strncmp(line, key, l) != 0 || line[l] != ':')
+		return -1;
+	line[strcspn(line, "\n")] = '\0';
+	snprintf(value, size, "%s", line + l + 1);
+	return 0;
+}
+
+/* a store that doesn't read back right is dropped, a full sync
+   makes it again */
+static void load(irmcstore *s) {
+
+	char line[256], cc[32], changed[32], count[32], luid[64], *data;
+	FILE *f;
+	int i, n, len;
+
+	f = fopen(s->file, "rb");
+	if (f == NULL)
+		return;
+	if (fgets(line, sizeof(line), f) == NULL || strcmp(line, STORE_MAGIC "\n") != 0 ||
+		field(f, "SN", s->sn, sizeof(s->sn)) < 0 || field(f, "DID", s->did, sizeof(s->did)) < 0 ||
+		field(f, "CC", cc, sizeof(cc)) < 0 || field(f, "CHANGED", changed, sizeof(changed)) < 0 ||
+		field(f, "RECORDS", count, sizeof(count)) < 0)
+	{
+		fclose(f);
+		clear(s);
+		return;
+	}
+	n = atoi(count);
+	for (i=0; i<n; i++) {
+		if (fscanf(f, "%63s %i", luid, &len) != 2 || fgetc(f) != '\n' || len < 0)
+			break;
+		data = malloc(len + 1);
+		if (fread(data, 1, len, f) != len || fgetc(f) != '\n') {
+			free(data);
+			break;
+		}
+		put(s, luid, data, len);
+		free(data);
+	}
+	fclose(f);
+
+	if (i < n) {
+		clear(s);
+		return;
+	}
+	s->cc = atol(cc);
+	s->changed = atol(changed);
+	s->dirty = 0;
+}
+
+irmcstore *irmc_create(int db, const char *file) {
+
+	irmcstore *s;
+
+	s = (irmcstore *) calloc(1, sizeof(irmcstore));
+	if (s == NULL)
+		return NULL;
+	s->db = db;
+	s->cc = -1;
+	if (file != NULL) {
+		s->file = strdup(file);
+		load(s);
+	}
+
+	return s;
+}
+
+void irmc_free(irmcstore *s) {
+
+	if (s == NULL) return;
+	save(s);
+	clear(s);
+	free(s->recs);
+	free(s->file);
+	free(s);
+}
+
+long long irmc_size(irmcstore *s) {
+
+	if (s->db == IRMC_CAL)
+		return s->bytes + strlen(CAL_HEAD) + strlen(CAL_TAIL);
+	return s->bytes;
+}
+
+char *irmc_text(irmcstore *s, long long *len) {
+
+	char *t, *p;
+	int i;
+
+	t = p = malloc(irmc_size(s) + 1);
+	if (t == NULL)
+		return NULL;
+	if (s->db == IRMC_CAL)
+		p += sprintf(p, "%s", CAL_HEAD);
+	for (i=0; i<s->count; i++) {
+		memcpy(p, s->recs[i].data, s->recs[i].len);
+		p += s->recs[i].len;
+	}
+	if (s->db == IRMC_CAL)
+		p += sprintf(p, "%s", CAL_TAIL);
+	*p = '\0';
+
+	if (len) *len = p - t;
+	return t;
+}
+
+/* records in what the phone sends */
+
+static char *nextline(char *s, char *end) {
+
+	while (s < end && *s != '\n') s++;
+	return (s < end) ? s + 1 : end;
+}
+
+/* the line at s is text */
+static int isline(char *s, char *end, const char *text) {
+
+	int l = strlen(text);
+
+	return end - s >= l && strncasecmp(s, text, l) == 0 &&
+		(s + l == end || s[l] == '\r' || s[l] == '\n');
+}
+
+/* the next vCard, or vEvent or vTodo, from *pos on: where it starts,
+   its length and luid ("" if it has none); *pos is moved past it.
+   The luid line is cut out of the buffer, a record is kept the same
+   whether it came with the whole database or by itself */
+static char *record(int db, char **pos, char **pend, int *len, char *luid, int lsize) {
+
+	char *s, *e, *end = *pend, endline[40];
+	int l;
+
+	for (s = *pos; s < end; s = nextline(s, end)) {
+		if (db == IRMC_PB ? isline(s, end, "BEGIN:VCARD") :
+			(isline(s, end, "BEGIN:VEVENT") || isline(s, end, "BEGIN:VTODO")))
+			break;
+	}
+	if (s >= end)
+		return NULL;
+
+	l = strcspn(s + 6, "\r\n");
+	snprintf(endline, sizeof(endline), "END:%.*s", (l < 32) ? l : 32, s + 6);
+	*luid = '\0';
+	for (e = nextline(s, end); e < end; ) {
+		if (end - e > 12 && strncasecmp(e, "X-IRMC-LUID:", 12) == 0) {
+			l = strcspn(e + 12, "\r\n");
+			snprintf(luid, lsize, "%.*s", l, e + 12);
+			l = nextline(e, end) - e;
+			memmove(e, e + l, end - e - l);
+			end -= l;
+			continue;
+		}
+		l = isline(e, end, endline);
+		e = nextline(e, end);
+		if (l)
+			break;
+	}
+
+	*len = e - s;
+	*pos = e;
+	*pend = end;
+	return s;
+}
+
+/* syncing */
+
+/* everything again: the whole database and the counter it is at */
+static int full_sync(irmcstore *s, obexsession *os) {
+
+	char name[64], luid[64], *data, *pos, *end, *rec;
+	long long len;
+	long cc = -1;
+	int l, n;
+
+	snprintf(name, sizeof(name), "telecom/%s/luid/cc.log", db_name[s->db]);
+	if (obex_getobj(os, name, &data) >= 0) {
+		cc = strtol(data, NULL, 10);
+		free(data);
+	} else if (! os->connected) {
+		return -1;
+	}
+
+	/* without a counter the phone can't do level 4, the next
+	   sync is a full one again */
+	snprintf(name, sizeof(name), "telecom/%s.%s", db_name[s->db], db_ext[s->db]);
+	if ((len = obex_getobj(os, name, &data)) < 0)
+		return -1;
+
+	clear(s);
+	pos = data;
+	end = data + len;
+	for (n = 0; (rec = record(s->db, &pos, &end, &l, luid, sizeof(luid))) != NULL; n++) {
+		if (*luid == '\0')
+			sprintf(luid, "~%i", n);	/* no log can name it */
+		put(s, luid, rec, l);
+	}
+	free(data);
+	s->cc = cc;
+	s->changed = time(NULL);
+
+	return n;
+}
+
+/* a record named by the log, gone if the phone hasn't got it */
+static int fetch(irmcstore *s, obexsession *os, char *luid) {
+
+	char name[128], got[64], *data, *pos, *end, *rec;
+	long long len;
+	int l;
+
+	snprintf(name, sizeof(name), "telecom/%s/luid/%s.%s", db_name[s->db], luid, db_ext[s->db]);
+	if ((len = obex_getobj(os, name, &data)) < 0) {
+		if (! os->connected)
+			return -1;
+		drop(s, luid);
+		return 0;
+	}
+	pos = data;
+	end = data + len;
+	if ((rec = record(s->db, &pos, &end, &l, got, sizeof(got))) != NULL)
+		put(s, luid, rec, l);
+	else
+		drop(s, luid);
+	free(data);
+
+	return 0;
+}
+
+/* apply the change log since s->cc: 0, 1 if everything has to be
+   fetched, -1 if the link was lost; *fetched counts the records */
+static int follow_log(irmcstore *s, obexsession *os, int *fetched) {
+
+	char name[64], *log, *line, *next, *luid, **luids, *types;
+	long cc, top = s->cc, total = -1;
+	int i, j, n = 0, max, mod = 0, r = 0;
+
+	*fetched = 0;
+	snprintf(name, sizeof(name), "telecom/%s/luid/%li.log", db_name[s->db], s->cc);
+	if (obex_getobj(os, name, &log) < 0)
+		return os->connected ? 1 : -1;
+
+	for (max = 1, line = log; *line; line++)
+		if (*line == '\n') max++;
+	luids = malloc(max * sizeof(char *));
+	types = malloc(max);
+
+	for (line = log; line != NULL && r == 0; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL) *(next++) = '\0';
+		line[strcspn(line, "\r")] = '\0';
+
+		if (strncasecmp(line, "SN:", 3) == 0) {
+			if (*s->sn && strcmp(s->sn, line + 3) != 0) r = 1;
+			snprintf(s->sn, sizeof(s->sn), "%s", line + 3);
+		} else if (strncasecmp(line, "DID:", 4) == 0) {
+			if (*s->did && strcmp(s->did, line + 4) != 0) r = 1;
+			snprintf(s->did, sizeof(s->did), "%s", line + 4);
+		} else if (strncasecmp(line, "Total-Records:", 14) == 0) {
+			total = atol(line + 14);
+		} else if (strcmp(line, "*") == 0) {
+			r = 1;		/* the phone has lost track */
+		} else if (line[0] && strchr("MHD", line[0]) && line[1] == ':') {
+			/* <type>:<change counter>:[<time>]:<luid> */
+			cc = strtol(line + 2, NULL, 10);
+			if (cc > top) top = cc;
+			luid = strrchr(line, ':') + 1;
+			if (*luid == '\0') continue;
+			luids[n] = luid;
+			types[n++] = line[0];
+		}
+	}
+
+	/* the last change to each record is what counts; when most
+	   records changed, fetching them all at once is cheaper */
+	for (i=0; i<n; i++) {
+		for (j=i+1; j<n && strcmp(luids[i], luids[j]) != 0; j++);
+		if (j < n)
+			types[i] = 0;
+		else if (types[i] == 'M')
+			mod++;
+	}
+	if (mod > 16 && mod > s->count / 2)
+		r = 1;
+
+	for (i=0; i<n && r == 0; i++) {
+		if (types[i] == 'M') {
+			if (fetch(s, os, luids[i]) < 0)
+				r = -1;
+			(*fetched)++;
+		} else if (types[i] != 0) {
+			drop(s, luids[i]);
+		}
+	}
+	free(luids);
+	free(types);
+	free(log);
+
+	if (r == 0) {
+		if (top != s->cc) s->dirty = 1;
+		s->cc = top;
+		if (total >= 0 && total != s->count)
+			r = 1;	/* out of step, start over */
+	}
+
+	return r;
+}
+
+int irmc_sync(irmcstore *s, obexsession *os) {
+
+	int n = 0, m = 0, r = 1;
+
+	if (obex_target(os, OBEX_TARGET_SYNC) < 0)
+		return -1;
+
+	if (s->cc >= 0 && (r = follow_log(s, os, &n)) < 0)
+		return -1;
+	if (r == 1) {
+		if ((n = full_sync(s, os)) < 0)
+			return -1;
+
+		/* the ids of the database, and what changed meanwhile */
+		if (s->cc >= 0 && follow_log(s, os, &m) < 0)
+			return -1;
+		n += m;
+	}
+	save(s);
+
+	return n;
+}
@@ -0,0 +1,75 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#ifndef IRMC_H
+#define IRMC_H
+
+#include <time.h>
+#include "obex.h"
+
+#define IRMC_PB 0		/* phone book, vCards */
+#define IRMC_CAL 1		/* calendar, vEvents and vTodos */
+#define IRMC_STORES 2
+
+typedef struct _irmcrec {
+
+	char *luid;		/* the phone's id of the record */
+	char *data;		/* as the phone sent it */
+	int len;
+
+} irmcrec;
+
+/*
+ * A local copy of one of the phone's databases, kept current with
+ * IrMC level 4 sync: the change log since the change counter the
+ * copy was made at names the records to fetch again or drop. Only
+ * a new database id, a log the phone couldn't keep or a record
+ * count that doesn't add up make it fetch everything.
+ */
+typedef struct _irmcstore {
+
+	int db;
+	char sn[64];		/* serial number and database id of */
+	char did[64];		/* the phone's copy, "" if not known */
+	long cc;		/* change counter, -1 if nothing synced */
+	irmcrec *recs;		/* sorted by luid */
+	int count, size;
+	long long bytes;	/* of the records */
+	time_t changed;		/* when the records last changed */
+	char *file;		/* kept there between runs, NULL if not */
+	int dirty;		/* changed since it was kept */
+
+} irmcstore;
+
+/*
+ * Create a store for db, loading it from file if that exists.
+ */
+irmcstore *irmc_create(int db, const char *file);
+void irmc_free(irmcstore *s);
+
+/*
+ * Bring s up to date with the phone (a transfer in progress has
+ * to be suspended first). The connection stays with the sync
+ * target until the next file operation. Returns the number of
+ * records fetched, 0 if the change log was all it took, or -1
+ * with errno set.
+ */
+int irmc_sync(irmcstore *s, obexsession *os);
+
+/*
+ * All records as one file, malloc'ed; irmc_size() is its length.
+ */
+char *irmc_text(irmcstore *s, long long *len);
+long long irmc_size(irmcstore *s);
+
+/*
+ * The file a database is shown as under telecom: pb.vcf, cal.vcs.
+ */
+const char *irmc_file(int db);
+
+#endif
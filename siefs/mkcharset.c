@@ -0,0 +1,84 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* mkcharset.c - write charset_tab.h, the reverse tables of nls.h */
+
+#include <stdio.h>
+#include <string.h>
+#include "nls.h"
+
+/* reverse of c2u: pages[hi[u >> 8] - 1][u & 0xff] is the byte for u */
+static int reverse(const unsigned short *c2u, unsigned char hi[256],
+	unsigned char pages[256][256]) {
+
+	int i, n = 0;
+	unsigned short u;
+
+	memset(hi, 0, 256);
+	memset(pages, 0, 256 * 256);
+
+	/* page 0 holds ascii as it is */
+	hi[0] = ++n;
+	for (i=1; i<0x80; i++)
+		pages[0][i] = i;
+
+	for (i=0; i<128; i++) {
+		u = c2u[i];
+		if (u == 0)
+			continue;
+		if (hi[u >> 8] == 0)
+			hi[u >> 8] = ++n;
+		pages[hi[u >> 8] - 1][u & 0xff] = 0x80 + i;
+	}
+
+	return n;
+}
+
+static void table(const char *type, const char *name, const unsigned char *t) {
+
+	int i;
+
+	printf("static const unsigned char %s%s[256] = {", type, name);
+	for (i=0; i<256; i++)
+		printf("%s0x%02x,", (i % 12) ? " " : "\n\t", t[i]);
+	printf("\n};\n\n");
+}
+
+int main() {
+
+	unsigned char hi[256], pages[256][256];
+	char lo[64];
+	int i, j, n, total = 0;
+
+	printf("/* generated by mkcharset from nls.h, do not edit */\n\n");
+
+	for (i=0; nls_list[i].name != NULL; i++) {
+		n = reverse(nls_list[i].c2u, hi, pages);
+		table("u2c_hi_", nls_list[i].name, hi);
+		for (j=0; j<n; j++) {
+			sprintf(lo, "%s_%i", nls_list[i].name, j);
+			table("u2c_lo_", lo, pages[j]);
+		}
+		printf("static const unsigned char *const u2c_lo_%s[] = {\n", nls_list[i].name);
+		for (j=0; j<n; j++)
+			printf("\tu2c_lo_%s_%i,\n", nls_list[i].name, j);
+		printf("};\n\n");
+		total += 256 * (n + 1);
+	}
+
+	printf("/* %i bytes of tables */\n"
+		"const charset charsets[] = {\n"
+		"\t{ \"utf8\", NULL, NULL, NULL },\n", total);
+	for (i=0; nls_list[i].name != NULL; i++) {
+		printf("\t{ \"%s\", c2u_%s, u2c_hi_%s, u2c_lo_%s },\n",
+			nls_list[i].name, nls_list[i].name, nls_list[i].name, nls_list[i].name);
+	}
+	printf("\t{ NULL, NULL, NULL, NULL },\n};\n");
+
+	return 0;
+}
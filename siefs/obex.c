@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -18,8 +19,11 @@
 #include <time.h>
 #include "transport.h"
 #include "obex.h"
+#include "stats.h"
+#include "trace.h"
 
 #define TIMEOUT 70
+#define RECOVER_TRIES 3
 
 void set_errno(unsigned char obex_response) {
 
@@ -173,10 +177,13 @@ int send_packet(obexsession *os, obexpacket *p) {
 	s = p->data;
 	*(s+1) = p->len >> 8;
 	*(s+2) = p->len & 0xff;
+	os->lastop = s[0];
+	os->tsent = stats_now();
 
 	if (tra_send(os->b, s, p->len) >= 0) {
 		return 0;
 	} else {
+		os->connected = 0;
 		abort_exchange(os);
 		return -1;
 	}
@@ -187,11 +194,14 @@ int recv_packet(obexsession *os, obexpacket *p) {
 	int l;
 
 	l = tra_recv(os->b, p->data, os->maxsize+16);
+	TRACE(TR_OBEX, os->lastop, NULL, l, (l > 0) ? p->data[0] : -1, stats_now() - os->tsent);
 	if (l <= 0) {
+		os->connected = 0;
 		abort_exchange(os);
 		return -1;
 	}
 
+	stats_time(stats_obexop(os->lastop), stats_now() - os->tsent);
 	p->pos = p->data;
 	p->len = l;
 	set_errno(p->data[0]);
@@ -328,9 +338,11 @@ int cdto(obexsession *os, char *name, int strip_last, int create_if_missing) {
 		eqd++;
 	}
 
+	/* up to the common folder one step at a time, or from the top
+	   if that takes fewer SETPATHs */
 	s = s2;
 	if (eqd < depth) {
-		if (eqd <= depth/2) {
+		if (1 + 2*eqd < depth) {
 			if (cdtop(os) != 0) goto err_cd;
 			depth = 0;
 			s = buf;
@@ -355,6 +367,7 @@ int cdto(obexsession *os, char *name, int strip_last, int create_if_missing) {
 
 err_cd:
 	er = errno;
+	free(buf);
 	if (os->currentdir) free(os->currentdir);
 	cdtop(os);
 	errno = er;
@@ -375,6 +388,10 @@ obexsession *obex_startup(char *device, int speed) {
 	os = (obexsession *) malloc(sizeof(obexsession));
 	os->b = b;
 	os->connected = 0;
+	os->session = 0;
+	os->probe = 1;
+	os->conngen = 0;
+	os->target = OBEX_TARGET_FLEX;
 	os->maxsize = MAXPACKETSIZE;
 	os->pc = (obexpacket *) malloc(sizeof(obexpacket) + os->maxsize + 32);
 	os->pd = (obexpacket *) malloc(sizeof(obexpacket) + os->maxsize + 32);
@@ -383,16 +400,99 @@ obexsession *obex_startup(char *device, int speed) {
 	os->depth = 0;
 	os->currentdir = NULL;
 	os->mode = OBEX_IDLE;
+	os->suspended = 0;
 	os->filename = NULL;
+	os->ahead = 0;
+	os->spool = NULL;
+	os->ownspool = 0;
+	os->recoveries = 0;
+	os->recovery_us = 0;
 
 	return os;
 }
 
-int handshake(obexsession *os) {
+void handle_data(obexsession *os, obexpacket *p) {
 
-	obexpacket *p = os->pc;
-	int n;
+	unsigned char *s;
+	int l;
+
+	os->eof = (p->data[0] == 0x90) ? 0 : 1;
+
+	os->pos = 0;
+	os->len = 0;
+
+	s = find_header(p, 0x48);
+	if (s == NULL)
+		s = find_header(p, 0x49);
+
+	if (s != NULL) {
+		l = (*s << 8) + *(s+1) - 3;
+		os->len = l;
+		if (l > 0) os->pos = s+2;
+	}
+}
+
+/*
+ * Collect the response to a GET packet requested in advance by
+ * obex_read(). Called before anything else goes over the link.
+ */
+int settle(obexsession *os) {
+
+	obexpacket *p = os->pd;
+	int l, r;
 
+	if (! os->ahead)
+		return 0;
+
+	os->ahead = 0;
+	l = tra_complete(os->b, &os->areq);
+	TRACE(TR_OBEX, 0x83, NULL, l, (l > 0) ? p->data[0] : -1, stats_now() - os->tsent);
+	if (l <= 0) {
+		os->connected = 0;
+		abort_exchange(os);
+		return -1;
+	}
+
+	stats_time(ST_OBEX_GET, stats_now() - os->tsent);
+	p->pos = p->data;
+	p->len = l;
+	set_errno(p->data[0]);
+	r = p->data[0];
+	if (r != 0x90 && r != 0xa0)
+		return -1;
+
+	handle_data(os, p);
+	return 0;
+}
+
+/* send the next GET packet without waiting for the answer */
+int read_ahead(obexsession *os) {
+
+	obexpacket *p = os->pd;
+
+	init_packet(p, 0x83);
+	p->data[1] = p->len >> 8;
+	p->data[2] = p->len & 0xff;
+	eng_init(&os->areq, os->b, p->data, p->len, p->data, os->maxsize+16);
+	os->lastop = 0x83;
+	os->tsent = stats_now();
+	if (tra_submit(os->b, &os->areq) < 0) {
+		abort_exchange(os);
+		return -1;
+	}
+
+	os->ahead = 1;
+	return 0;
+}
+
+int hello(obexsession *os, int target);
+int bye(obexsession *os);
+int recover(obexsession *os);
+
+/* a working link; a new one gets its OBEX connection to target */
+int link_up(obexsession *os, int target) {
+
+	settle(os);
 	os->connected = 0;
 
 	if (tra_test(os->b, 3) == 0) {
@@ -400,6 +500,10 @@ int handshake(obexsession *os) {
 		return 0;
 	}
 
+	if (! os->probe) {
+		errno = EIO;
+		return -1;
+	}
 	if (tra_initiate(os->b) != 0) {
 		if (tra_test(os->b, 20) == 0) {
 			os->connected = 1;
@@ -408,12 +512,53 @@ int handshake(obexsession *os) {
 		return -1;
 	}
 
+	os->session = 0;	/* a fresh link has none */
+	return hello(os, target);
+}
+
+int obex_target(obexsession *os, int target) {
+
+	int gen;
+
+	if (link_up(os, target) != 0)
+		return -1;
+	if (os->session && os->target == target)
+		return 0;
+
+	/* the phone serves one target at a time */
+	if (os->session) {
+		os->session = 0;
+		if (bye(os) != 0 && ! os->connected)
+			return -1;
+	}
+	gen = os->conngen;
+	if (hello(os, target) != 0)
+		return -1;
+	os->conngen = gen;	/* the same phone, cached values stay */
+	return 0;
+}
+
+/* ready for the file operations */
+int handshake(obexsession *os) {
+
+	return obex_target(os, OBEX_TARGET_FLEX);
+}
+
+/* OBEX CONNECT to target on a working link */
+int hello(obexsession *os, int target) {
+
+	obexpacket *p = os->pc;
+	int n;
+
 	init_packet(p, 0x80);
 	append_byte(p, 0x10);
 	append_byte(p, 0x00);
 	append_byte(p, os->maxsize >> 8);
 	append_byte(p, os->maxsize & 0xFF);
-	append_data(p, 0x46, (unsigned char *)sig_flex, sizeof(sig_flex));
+	if (target == OBEX_TARGET_SYNC)
+		append_data(p, 0x46, (unsigned char *)sig_sync, sizeof(sig_sync));
+	else
+		append_data(p, 0x46, (unsigned char *)sig_flex, sizeof(sig_flex));
 	if (send_packet(os, p) < 0)
 		return -1;
 
@@ -433,32 +578,106 @@ int handshake(obexsession *os) {
 		os->currentdir = NULL;
 	}
 
+	os->conngen++;
 	os->connected = 1;
+	os->session = 1;
+	os->target = target;
 	return 0;
 }
 
-void obex_shutdown(obexsession *os) {
+int obex_connect(obexsession *os) {
 
-	obexpacket *p = os->pc;
+	int probe = os->probe, r;
 
-	if (os->connected) {
-		init_packet(p, 0x81);
-		append_byte(p, 0xcb);
-		append_byte(p, 0x00);
-		append_byte(p, 0x00);
-		append_byte(p, 0x00);
-		append_byte(p, 0x01);
-		if (send_packet(os, p) >= 0)
-			recv_packet(os, p);
-	}
+	os->probe = 1;
+	r = handshake(os);
+	os->probe = probe;
+	return r;
+}
+
+int obex_reconnect(obexsession *os) {
+
+	int probe = os->probe, r;
+
+	settle(os);
+	os->probe = 1;
+	r = recover(os);
+	os->probe = probe;
+	return r;
+}
+
+int obex_setspeed(obexsession *os, int speed) {
+
+	settle(os);
+	return tra_setspeed(os->b, speed);
+}
+
+void obex_shutdown(obexsession *os) {
+
+	settle(os);
+	if (os->connected && os->session)
+		bye(os);
 
 	tra_close(os->b);
 	free(os->pc);
 	free(os->pd);
 	if (os->dirlist) free(os->dirlist);
+	free(os->currentdir);
+	free(os->filename);
 	free(os);
 }
 
+/* OBEX DISCONNECT */
+int bye(obexsession *os) {
+
+	obexpacket *p = os->pc;
+
+	init_packet(p, 0x81);
+	append_byte(p, 0xcb);
+	append_byte(p, 0x00);
+	append_byte(p, 0x00);
+	append_byte(p, 0x00);
+	append_byte(p, 0x01);
+	if (send_packet(os, p) < 0)
+		return -1;
+
+	return (recv_packet(os, p) == 0xa0) ? 0 : -1;
+}
+
+/*
+ * Get the link back after a failed exchange. The phone usually
+ * stays in BFB mode at our speed, so reopening the port and
+ * resyncing the frame sequence is tried before a full initiate.
+ * The OBEX connection is renewed either way.
+ */
+int recover(obexsession *os) {
+
+	struct timespec t0, t1;
+	long long us;
+	int r = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	os->ahead = 0;
+	os->connected = 0;
+	os->session = 0;
+	if (tra_reconnect(os->b) == 0) {
+		abort_exchange(os);	/* the phone may be in the middle of one */
+		r = hello(os, os->target);
+	}
+	if (r != 0 && os->probe && tra_initiate(os->b) == 0)
+		r = hello(os, os->target);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	us = (t1.tv_sec - t0.tv_sec) * 1000000LL + (t1.tv_nsec - t0.tv_nsec) / 1000;
+	TRACE(TR_RECOVER, 0, NULL, 0, r, us);
+
+	if (r == 0) {
+		stats_count(ST_RECOVERIES, 1);
+		os->recoveries++;
+		os->recovery_us += us;
+	}
+	return r;
+}
+
 int abort_exchange(obexsession *os) {
 
 	unsigned char abuf[256];
@@ -475,7 +694,8 @@ int abort_exchange(obexsession *os) {
 	return (abuf[0] == 0xa0) ? 0 : -1;
 }
 
-int obex_readdir(obexsession *os, char *dir) {
+/* the listing of the current folder into os->dirlist */
+int list_here(obexsession *os) {
 
 	obexpacket *p = os->pc;
 	int n, r, lsize;
@@ -484,12 +704,6 @@ int obex_readdir(obexsession *os, char *dir) {
 	free(os->dirlist);
 	os->dirlist = NULL;
 
-	if (handshake(os) != 0)
-		return -1;
-
-	if (cdto(os, dir, 0, 0) < 0)
-		return -1;
-
 	init_packet(p, 0x83);
 	append_string(p, 0x42, "x-obex/folder-listing");
 
@@ -523,6 +737,66 @@ int obex_readdir(obexsession *os, char *dir) {
 	return 0;
 }
 
+long long obex_getobj(obexsession *os, char *name, char **data) {
+
+	obexpacket *p = os->pc;
+	long long len = 0, size = 0;
+	unsigned char *s;
+	int n, r = -1;
+
+	*data = NULL;
+	init_packet(p, 0x83);
+	append_unicode(p, 0x01, name);
+
+	do {
+		if (send_packet(os, p) < 0)
+			break;
+
+		r = recv_packet(os, p);
+		if (r != 0x90 && r != 0xa0)
+			break;
+
+		s = find_header(p, 0x48);
+		if (s == NULL) s = find_header(p, 0x49);
+		if (s != NULL) {
+			n = (*s << 8) + *(s+1) - 3;
+			if (len + n + 1 > size) {
+				size = 2 * size + n + 1;
+				*data = realloc(*data, size);
+			}
+			memcpy(*data + len, s+2, n);
+			len += n;
+		}
+
+		init_packet(p, 0x83);
+
+	} while (r != 0xa0);
+
+	if (r != 0xa0) {
+		free(*data);
+		*data = NULL;
+		return -1;
+	}
+	if (*data == NULL)
+		*data = malloc(1);
+	(*data)[len] = '\0';
+	return len;
+}
+
+int obex_readdir(obexsession *os, char *dir) {
+
+	free(os->dirlist);
+	os->dirlist = NULL;
+
+	if (handshake(os) != 0)
+		return -1;
+
+	if (cdto(os, dir, 0, 0) < 0)
+		return -1;
+
+	return list_here(os);
+}
+
 obexdirentry *obex_nextentry(obexsession *os) {
 
 	struct tm ctm;
@@ -567,7 +841,7 @@ obexdirentry *obex_nextentry(obexsession *os) {
 	/* size */
 	if (! isdir) {
 		ss = getparm(s, "size");
-		os->direntry.size = (ss == NULL) ? 0 : atoi(ss);
+		os->direntry.size = (ss == NULL) ? 0 : strtoll(ss, NULL, 10);
 	} else {
 		os->direntry.size = 0;
 	}
@@ -630,34 +904,13 @@ obexdirentry *obex_nextentry(obexsession *os) {
 	return &(os->direntry);
 }
 
-void handle_data(obexsession *os, obexpacket *p) {
-
-	unsigned char *s;
-	int l;
-
-	os->eof = (p->data[0] == 0x90) ? 0 : 1;
-
-	os->pos = 0;
-	os->len = 0;
-
-	s = find_header(p, 0x48);
-	if (s == NULL)
-		s = find_header(p, 0x49);
-
-	if (s != NULL) {
-		l = (*s << 8) + *(s+1) - 3;
-		os->len = l;
-		if (l > 0) os->pos = s+2;
-	}
-}
-
-int begin_get_request(obexsession *os) {
+long long begin_get_request(obexsession *os) {
 
 	obexpacket *p = os->pd;
 	unsigned char *s;
-	unsigned char tbuf[8];
-	int r, i, offset, len;
-	long pos, shift;
+	unsigned char tbuf[10];
+	int r, i, n, shift;
+	long long pos, len;
 
 	if (handshake(os) != 0)
 		return -1;
@@ -667,17 +920,18 @@ int begin_get_request(obexsession *os) {
 
 	init_packet(p, 0x83);
 	append_unicode(p, 0x01, lastitem(os->filename));
-	offset = os->offset;
-	shift = offset % BLOCKSIZE;
-	pos = offset - shift;
+	shift = os->offset % BLOCKSIZE;
+	pos = os->offset - shift;
 	if (pos != 0) {
+		/* 4 bytes as the phones know it, 8 past 4 GB */
+		n = (pos < 0x100000000LL) ? 4 : 8;
 		tbuf[0] = 0x37;
-		tbuf[1] = 0x04;
-		for (i=5; i>1; i--) {
+		tbuf[1] = n;
+		for (i=n+1; i>1; i--) {
 			tbuf[i] = (unsigned char) (pos & 0xff);
 			pos >>= 8;
 		}
-		append_data(p, 0x4c, tbuf, 6);
+		append_data(p, 0x4c, tbuf, n+2);
 	}
 	if (send_packet(os, p) < 0)
 		return -1;
@@ -702,13 +956,27 @@ int begin_get_request(obexsession *os) {
 	return len;
 }
 
-int obex_get(obexsession *os, char *name, long offset) {
+long long obex_get(obexsession *os, char *name, long long offset) {
 
+	free(os->filename);	/* left by a request that failed */
 	os->filename = strdup(name);
 	os->offset = offset;
 	return begin_get_request(os);
 }
 
+/* restart an interrupted GET at the first byte not read yet */
+int resume_get(obexsession *os) {
+
+	int i;
+
+	for (i=0; i<RECOVER_TRIES; i++) {
+		if (recover(os) == 0 && begin_get_request(os) >= 0)
+			return 0;
+	}
+
+	return -1;
+}
+
 int obex_read(obexsession *os, void *buf, int size) {
 
 	obexpacket *p = os->pd;
@@ -729,11 +997,28 @@ int obex_read(obexsession *os, void *buf, int size) {
 		if (os->len == 0) {
 			if (os->eof) break;
 
-			init_packet(p, 0x83);
-			if (send_packet(os, p) < 0)
-				return -1;
+			if (os->ahead) {
+				if (settle(os) < 0 && (os->connected || resume_get(os) < 0))
+					return -1;
+				continue;
+			}
 
-			r = recv_packet(os, p);
+			/* caller has got all it wanted: let the phone prepare
+			   the next packet while the caller is busy with data */
+			if (av == 0) {
+				if (read_ahead(os) < 0)
+					return -1;
+				break;
+			}
+
+			init_packet(p, 0x83);
+			r = (send_packet(os, p) < 0) ? -1 : recv_packet(os, p);
+			if (r < 0 && ! os->connected) {
+				/* link dropped, pick up where we are */
+				if (resume_get(os) < 0)
+					return -1;
+				continue;
+			}
 			if (r != 0x90 && r != 0xa0)
 				return -1;
 
@@ -747,8 +1032,10 @@ int obex_read(obexsession *os, void *buf, int size) {
 int begin_put_request(obexsession *os) {
 
 	obexpacket *p = os->pd;
-	unsigned char *s;
-	int r, i, len;
+	char tbuf[32];
+	struct tm tm;
+	time_t t;
+	int r, i;
 
 	if (handshake(os) != 0)
 		return -1;
@@ -758,6 +1045,18 @@ int begin_put_request(obexsession *os) {
 
 	init_packet(p, 0x02);
 	append_unicode(p, 0x01, lastitem(os->filename));
+	if (os->putsize >= 0 && os->putsize < 0x100000000LL) {
+		append_byte(p, 0xc3);
+		for (i=24; i>=0; i-=8)
+			append_byte(p, (os->putsize >> i) & 0xff);
+	}
+	if (os->putmtime != 0) {
+		/* local time, like the phone lists it */
+		t = os->putmtime;
+		localtime_r(&t, &tm);
+		strftime(tbuf, sizeof(tbuf), "%Y%m%dT%H%M%S", &tm);
+		append_data(p, 0x44, (unsigned char *)tbuf, strlen(tbuf));
+	}
 	if (send_packet(os, p) < 0)
 		return -1;
 
@@ -771,21 +1070,29 @@ int begin_put_request(obexsession *os) {
 	return 0;
 }
 
-int obex_put(obexsession *os, char *name) {
+int obex_put(obexsession *os, char *name, long long size, long mtime, FILE *spool) {
 
+	free(os->filename);	/* left by a request that failed */
 	os->filename = strdup(name);
 	os->offset = 0;
+	os->putsize = size;
+	os->putmtime = mtime;
+
+	/* everything written is kept until close, so the PUT can be
+	   repeated if it gets interrupted */
+	if (os->spool && os->ownspool) fclose(os->spool);
+	os->ownspool = (spool == NULL);
+	os->spool = os->ownspool ? tmpfile() : spool;
+	os->written = 0;
+
 	return begin_put_request(os);
 }
-	
-int obex_write(obexsession *os, void *buf, int size) {
 
-	obexpacket *p = os->pd;
-	unsigned char *ptr;
-	int l, n, r;
+/* fill PUT packets with data, sending them as they get full */
+int put_data(obexsession *os, unsigned char *ptr, int n) {
 
-	ptr = buf;
-	n = size;
+	obexpacket *p = os->pd;
+	int l, r;
 
 	while (n > 0) {
 
@@ -818,23 +1125,91 @@ int obex_write(obexsession *os, void *buf, int size) {
 		}
 	}
 
-	return size - n;
+	return 0;
+}
+
+/*
+ * Start the PUT again and send the spooled data. The phone can't
+ * append to a file, so it is all of it, but the caller doesn't
+ * have to know.
+ */
+int replay_put(obexsession *os) {
+
+	unsigned char buf[BLOCKSIZE];
+	long long total = os->written;
+	int n;
+
+	if (os->spool == NULL) {
+		errno = EIO;
+		return -1;
+	}
+
+	fflush(os->spool);
+	if (begin_put_request(os) != 0)
+		return -1;
+
+	os->offset = 0;
+	while (os->offset < total) {
+		n = (total - os->offset > sizeof(buf)) ? sizeof(buf) : total - os->offset;
+		n = pread(fileno(os->spool), buf, n, os->offset);
+		if (n <= 0 || put_data(os, buf, n) < 0)
+			break;
+	}
+
+	return (os->offset == total) ? 0 : -1;
+}
+
+int resume_put(obexsession *os) {
+
+	int i;
+
+	for (i=0; i<RECOVER_TRIES; i++) {
+		if (recover(os) == 0 && replay_put(os) == 0)
+			return 0;
+	}
+
+	return -1;
+}
+
+int obex_write(obexsession *os, void *buf, int size) {
+
+	if (os->ownspool && os->spool && fwrite(buf, 1, size, os->spool) != size) {
+		fclose(os->spool);
+		os->spool = NULL;
+	}
+	os->written += size;
+
+	if (put_data(os, buf, size) < 0) {
+		if (os->connected || resume_put(os) < 0)
+			return -1;
+	}
+
+	return size;
 }
 
 int obex_suspend(obexsession *os) {
 
+	if (os->mode == OBEX_IDLE || os->suspended)
+		return 0;
+
+	settle(os);
+	os->suspended = 1;
+	if (os->mode == OBEX_GET && os->eof)
+		return 0;
+
 	return abort_exchange(os);
 }
 
 int obex_resume(obexsession *os) {
 
+	os->suspended = 0;
 	switch (os->mode) {
 
 		case OBEX_GET:
-			return begin_get_request(os);
+			return (begin_get_request(os) < 0) ? -1 : 0;
 
 		case OBEX_PUT:
-			return begin_put_request(os);
+			return replay_put(os);
 
 		default:
 			return -1;
@@ -844,36 +1219,59 @@ int obex_resume(obexsession *os) {
 int obex_close(obexsession *os) {
 
 	obexpacket *p = os->pd;
-	int l, r = 0;
+	int i, l, n, r = 0;
 
+	settle(os);
 	switch (os->mode) {
 
 		case OBEX_GET:
-			if (! os->eof) {
+			if (! os->eof && ! os->suspended) {
 				abort_exchange(os);
 			}
 			break;
 
 		case OBEX_PUT:
-			init_packet(p, 0x82);
-			p->data[3] = 0x49;
-			l = p->len = os->len;
-			l -= 3;
-			p->data[4] = (l >> 8);
-			p->data[5] = (l & 0xff);
-
-			if (send_packet(os, p) < 0) {
-				r = -1;
-			} else if (recv_packet(os, p) != 0xa0) {
+			if (os->suspended && obex_resume(os) < 0) {
 				r = -1;
+				break;
+			}
+			for (i=0; ; i++) {
+				init_packet(p, 0x82);
+				p->data[3] = 0x49;
+				l = p->len = os->len;
+				l -= 3;
+				p->data[4] = (l >> 8);
+				p->data[5] = (l & 0xff);
+
+				n = (send_packet(os, p) < 0) ? -1 : recv_packet(os, p);
+				if (n == 0xa0)
+					break;
+				if (os->connected || i >= RECOVER_TRIES || resume_put(os) < 0) {
+					r = -1;
+					break;
+				}
 			}
 			break;
 	}
 
+	if (os->spool && os->ownspool)
+		fclose(os->spool);
+	os->spool = NULL;
 	free(os->filename);
 	os->filename = NULL;
 	os->mode = OBEX_IDLE;
-	return 0;
+	os->suspended = 0;
+	return r;
+}
+
+int obex_buffered(obexsession *os) {
+
+	return (os->mode == OBEX_GET && ! os->suspended) ? os->len : 0;
+}
+
+int obex_room(obexsession *os) {
+
+	return (os->mode == OBEX_PUT) ? os->maxsize - os->len : 0;
 }
 
 int obex_mkdir(obexsession *os, char *name) {
@@ -884,12 +1282,13 @@ int obex_mkdir(obexsession *os, char *name) {
 	return cdto(os, name, 0, 1);
 }
 
-int getinfo(obexsession *os, unsigned char req) {
+long long getinfo(obexsession *os, unsigned char req) {
 
 	obexpacket *p = os->pc;
 	unsigned char reqstr[3] = "\x32\x01";
 	unsigned char *s;
-	int n, l;
+	long long n;
+	int l;
 
 	if (handshake(os) != 0)
 		return 0;
@@ -906,6 +1305,7 @@ int getinfo(obexsession *os, unsigned char req) {
 		if (s != NULL && *(s+2) == 0x32) {
 			n = 0;
 			l = *(s+3);
+			if (l > 8) l = 8;
 			for (s+=4; l>0; s++,l--) {
 				n = (n << 8) + *s;
 			}
@@ -915,25 +1315,36 @@ int getinfo(obexsession *os, unsigned char req) {
 	return n;
 }
 
-int obex_capacity(obexsession *os) {
+long long obex_capacity(obexsession *os) {
 
 	return getinfo(os, 0x01);
 }
 
-int obex_available(obexsession *os) {
+long long obex_available(obexsession *os) {
 
 	return getinfo(os, 0x02);
 }
 
+int move_item(obexsession *os, char *src, char *dest);
+int delete_item(obexsession *os, char *name);
+int delete_here(obexsession *os, char *name);
+int chmod_item(obexsession *os, char *name, unsigned int mode);
+
 int obex_move(obexsession *os, char *src, char *dest) {
 
+	if (handshake(os) != 0)
+		return -1;
+
+	return move_item(os, src, dest);
+}
+
+/* the operations without a link check, for obex_batch() too */
+int move_item(obexsession *os, char *src, char *dest) {
+
 	unsigned char buf[540];
 	obexpacket *p = os->pc;
 	int l, n;
 
-	if (handshake(os) != 0)
-		return -1;
-
 	init_packet(p, 0x82);
 	n = 0;
 	strcpy(buf+n, "\x34\x04move");
@@ -958,16 +1369,27 @@ int obex_move(obexsession *os, char *src, char *dest) {
 
 int obex_delete(obexsession *os, char *name) {
 
-	obexpacket *p = os->pc;
-
 	if (handshake(os) != 0)
 		return -1;
 
+	return delete_item(os, name);
+}
+
+int delete_item(obexsession *os, char *name) {
+
 	if (cdto(os, name, 1, 0) < 0)
 		return -1;
 
+	return delete_here(os, lastitem(name));
+}
+
+/* name in the current folder */
+int delete_here(obexsession *os, char *name) {
+
+	obexpacket *p = os->pc;
+
 	init_packet(p, 0x82);
-	append_unicode(p, 0x01, lastitem(name));
+	append_unicode(p, 0x01, name);
 	if (send_packet(os, p) < 0)
 		return -1;
 
@@ -979,14 +1401,19 @@ int obex_delete(obexsession *os, char *name) {
 
 int obex_chmod(obexsession *os, char *name, unsigned int mode) {
 
+	if (handshake(os) != 0)
+		return -1;
+
+	return chmod_item(os, name, mode);
+}
+
+int chmod_item(obexsession *os, char *name, unsigned int mode) {
+
 	unsigned char *umode[4] = { "\"D\"", "\"WD\"", "\"RD\"", "\"RWD\"" };
 	unsigned char *gmode[4] = { "\"\"", "\"W\"", "\"R\"", "\"RW\"" };
 	unsigned char buf[16];
 	obexpacket *p = os->pc;
 
-	if (handshake(os) != 0)
-		return -1;
-
 	if (cdto(os, name, 1, 0) < 0)
 		return -1;
 
@@ -1007,3 +1434,309 @@ int obex_chmod(obexsession *os, char *name, unsigned int mode) {
 	return 0;
 }
 
+
+/* length of the folder part of a path, leading slashes skipped */
+int folder_len(char *name) {
+
+	char *s, *e;
+
+	while (*name == '/' || *name == '\\') name++;
+	s = strrchr(name, '/');
+	e = strrchr(name, '\\');
+	if (e > s) s = e;
+
+	return (s == NULL) ? 0 : s - name;
+}
+
+/* a is b, or a folder above it */
+int path_above(char *a, char *b) {
+
+	int l;
+
+	while (*a == '/' || *a == '\\') a++;
+	while (*b == '/' || *b == '\\') b++;
+	l = strlen(a);
+	while (l > 0 && (a[l-1] == '/' || a[l-1] == '\\')) l--;
+
+	return l == 0 || (strncasecmp(a, b, l) == 0 && (b[l] == '\0' || b[l] == '/' || b[l] == '\\'));
+}
+
+/* the order of a and b matters */
+int ops_depend(obexop *a, obexop *b) {
+
+	char *pa[2] = { a->name, a->dest }, *pb[2] = { b->name, b->dest };
+	int i, j;
+
+	for (i=0; i<2; i++) {
+		for (j=0; j<2; j++) {
+			if (pa[i] == NULL || pb[j] == NULL) continue;
+			if (path_above(pa[i], pb[j]) || path_above(pb[j], pa[i]))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* the folder op leaves the phone in, -1 for a move (paths are
+   absolute); a mkdir ends inside the new folder */
+int op_folder(obexop *op, char **f) {
+
+	char *s = op->name;
+	int l;
+
+	while (*s == '/' || *s == '\\') s++;
+	*f = s;
+	if (op->op == OBEX_OP_MOVE)
+		return -1;
+	if (op->op != OBEX_OP_MKDIR)
+		return folder_len(s);
+
+	l = strlen(s);
+	while (l > 0 && (s[l-1] == '/' || s[l-1] == '\\')) l--;
+	return l;
+}
+
+int run_op(obexsession *os, obexop *op) {
+
+	switch (op->op) {
+		case OBEX_OP_DELETE:
+			return delete_item(os, op->name);
+		case OBEX_OP_MKDIR:
+			return cdto(os, op->name, 0, 1);
+		case OBEX_OP_MOVE:
+			return move_item(os, op->name, op->dest);
+		case OBEX_OP_CHMOD:
+			return chmod_item(os, op->name, op->mode);
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+int obex_batch(obexsession *os, obexop *ops, int n) {
+
+	char *cur = NULL, *f;
+	int curlen = -1, left, failed = 0, retried, i, j, k, l, e;
+	int *wait, *first, *next;
+
+	if (n <= 0)
+		return 0;
+	for (i=0; i<n; i++)
+		ops[i].result = EIO;
+
+	/* wait[i]: earlier operations i has to wait for; the ones
+	   waiting for j are next[first[j]...first[j+1]-1] */
+	wait = calloc(2 * n + 1, sizeof(int));
+	if (wait == NULL)
+		return -1;
+	first = wait + n;
+	next = NULL;
+	for (e=0, j=0; j<n; j++) {
+		for (i=j+1; i<n; i++) {
+			if (ops_depend(&ops[j], &ops[i])) {
+				wait[i]++;
+				e++;
+			}
+		}
+	}
+	if (e > 0) {
+		next = malloc(e * sizeof(int));
+		if (next == NULL) {
+			free(wait);
+			return -1;
+		}
+		for (e=0, j=0; j<n; j++) {
+			first[j] = e;
+			for (i=j+1; i<n; i++)
+				if (ops_depend(&ops[j], &ops[i]))
+					next[e++] = i;
+		}
+	}
+	first[n] = e;
+
+	if (handshake(os) != 0) {
+		free(next);
+		free(wait);
+		return -1;
+	}
+
+	for (left = n; left > 0; left--) {
+
+		/* the first ready one in the current folder, or else the
+		   first ready one */
+		k = -1;
+		for (i=0; i<n; i++) {
+			if (wait[i] != 0) continue;
+			if (k < 0) k = i;
+			l = op_folder(&ops[i], &f);
+			if (l < 0 || (l == curlen && strncasecmp(f, cur, l) == 0)) {
+				k = i;
+				break;
+			}
+		}
+
+		l = op_folder(&ops[k], &f);
+		if (l >= 0) {
+			cur = f;
+			curlen = l;
+		}
+
+		/* a lost link is set up again, once per operation */
+		for (retried = 0; ; retried++) {
+			if (run_op(os, &ops[k]) == 0) {
+				ops[k].result = 0;
+				break;
+			}
+			ops[k].result = errno;
+			if (os->connected)
+				break;
+			if (retried || handshake(os) != 0) {
+				free(next);
+				free(wait);
+				return -1;
+			}
+		}
+		if (ops[k].result != 0)
+			failed++;
+
+		wait[k] = -1;
+		if (next != NULL)
+			for (e=first[k]; e<first[k+1]; e++)
+				wait[next[e]]--;
+	}
+
+	free(next);
+	free(wait);
+	return failed;
+}
+
+/* empty the current folder, path: its files from one listing, then
+   each subfolder entered once, emptied and deleted from here */
+int rmtree_here(obexsession *os, char *path) {
+
+	obexdirentry *e;
+	char *dirs = NULL, *s, *sub, *t;
+	int l = 0, size = 0, n, r, er = 0;
+
+	if (list_here(os) < 0)
+		return -1;
+	while ((e = obex_nextentry(os)) != NULL) {
+		if (e->isdir) {
+			n = strlen(e->name) + 1;
+			if (l + n > size) {
+				size = 2 * size + n + 256;
+				t = realloc(dirs, size);
+				if (t == NULL) {
+					free(dirs);
+					return -1;
+				}
+				dirs = t;
+			}
+			memcpy(dirs + l, e->name, n);
+			l += n;
+		} else if (delete_here(os, e->name) < 0) {
+			if (! os->connected) {
+				free(dirs);
+				return -1;
+			}
+			if (er == 0) er = errno;
+		}
+	}
+
+	for (s = dirs; s != NULL && s < dirs + l; s += strlen(s) + 1) {
+		sub = malloc(strlen(path) + strlen(s) + 2);
+		if (sub == NULL) {
+			free(dirs);
+			return -1;
+		}
+		sprintf(sub, "%s/%s", path, s);
+		r = cdto(os, sub, 0, 0);
+		if (r == 0)
+			r = rmtree_here(os, sub);
+		free(sub);
+		if (r < 0 && er == 0) er = errno;
+		if (! os->connected || cdto(os, path, 0, 0) < 0) {
+			free(dirs);
+			return -1;
+		}
+		if (r == 0 && delete_here(os, s) < 0 && er == 0)
+			er = errno;
+	}
+	free(dirs);
+
+	errno = er;
+	return (er == 0) ? 0 : -1;
+}
+
+int obex_rmtree(obexsession *os, char *name) {
+
+	char *s = name;
+
+	if (handshake(os) != 0)
+		return -1;
+
+	while (*s == '/' || *s == '\\') s++;
+	if (cdto(os, name, 0, 0) < 0) {
+		/* not a folder, perhaps a file */
+		if (! os->connected || *s == '\0')
+			return -1;
+		return delete_item(os, name);
+	}
+	if (rmtree_here(os, name) < 0)
+		return -1;
+
+	/* the root stays */
+	return (*s == '\0') ? 0 : delete_item(os, name);
+}
+
+/* paths in the order of a walk of their tree: by folder names,
+   case ignored, a folder before what is in it */
+int pathcmp(const void *a, const void *b) {
+
+	const unsigned char *s = *(const unsigned char **)a, *t = *(const unsigned char **)b;
+	int c, d;
+
+	for (;; s++, t++) {
+		c = (*s == '\\') ? '/' : tolower(*s);
+		d = (*t == '\\') ? '/' : tolower(*t);
+		if (c != d || c == '\0')
+			break;
+	}
+	if (c == '/') c = 1;
+	if (d == '/') d = 1;
+
+	return c - d;
+}
+
+/* a batch of mkdirs in walk order: each creates what is missing
+   on its way and stays in the new folder for the next one */
+int obex_mkdirs(obexsession *os, char **names, int n) {
+
+	char **sorted;
+	obexop *ops;
+	int i, er = 0;
+
+	sorted = malloc(n * sizeof(char *) + 1);
+	ops = calloc(n + 1, sizeof(obexop));
+	if (sorted == NULL || ops == NULL) {
+		free(sorted);
+		free(ops);
+		return -1;
+	}
+	memcpy(sorted, names, n * sizeof(char *));
+	qsort(sorted, n, sizeof(char *), pathcmp);
+	for (i=0; i<n; i++) {
+		ops[i].op = OBEX_OP_MKDIR;
+		ops[i].name = sorted[i];
+	}
+
+	obex_batch(os, ops, n);
+	for (i=0; i<n && er == 0; i++)
+		er = ops[i].result;
+	free(ops);
+	free(sorted);
+
+	errno = er;
+	return (er == 0) ? 0 : -1;
+}
@@ -9,12 +9,17 @@
 #ifndef OBEX_H
 #define OBEX_H
 
+#include <stdio.h>
 #include "transport.h"
+#include "engine.h"
 
 #define OBEX_IDLE 0
 #define OBEX_GET 1
 #define OBEX_PUT 2
 
+#define OBEX_TARGET_FLEX 0	/* the file system */
+#define OBEX_TARGET_SYNC 1	/* IrMC sync, see irmc.h */
+
 #define BLOCKSIZE 2048
 //#define BLOCKSIZE 16384
 #define MAXPACKETSIZE (BLOCKSIZE+6)
@@ -40,7 +45,7 @@ typedef struct _obexdirentry {
 
 	char name[256];
 	int isdir;
-	int size;
+	long long size;
 	long mtime;
 	int mode;
 
@@ -50,8 +55,13 @@ typedef struct _obexsession {
 
 	tra_connection *b;
 	int connected;
+	int probe;		/* requests may set the link up from scratch */
+	int conngen;		/* bumped on every OBEX CONNECT */
+	int session;		/* an OBEX connection is open */
+	int target;		/* the target it is, or was last, on */
 	int maxsize;
 	int mode;
+	int suspended;		/* GET/PUT aborted by obex_suspend() */
 	obexpacket *pc, *pd;
 	int len;
 	unsigned char *pos;
@@ -62,7 +72,18 @@ typedef struct _obexsession {
 	unsigned char *dirpos;
 	obexdirentry direntry;
 	char *filename;
-	long offset;
+	long long offset;
+	long long putsize;	/* Length and Time of the current PUT, */
+	long putmtime;		/* -1 and 0 if not known */
+	int ahead;		/* next GET packet requested in advance */
+	eng_req areq;
+	FILE *spool;		/* data of the current PUT */
+	int ownspool;		/* made by obex_put(), not the caller's */
+	long long written;	/* bytes given to obex_write() */
+	int recoveries;		/* link drops survived */
+	long long recovery_us;	/* time spent recovering */
+	int lastop;		/* opcode of the request in flight */
+	long long tsent;	/* when it was sent, us */
 
 } obexsession;
 
@@ -79,6 +100,51 @@ typedef struct _obexsession {
 obexsession *obex_startup(char *device, int speed);
 
 
+/*
+ * Set up the link and OBEX connection now rather than on the
+ * first request. Returns 0 if the phone is connected.
+ *
+ * Requests bring a dead link back themselves, with the full AT
+ * and BFB probe if need be. A caller that does that elsewhere
+ * clears os->probe: requests then only reopen the port, and fail
+ * with os->connected clear if that isn't enough; obex_connect()
+ * and obex_reconnect() still probe.
+ */
+int obex_connect(obexsession *os);
+
+
+/*
+ * Drop the link and set it up again (reopening the port), eg.
+ * after a bad cable was replaced. A suspended transfer is resumed
+ * by its next read or write.
+ */
+int obex_reconnect(obexsession *os);
+
+
+/*
+ * Switch the line to another baudrate. A BFB link is switched at
+ * once; otherwise the speed is used from the next link setup.
+ * Returns -1 with errno EINVAL for a rate the phone doesn't know.
+ */
+int obex_setspeed(obexsession *os, int speed);
+
+
+/*
+ * Connect to another OBEX target of the phone (the file
+ * operations switch back by themselves). A transfer in progress
+ * has to be suspended first. Returns 0 or -1 with errno set.
+ */
+int obex_target(obexsession *os, int target);
+
+
+/*
+ * Get a whole object by its full name, without changing folders,
+ * as the IrMC sync target wants it. *data is malloc'ed and NUL
+ * terminated. Returns its length or -1 with errno set.
+ */
+long long obex_getobj(obexsession *os, char *name, char **data);
+
+
 /*
  * Terminate an OBEX session, exit BFB mode and close 
  * communication port.
@@ -105,19 +171,29 @@ obexdirentry *obex_nextentry(obexsession *os);
  * GET and PUT operations.
  * - call obex_get()/obex_put() to start reading/writing
  *   a file. obex_get() returns file size on success (0 if
- *   size is not known), -1 on error. obex_put() returns
- *   0 on success, -1 on error. Reading can be started
- *   from any position, writing is sequential only.
+ *   size is not known), -1 on error. Sizes and offsets are
+ *   64-bit, though OBEX can't tell sizes of 4 GB and more.
+ *   obex_put() returns 0 on success, -1 on error. It tells
+ *   the phone the size (if not -1) and the modification time
+ *   (if not 0) of the file, so a phone short of space can
+ *   refuse it at once, with errno ENOSPC. Reading can be
+ *   started from any position, writing is sequential only.
+ *   A caller that has the data in a file already passes it as
+ *   spool (it is read with pread() and not closed), else the
+ *   data written is copied to a spool of obex_put()'s own.
  * - call obex_read()/obex_write() one or more times.
  *   They return number of successfully read/written bytes,
  *   or -1 if error occured.
  * - call obex_close() to complete operation. (This call
  *   is obigatory, don't forget it!)
+ * If the link drops in the middle, it is reconnected and the
+ * transfer picks up where it was: a GET continues at the current
+ * offset, a PUT is repeated from a spool file.
  */
-int obex_get(obexsession *os, char *name, long offset);
+long long obex_get(obexsession *os, char *name, long long offset);
 int obex_read(obexsession *os, void *buf, int size);
 
-int obex_put(obexsession *os, char *name);
+int obex_put(obexsession *os, char *name, long long size, long mtime, FILE *spool);
 int obex_write(obexsession *os, void *buf, int size);
 
 int obex_close(obexsession *os);
@@ -125,12 +201,25 @@ int obex_close(obexsession *os);
 
 /*
  * Suspend/resume current GET or PUT session to perform quick
- * operation (readdir, stat etc.)
+ * operation (readdir, stat etc.). os->suspended is set between
+ * the two calls. obex_close() can be called on a suspended
+ * session directly.
  */
 int obex_suspend(obexsession *os);
 int obex_resume(obexsession *os);
 
 
+/*
+ * For callers that interleave other requests with a transfer at
+ * packet boundaries: obex_buffered() returns the number of bytes
+ * obex_read() can return without talking to the phone,
+ * obex_room() the number of bytes obex_write() accepts before it
+ * sends the next packet.
+ */
+int obex_buffered(obexsession *os);
+int obex_room(obexsession *os);
+
+
 /*
  * Create a new directory. Returns 0 on success, -1 on error
  */
@@ -141,9 +230,12 @@ int obex_mkdir(obexsession *os, char *name);
  * Get total capacity of device memory (obex_capacity()) and
  * free space (obex_available()) in bytes. These calls always
  * succeed - if no device connected, 0 is returned.
+ * os->conngen changes whenever a new OBEX connection is made,
+ * so callers can tell if cached values still belong to the
+ * same device.
  */
-int obex_capacity(obexsession *os);
-int obex_available(obexsession *os);
+long long obex_capacity(obexsession *os);
+long long obex_available(obexsession *os);
 
 
 /*
@@ -160,10 +252,56 @@ int obex_move(obexsession *os, char *src, char *dest);
 int obex_delete(obexsession *os, char *name);
 
 
+/*
+ * Delete a file or directory with all it contains (rm -r). Each
+ * folder is listed once and entered once: its files are deleted
+ * there, then its subfolders one after the other. Deleting the
+ * root empties it. Returns 0, or -1 with errno of the first
+ * failure; whatever could be deleted is gone.
+ */
+int obex_rmtree(obexsession *os, char *name);
+
+
+/*
+ * Create n directories with their missing parents (mkdir -p),
+ * as one obex_batch() walking them as a tree so common parents
+ * are entered once. Returns 0, or -1 with errno of the first
+ * failure.
+ */
+int obex_mkdirs(obexsession *os, char **names, int n);
+
+
 /* 
  * Change a file/directory attributes. mode is standart UNIX
  * value. Only 4 bits are meaningful: -rw-rw----
  */ 
 int obex_chmod(obexsession *os, char *name, unsigned int mode);
 
+
+/*
+ * Run several of the above as one batch. Operations are reordered
+ * to group them by folder where that can't change the outcome (an
+ * operation never passes one on the same path, its parents or its
+ * children), the link is checked once and each folder is entered
+ * once. result of every operation is set to 0 or an errno value.
+ * Returns the number of failed operations, -1 if the link was lost
+ * (those not done get EIO).
+ */
+#define OBEX_OP_DELETE 1
+#define OBEX_OP_MKDIR 2
+#define OBEX_OP_MOVE 3		/* name to dest */
+#define OBEX_OP_CHMOD 4		/* name to mode */
+
+typedef struct _obexop {
+
+	int op;
+	char *name;
+	char *dest;
+	unsigned int mode;
+	int result;
+
+} obexop;
+
+int obex_batch(obexsession *os, obexop *ops, int n);
+
 #endif
@@ -0,0 +1,180 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* transfer scheduler - a single thread owning the obex session */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "sched.h"
+
+/* take the first job of a class below maxclass, called with s->mx held */
+static schedjob *dequeue(scheduler *s, int maxclass) {
+
+	schedjob *j;
+	int c;
+
+	for (c=0; c<maxclass; c++) {
+		j = s->head[c];
+		if (j != NULL) {
+			s->head[c] = j->next;
+			if (s->head[c] == NULL) s->tail[c] = NULL;
+			s->queued--;
+			return j;
+		}
+	}
+
+	return NULL;
+}
+
+static void run(scheduler *s, schedjob *j) {
+
+	/* a waited for job is gone as soon as it is done */
+	int detached = j->detached;
+
+	errno = 0;
+	j->result = j->fn(j->arg);
+	j->error = errno;
+
+	if (detached) {
+		free(j);
+		return;
+	}
+	pthread_mutex_lock(&s->mx);
+	j->done = 1;
+	pthread_cond_broadcast(&s->done);
+	pthread_mutex_unlock(&s->mx);
+}
+
+static void *worker(void *arg) {
+
+	scheduler *s = arg;
+	schedjob *j;
+
+	s->self = pthread_self();
+	pthread_mutex_lock(&s->mx);
+	while (1) {
+		j = dequeue(s, SCHED_CLASSES);
+		if (j == NULL) {
+			if (s->stop) break;
+			pthread_cond_wait(&s->work, &s->mx);
+			continue;
+		}
+		pthread_mutex_unlock(&s->mx);
+		run(s, j);
+		pthread_mutex_lock(&s->mx);
+	}
+	pthread_mutex_unlock(&s->mx);
+
+	return NULL;
+}
+
+static void enqueue(scheduler *s, schedjob *j) {
+
+	j->next = NULL;
+	j->done = 0;
+
+	pthread_mutex_lock(&s->mx);
+	if (s->tail[j->class])
+		s->tail[j->class]->next = j;
+	else
+		s->head[j->class] = j;
+	s->tail[j->class] = j;
+	s->queued++;
+	pthread_cond_signal(&s->work);
+	pthread_mutex_unlock(&s->mx);
+}
+
+scheduler *sched_start(void) {
+
+	scheduler *s;
+
+	s = (scheduler *) malloc(sizeof(scheduler));
+	if (s == NULL) return NULL;
+	memset(s, 0, sizeof(scheduler));
+	pthread_mutex_init(&s->mx, NULL);
+	pthread_cond_init(&s->work, NULL);
+	pthread_cond_init(&s->done, NULL);
+
+	if (pthread_create(&s->thread, NULL, worker, s) != 0) {
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+void sched_stop(scheduler *s) {
+
+	pthread_mutex_lock(&s->mx);
+	s->stop = 1;
+	pthread_cond_signal(&s->work);
+	pthread_mutex_unlock(&s->mx);
+
+	pthread_join(s->thread, NULL);
+	pthread_mutex_destroy(&s->mx);
+	pthread_cond_destroy(&s->work);
+	pthread_cond_destroy(&s->done);
+	free(s);
+}
+
+int sched_call(scheduler *s, int class, sched_fn fn, void *arg) {
+
+	schedjob j;
+
+	if (pthread_equal(pthread_self(), s->self))
+		return fn(arg);
+
+	j.class = class;
+	j.fn = fn;
+	j.arg = arg;
+	j.detached = 0;
+	enqueue(s, &j);
+
+	pthread_mutex_lock(&s->mx);
+	while (! j.done)
+		pthread_cond_wait(&s->done, &s->mx);
+	pthread_mutex_unlock(&s->mx);
+
+	errno = j.error;
+	return j.result;
+}
+
+void sched_post(scheduler *s, int class, sched_fn fn, void *arg) {
+
+	schedjob *j;
+
+	j = (schedjob *) malloc(sizeof(schedjob));
+	j->class = class;
+	j->fn = fn;
+	j->arg = arg;
+	j->detached = 1;
+	enqueue(s, j);
+}
+
+int sched_preempt(scheduler *s, int class) {
+
+	schedjob *j;
+	int n = 0;
+
+	/* cheap unlocked test, we are called once per packet */
+	if (s->queued == 0)
+		return 0;
+
+	pthread_mutex_lock(&s->mx);
+	while ((j = dequeue(s, class)) != NULL) {
+		pthread_mutex_unlock(&s->mx);
+		run(s, j);
+		n++;
+		pthread_mutex_lock(&s->mx);
+	}
+	pthread_mutex_unlock(&s->mx);
+
+	return n;
+}
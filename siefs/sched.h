@@ -0,0 +1,86 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <pthread.h>
+
+/* request classes, in order of priority */
+#define SCHED_META 0		/* interactive metadata (stat, readdir...) */
+#define SCHED_READ 1		/* foreground reads */
+#define SCHED_BACKGROUND 2	/* prefetch and write-back */
+#define SCHED_CLASSES 3
+
+typedef int (*sched_fn)(void *arg);
+
+typedef struct _schedjob {
+
+	int class;
+	sched_fn fn;
+	void *arg;
+	int result;
+	int error;		/* errno after fn */
+	int done;
+	int detached;		/* nobody waits, free when done */
+	struct _schedjob *next;
+
+} schedjob;
+
+typedef struct _scheduler {
+
+	pthread_t thread;
+	pthread_t self;		/* thread currently running jobs */
+	pthread_mutex_t mx;
+	pthread_cond_t work;	/* signalled on submit */
+	pthread_cond_t done;	/* broadcast on completion */
+	schedjob *head[SCHED_CLASSES];
+	schedjob *tail[SCHED_CLASSES];
+	int queued;
+	int stop;
+
+} scheduler;
+
+
+/*
+ * Start a scheduler thread. All link access is done from this
+ * thread, one job at a time, highest class first and FIFO
+ * within a class.
+ */
+scheduler *sched_start(void);
+
+
+/*
+ * Stop the scheduler thread after the queued jobs are done.
+ */
+void sched_stop(scheduler *s);
+
+
+/*
+ * Run fn(arg) in the scheduler thread and wait for it. Returns
+ * the value returned by fn, errno is taken over from the job.
+ * Called from the scheduler thread itself, fn is run in place.
+ */
+int sched_call(scheduler *s, int class, sched_fn fn, void *arg);
+
+
+/*
+ * Queue fn(arg) without waiting for it. arg is owned by fn.
+ */
+void sched_post(scheduler *s, int class, sched_fn fn, void *arg);
+
+
+/*
+ * Called by a long running job between OBEX packets: runs all
+ * queued jobs of a higher priority than class in place. Returns
+ * the number of jobs run, so the caller knows it has to resume
+ * its transfer.
+ */
+int sched_preempt(scheduler *s, int class);
+
+#endif
@@ -0,0 +1,316 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* siecap.c - look into link captures (see SIEFS_CAPTURE) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "comm.h"
+
+#define MODE_AT 0
+#define MODE_BFB 1
+#define MODE_QWE3 2
+
+typedef struct {
+
+	long records, opens, speeds;
+	long rxbytes, txbytes;
+	long roundtrips;	/* host to phone turns */
+	long pings, acks, frames, atcmds;
+	long connects, setpaths, gets, puts, aborts, disconnects, others;
+	long long us;		/* total time */
+
+} capstats;
+
+/* host side stream parser */
+static int mode = MODE_AT;
+static unsigned char line[256];
+static int linelen = 0;
+static char reply[16];		/* phone's answer to an AT command */
+static int replylen = 0;
+static int pending = MODE_AT;	/* mode after the next OK */
+static unsigned char blk[3 + 0x20];
+static int blklen = 0;
+static int framewant = 0;	/* bytes of the current BFB frame still to come */
+static unsigned char pkt[3];
+static int pktlen = 0, pktwant = 0;
+
+static int verbose = 0;
+
+static void opcode(capstats *st, int op) {
+
+	const char *name;
+
+	switch (op) {
+		case 0x80: st->connects++; name = "CONNECT"; break;
+		case 0x81: st->disconnects++; name = "DISCONNECT"; break;
+		case 0x85: st->setpaths++; name = "SETPATH"; break;
+		case 0x03: case 0x83: st->gets++; name = "GET"; break;
+		case 0x02: case 0x82: st->puts++; name = "PUT"; break;
+		case 0xff: st->aborts++; name = "ABORT"; break;
+		default: st->others++; name = "?"; break;
+	}
+	if (verbose) printf("\t\t\t%s\n", name);
+}
+
+static void at_line(capstats *st) {
+
+	line[linelen] = '\0';
+	st->atcmds++;
+	if (verbose) printf("\t\t\t%s\n", line);
+	pending = MODE_AT;
+	if (strncasecmp((char *)line, "at^sbfb=1", 9) == 0)
+		pending = MODE_BFB;
+	else if (strncasecmp((char *)line, "at^sqwe=3", 9) == 0)
+		pending = MODE_QWE3;
+	linelen = 0;
+}
+
+/* follow the phone's answers while in AT mode */
+static void phone(unsigned char *p, int n) {
+
+	int i;
+
+	for (i=0; i<n && mode == MODE_AT; i++) {
+		if (p[i] == '\r' || p[i] == '\n') {
+			reply[replylen] = '\0';
+			if (strcmp(reply, "OK") == 0)
+				mode = pending;
+			if (replylen > 0)
+				pending = MODE_AT;
+			replylen = 0;
+		} else if (replylen < sizeof(reply) - 1) {
+			reply[replylen++] = p[i];
+		}
+	}
+}
+
+static void bfb_block(capstats *st) {
+
+	int l = blk[1];
+	unsigned char *d = blk + 3;
+
+	switch (blk[0]) {
+
+		case 0x02:
+			st->pings++;
+			if (verbose) printf("\t\t\tping\n");
+			break;
+
+		case 0x06:
+			if (l >= 9 && strncasecmp((char *)d, "at^sbfb=0", 9) == 0)
+				mode = MODE_AT;
+			st->atcmds++;
+			break;
+
+		case 0x16:
+			if (framewant == 0 && l == 2 && d[0] == 0x01 && d[1] == 0xfe) {
+				st->acks++;
+				break;
+			}
+			if (framewant == 0) {
+				if (l < 6 || (d[0] | 1) != 0x03) break;
+				st->frames++;
+				framewant = ((d[3] << 8) | d[4]) + 7;
+				opcode(st, d[5]);
+			}
+			framewant -= (l < framewant) ? l : framewant;
+			break;
+	}
+}
+
+/* follow what the host sends */
+static void host(capstats *st, unsigned char *p, int n) {
+
+	int i;
+
+	for (i=0; i<n; i++) {
+		switch (mode) {
+
+			case MODE_AT:
+				if (p[i] == '\r' || p[i] == '\n') {
+					if (linelen > 0) at_line(st);
+				} else if (linelen < sizeof(line) - 1) {
+					line[linelen++] = p[i];
+				}
+				break;
+
+			case MODE_BFB:
+				blk[blklen++] = p[i];
+				if (blklen == 3 && (blk[0] ^ blk[1]) != blk[2]) {
+					/* not a block header, resync */
+					memmove(blk, blk+1, 2);
+					blklen = 2;
+				}
+				if (blklen >= 3 && (blklen == 3 + blk[1] || blklen == sizeof(blk))) {
+					bfb_block(st);
+					blklen = 0;
+				}
+				break;
+
+			case MODE_QWE3:
+				if (pktwant == 0) {
+					pkt[pktlen++] = p[i];
+					if (pktlen == 3) {
+						st->frames++;
+						opcode(st, pkt[0]);
+						pktwant = ((pkt[1] << 8) | pkt[2]) - 3;
+						pktlen = 0;
+					}
+				} else {
+					pktwant--;
+				}
+				break;
+		}
+	}
+}
+
+static void dump(unsigned char *p, int n) {
+
+	int i;
+
+	for (i=0; i<n && i<16; i++)
+		printf(" %02x", p[i]);
+	if (n > 16) printf(" ...");
+	printf("\n");
+}
+
+static int scan(const char *path, capstats *st) {
+
+	FILE *f;
+	unsigned char hdr[CAP_HDRLEN], *data = NULL;
+	unsigned long dt;
+	int l, last = 0;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	if (fread(hdr, 1, CAP_MAGICLEN, f) != CAP_MAGICLEN ||
+		memcmp(hdr, CAP_MAGIC, CAP_MAGICLEN) != 0)
+	{
+		fprintf(stderr, "%s: not a capture file\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	memset(st, 0, sizeof(capstats));
+	data = malloc(0x10000);
+	while (fread(hdr, 1, CAP_HDRLEN, f) == CAP_HDRLEN) {
+		dt = hdr[1] | (hdr[2] << 8) | (hdr[3] << 16) | ((unsigned long)hdr[4] << 24);
+		l = hdr[5] | (hdr[6] << 8);
+		if (fread(data, 1, l, f) != l) break;
+		st->records++;
+		st->us += dt;
+		if (verbose) printf("%10.3f %c %5i", st->us / 1000.0, hdr[0], l);
+
+		switch (hdr[0]) {
+
+			case CAP_OPEN:
+				/* the phone stays in its mode */
+				st->opens++;
+				pending = mode;
+				blklen = linelen = replylen = pktlen = pktwant = framewant = 0;
+				if (verbose) printf("\n");
+				break;
+
+			case CAP_SPEED:
+				st->speeds++;
+				if (verbose) printf(" %i\n", data[0] | (data[1] << 8) | (data[2] << 16));
+				break;
+
+			case CAP_TX:
+				st->txbytes += l;
+				if (verbose) dump(data, l);
+				host(st, data, l);
+				break;
+
+			case CAP_RX:
+				st->rxbytes += l;
+				if (last == CAP_TX) st->roundtrips++;
+				if (verbose) dump(data, l);
+				phone(data, l);
+				break;
+		}
+		if (hdr[0] == CAP_TX || hdr[0] == CAP_RX)
+			last = hdr[0];
+	}
+
+	free(data);
+	fclose(f);
+	return 0;
+}
+
+static void report(capstats *st) {
+
+	printf("time        %10.1f ms\n", st->us / 1000.0);
+	printf("records     %10li (%li opens, %li speed changes)\n", st->records, st->opens, st->speeds);
+	printf("bytes       %10li sent, %li received\n", st->txbytes, st->rxbytes);
+	printf("round trips %10li\n", st->roundtrips);
+	printf("frames      %10li (%li acks, %li pings, %li AT commands)\n",
+		st->frames, st->acks, st->pings, st->atcmds);
+	printf("obex        %10li CONNECT, %li SETPATH, %li GET, %li PUT, %li ABORT, %li other\n",
+		st->connects, st->setpaths, st->gets, st->puts, st->aborts, st->others + st->disconnects);
+}
+
+static int over(const char *what, long value, long budget) {
+
+	if (budget < 0 || value <= budget)
+		return 0;
+	printf("%s: %li, budget is %li\n", what, value, budget);
+	return 1;
+}
+
+static void usage() {
+
+	fprintf(stderr, "Usage: siecap [options] <capture>\n\n"
+		"Prints what a link capture (made with SIEFS_CAPTURE=<file>) did.\n"
+		"A capture can be played back as the phone with the device\n"
+		"replay:<capture>.\n\n"
+		"Options:\n"
+		"\t-v\t\tlist the records\n"
+		"\t-r <n>\t\tfail if there are more than n round trips\n"
+		"\t-p <n>\t\tfail if there are more than n pings\n"
+		"\t-s <n>\t\tfail if there are more than n SETPATHs\n"
+		"\t-t <ms>\t\tfail if the session took longer\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+
+	capstats st;
+	long rt = -1, pings = -1, setpaths = -1, ms = -1;
+	int c, r = 0;
+
+	while ((c = getopt(argc, argv, "vr:p:s:t:")) != -1) {
+		switch (c) {
+			case 'v': verbose = 1; break;
+			case 'r': rt = atol(optarg); break;
+			case 'p': pings = atol(optarg); break;
+			case 's': setpaths = atol(optarg); break;
+			case 't': ms = atol(optarg); break;
+			default: usage();
+		}
+	}
+	if (optind != argc - 1) usage();
+
+	if (scan(argv[optind], &st) != 0)
+		exit(2);
+	report(&st);
+
+	r |= over("round trips", st.roundtrips, rt);
+	r |= over("pings", st.pings, pings);
+	r |= over("SETPATHs", st.setpaths, setpaths);
+	r |= over("time", st.us / 1000, ms);
+
+	exit(r);
+}
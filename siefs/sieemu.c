@@ -0,0 +1,1336 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* sieemu.c - a pty based Siemens phone emulator for testing and benchmarking */
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include <poll.h>
+#include "transport.h"
+
+#define MODE_AT 0
+#define MODE_BFB 1
+#define MODE_QWE3 2
+
+#define MAXPACKET 0xffff
+#define MAXPATH 1024
+#define RESEND 1000		/* ms without an ack before repeating a frame */
+#define RESENDS 3
+#define SYNC_LOG 1024		/* changes an IrMC change log keeps */
+
+static int g_fd;			/* pty master */
+static int g_mode = MODE_AT;
+static int g_baud = 0;			/* 0 = no throttling */
+static int g_latency = 0;		/* turnaround, ms */
+static int g_maxpacket = MAXPACKET;
+static int g_qwe3 = 0;
+static long long g_capacity = 0;
+static int g_verbose = 0;
+static int g_dropevery = 0;		/* hang up every n requests */
+static char *g_root;
+static char *g_link = "/tmp/sieemu";
+static int g_sfd = -1;
+static int g_closed = 0;
+
+static unsigned char g_seq = 0;
+static int g_iseq = -1;
+static unsigned char *g_last = NULL;	/* last frame as sent, until acked */
+static int g_lastlen = 0, g_resends = 0;
+
+/* obex state */
+static char g_cwd[MAXPATH] = "";
+static int g_peermax = 255;
+
+static unsigned char *g_getbuf = NULL;	/* object being sent: a listing */
+static int g_getfd = -1;		/* or a file, read as it goes */
+static long long g_getlen, g_getpos;
+
+static FILE *g_put = NULL;		/* object being received */
+static char g_putname[MAXPATH];
+static long g_putmtime;
+static long long g_putlen;
+
+static struct {
+	long frames, bytes_in, bytes_out, requests, resent;
+} g_stats;
+
+/* IrMC sync: the records are the files of telecom/pb and telecom/cal,
+   named <luid>.vcf and <luid>.vcs; changes to them are found by
+   looking at the files before answering */
+typedef struct {
+	char luid[64];
+	long long mtime, size;
+	int seen;
+} syncrec;
+
+typedef struct {
+	char type;
+	long cc;
+	char luid[64];
+} syncchange;
+
+static int g_sync = 0;			/* connected to the sync target */
+static long g_did;			/* database id, new every run */
+static struct {
+	syncrec *recs;
+	int count, size;
+	long cc;
+	syncchange log[SYNC_LOG];
+	int loglen;
+	long logfrom;			/* the log has all changes after this */
+	int scanned;			/* the files were looked at before */
+} g_db[2];
+static const char *g_dbname[2] = { "pb", "cal" };
+static const char *g_dbext[2] = { "vcf", "vcs" };
+
+static void usage() {
+
+	fprintf(stderr, "Usage: sieemu [options] <root directory>\n\n"
+		"Options:\n"
+		"\t-l <link>\tsymlink to create for the tty (default /tmp/sieemu)\n"
+		"\t-b <baud>\tthrottle the line to baud rate\n"
+		"\t-t <ms>\t\tturnaround latency before each response\n"
+		"\t-m <bytes>\tmaximum OBEX packet size\n"
+		"\t-c <bytes>\tsimulate a card this big (k, M, G suffixes), free\n"
+		"\t\t\tspace is what the file sizes leave of it\n"
+		"\t-q\t\taccept at^sqwe=3 (default is BFB only)\n"
+		"\t-x <n>\t\tdrop the line every n requests (once, if negative)\n"
+		"\t-v\t\tlog requests to stderr\n");
+	exit(1);
+}
+
+static long long parse_size(char *s) {
+
+	char *e;
+	long long n;
+
+	n = strtoll(s, &e, 0);
+	switch (*e) {
+		case 'k': case 'K': n <<= 10; break;
+		case 'm': case 'M': n <<= 20; break;
+		case 'g': case 'G': n <<= 30; break;
+	}
+	return n;
+}
+
+static void throttle(int n) {
+
+	if (g_baud > 0)
+		usleep((long long)n * 10 * 1000000 / g_baud);
+}
+
+static void tx(void *buf, int len) {
+
+	unsigned char *p = buf;
+	int c;
+
+	throttle(len);
+	g_stats.bytes_out += len;
+	while (len > 0) {
+		c = write(g_fd, p, len);
+		if (c < 0) {
+			if (errno == EINTR || errno == EAGAIN) continue;
+			return;
+		}
+		p += c;
+		len -= c;
+	}
+}
+
+static unsigned char rxbuf[4096];
+static int rxlen = 0, rxpos = 0;
+
+/* open a new pty and point the link at it */
+static void plug() {
+
+	char *slave;
+	struct termios tio;
+
+	g_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (g_fd < 0 || grantpt(g_fd) != 0 || unlockpt(g_fd) != 0) {
+		perror("sieemu: posix_openpt");
+		exit(1);
+	}
+	slave = ptsname(g_fd);
+
+	/* keep the slave open, so the master doesn't see hangups */
+	g_sfd = open(slave, O_RDWR | O_NOCTTY);
+	tcgetattr(g_sfd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(g_sfd, TCSANOW, &tio);
+
+	unlink(g_link);
+	if (symlink(slave, g_link) != 0) {
+		perror("sieemu: symlink");
+		exit(1);
+	}
+	rxlen = rxpos = 0;
+	free(g_last);
+	g_last = NULL;
+}
+
+/* simulate a cable drop: the tty goes away and a new one appears,
+   the phone itself stays in the mode it was */
+static void replug() {
+
+	if (g_verbose) fprintf(stderr, "sieemu: dropping the line\n");
+	close(g_sfd);
+	close(g_fd);
+	plug();
+}
+
+/* next byte from the host, -1 if the line is closed */
+static int rx() {
+
+	unsigned char *buf = rxbuf;
+	int c;
+
+	while (rxpos >= rxlen) {
+		if (g_last != NULL) {
+			/* a phone repeats a frame nobody acked */
+			struct pollfd pfd;
+			pfd.fd = g_fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, RESEND) == 0) {
+				if (g_resends++ < RESENDS) {
+					if (g_verbose) fprintf(stderr, "sieemu: no ack, resending\n");
+					g_stats.resent++;
+					tx(g_last, g_lastlen);
+				} else {
+					free(g_last);
+					g_last = NULL;
+				}
+				continue;
+			}
+		}
+		c = read(g_fd, buf, sizeof(rxbuf));
+		if (c < 0 && errno == EIO) {
+			/* no process has the tty open */
+			usleep(50000);
+			continue;
+		}
+		if (c < 0 && errno == EINTR)
+			continue;
+		if (c <= 0) {
+			g_closed = 1;
+			return -1;
+		}
+		throttle(c);
+		g_stats.bytes_in += c;
+		rxlen = c;
+		rxpos = 0;
+	}
+
+	return buf[rxpos++];
+}
+
+static void turnaround() {
+
+	if (g_latency > 0)
+		usleep(g_latency * 1000);
+}
+
+/* bfb framing */
+
+static void acked() {
+
+	free(g_last);
+	g_last = NULL;
+}
+
+static void bfb_block(int type, unsigned char *data, int len) {
+
+	unsigned char b[3 + 0x20];
+
+	b[0] = type;
+	b[1] = len;
+	b[2] = type ^ len;
+	memcpy(b+3, data, len);
+	tx(b, len+3);
+}
+
+static void bfb_send(unsigned char *data, int len) {
+
+	unsigned char *f;
+	unsigned short csum;
+	int n, l;
+
+	f = malloc(len + 7);
+	f[0] = (g_seq == 0) ? 0x02 : 0x03;
+	f[1] = ~f[0];
+	f[2] = g_seq++;
+	f[3] = len >> 8;
+	f[4] = len & 0xff;
+	memcpy(f+5, data, len);
+	csum = crc16(f+2, len+3);
+	f[5+len] = csum & 0xff;
+	f[6+len] = csum >> 8;
+
+	/* kept as blocks, to be repeated if the ack doesn't come */
+	acked();
+	g_last = malloc(len + 7 + 3 * ((len + 7 + 0x1f) / 0x20));
+	g_lastlen = 0;
+	g_resends = 0;
+	for (n=0; n<len+7; n+=l) {
+		l = (len+7-n > 0x20) ? 0x20 : len+7-n;
+		g_last[g_lastlen++] = 0x16;
+		g_last[g_lastlen++] = l;
+		g_last[g_lastlen++] = 0x16 ^ l;
+		memcpy(g_last + g_lastlen, f+n, l);
+		g_lastlen += l;
+	}
+	tx(g_last, g_lastlen);
+	free(f);
+	g_stats.frames++;
+}
+
+static void send_response(unsigned char *p, int len) {
+
+	p[1] = len >> 8;
+	p[2] = len & 0xff;
+	turnaround();
+	if (g_mode == MODE_BFB)
+		bfb_send(p, len);
+	else
+		tx(p, len);
+}
+
+/* helpers for obex packets */
+
+static int uni2str(unsigned char *u, int len, char *s, int size) {
+
+	int i, n = 0;
+	unsigned int c, c2;
+
+	for (i=0; i+1<len; i+=2) {
+		c = (u[i] << 8) | u[i+1];
+		if (c == 0) break;
+		if (c >= 0xd800 && c < 0xdc00 && i+3 < len) {
+			c2 = (u[i+2] << 8) | u[i+3];
+			c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+			i += 2;
+		}
+		if (n + 4 >= size) break;
+		if (c < 0x80) {
+			s[n++] = c;
+		} else if (c < 0x800) {
+			s[n++] = 0xc0 | (c >> 6);
+			s[n++] = 0x80 | (c & 0x3f);
+		} else if (c < 0x10000) {
+			s[n++] = 0xe0 | (c >> 12);
+			s[n++] = 0x80 | ((c >> 6) & 0x3f);
+			s[n++] = 0x80 | (c & 0x3f);
+		} else {
+			s[n++] = 0xf0 | (c >> 18);
+			s[n++] = 0x80 | ((c >> 12) & 0x3f);
+			s[n++] = 0x80 | ((c >> 6) & 0x3f);
+			s[n++] = 0x80 | (c & 0x3f);
+		}
+	}
+	s[n] = '\0';
+	return n;
+}
+
+typedef struct {
+	unsigned char *name; int namelen;
+	unsigned char *type; int typelen;
+	unsigned char *body; int bodylen;
+	int final_body;
+	unsigned char *appparm; int appparmlen;
+	unsigned char *target; int targetlen;
+	unsigned char *time; int timelen;
+	long long length; int has_length;
+} headers;
+
+static void parse_headers(unsigned char *s, unsigned char *end, headers *h) {
+
+	int l;
+
+	memset(h, 0, sizeof(headers));
+	while (s < end) {
+		switch (*s & 0xc0) {
+			case 0x00:
+			case 0x40:
+				l = (s[1] << 8) + s[2];
+				if (l < 3 || s + l > end) return;
+				switch (*s) {
+					case 0x01: h->name = s+3; h->namelen = l-3; break;
+					case 0x42: h->type = s+3; h->typelen = l-3; break;
+					case 0x48: h->body = s+3; h->bodylen = l-3; break;
+					case 0x49: h->body = s+3; h->bodylen = l-3; h->final_body = 1; break;
+					case 0x4c: h->appparm = s+3; h->appparmlen = l-3; break;
+					case 0x46: h->target = s+3; h->targetlen = l-3; break;
+					case 0x44: h->time = s+3; h->timelen = l-3; break;
+				}
+				s += l;
+				break;
+			case 0x80:
+				s += 2;
+				break;
+			case 0xc0:
+				if (*s == 0xc3) {
+					h->length = ((long long)s[1] << 24) | (s[2] << 16) | (s[3] << 8) | s[4];
+					h->has_length = 1;
+				}
+				s += 5;
+				break;
+		}
+	}
+}
+
+/* paths; join() and hostpath() give NULL for one that doesn't fit
+   in MAXPATH, and hostpath() passes a NULL on so they nest */
+
+static char *join(char *buf, const char *dir, const char *name) {
+
+	if (snprintf(buf, MAXPATH, "%s%s%s", dir, (*dir && *name) ? "/" : "", name) >= MAXPATH)
+		return NULL;
+	return buf;
+}
+
+/* find name in the host directory, case insensitively */
+static int lookup(const char *dir, const char *name, char *found) {
+
+	char path[MAXPATH];
+	DIR *d;
+	struct dirent *e;
+
+	snprintf(path, sizeof(path), "%s/%s", g_root, dir);
+	d = opendir(path);
+	if (d == NULL) return -1;
+	while ((e = readdir(d)) != NULL) {
+		if (strcasecmp(e->d_name, name) == 0) {
+			strcpy(found, e->d_name);
+			closedir(d);
+			return 0;
+		}
+	}
+	closedir(d);
+	return -1;
+}
+
+static char *hostpath(char *buf, const char *rel) {
+
+	if (rel == NULL || snprintf(buf, MAXPATH, "%s/%s", g_root, rel) >= MAXPATH)
+		return NULL;
+	return buf;
+}
+
+/* resolve "/a/b/c" from the root, case insensitively */
+static int resolve(const char *abs, char *rel) {
+
+	char tmp[MAXPATH], found[256], *s, *e;
+
+	strncpy(tmp, abs, MAXPATH-1);
+	tmp[MAXPATH-1] = '\0';
+	*rel = '\0';
+	s = tmp;
+	while (*s) {
+		while (*s == '/' || *s == '\\') s++;
+		if (! *s) break;
+		e = s + strcspn(s, "/\\");
+		if (*e) *(e++) = '\0';
+		if (lookup(rel, s, found) < 0)
+			return -1;
+		if (*rel) strcat(rel, "/");
+		strcat(rel, found);
+		s = e;
+	}
+	return 0;
+}
+
+/* bytes the files under path take, as their sizes say: sparse
+   files fill a simulated card like real ones */
+static long long used(const char *path) {
+
+	char fp[MAXPATH];
+	DIR *d;
+	struct dirent *e;
+	struct stat st;
+	long long n = 0;
+
+	d = opendir(path);
+	if (d == NULL) return 0;
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.') continue;
+		snprintf(fp, sizeof(fp), "%s/%s", path, e->d_name);
+		if (stat(fp, &st) != 0) continue;
+		n += S_ISDIR(st.st_mode) ? used(fp) : st.st_size;
+	}
+	closedir(d);
+
+	return n;
+}
+
+static long long capacity(int total) {
+
+	struct statvfs sv;
+	long long cap, avail;
+
+	if (g_capacity > 0) {
+		avail = g_capacity - used(g_root);
+		return total ? g_capacity : (avail < 0) ? 0 : avail;
+	}
+
+	if (statvfs(g_root, &sv) != 0) return 0;
+	cap = (long long)sv.f_blocks * sv.f_frsize;
+	avail = (long long)sv.f_bavail * sv.f_frsize;
+	return total ? cap : avail;
+}
+
+static void fmt_time(char *buf, time_t t) {
+
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	strftime(buf, 16, "%Y%m%dT%H%M%S", &tm);
+}
+
+static unsigned char *listing(const char *rel, long long *len) {
+
+	char path[MAXPATH], fp[MAXPATH + 256], tbuf[16];
+	DIR *d;
+	struct dirent *e;
+	struct stat st;
+	char *buf;
+	int size = 4096, n;
+
+	if (hostpath(path, rel) == NULL) return NULL;
+	d = opendir(path);
+	if (d == NULL) return NULL;
+
+	buf = malloc(size);
+	n = sprintf(buf, "<?xml version=\"1.0\"?>\n"
+		"<!DOCTYPE folder-listing SYSTEM \"obex-folder-listing.dtd\">\n"
+		"<folder-listing version=\"1.0\">\n");
+	if (*rel) n += sprintf(buf+n, "<parent-folder />\n");
+
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.') continue;
+		snprintf(fp, sizeof(fp), "%s/%s", path, e->d_name);
+		if (stat(fp, &st) != 0) continue;
+		if (n + 512 + strlen(e->d_name) > size) {
+			size *= 2;
+			buf = realloc(buf, size);
+		}
+		fmt_time(tbuf, st.st_mtime);
+		if (S_ISDIR(st.st_mode))
+			n += sprintf(buf+n, "<folder name=\"%s\" modified=\"%s\" "
+				"user-perm=\"RWD\" group-perm=\"RW\"/>\n", e->d_name, tbuf);
+		else
+			n += sprintf(buf+n, "<file name=\"%s\" size=\"%lld\" modified=\"%s\" "
+				"user-perm=\"RWD\" group-perm=\"RW\"/>\n", e->d_name,
+				(long long)st.st_size, tbuf);
+	}
+	closedir(d);
+	n += sprintf(buf+n, "</folder-listing>\n");
+
+	*len = n;
+	return (unsigned char *)buf;
+}
+
+static void append_hdr(unsigned char *p, int *len, int h, void *data, int dlen) {
+
+	p[*len] = h;
+	p[*len+1] = (dlen+3) >> 8;
+	p[*len+2] = (dlen+3) & 0xff;
+	memcpy(p+*len+3, data, dlen);
+	*len += dlen+3;
+}
+
+static void respond(int code) {
+
+	unsigned char p[3];
+
+	p[0] = code;
+	send_response(p, 3);
+}
+
+static void get_end() {
+
+	free(g_getbuf);
+	g_getbuf = NULL;
+	if (g_getfd >= 0) close(g_getfd);
+	g_getfd = -1;
+}
+
+/* next chunk of the object being sent */
+static void get_continue(unsigned char *p, int len) {
+
+	static unsigned char chunk[MAXPACKET];
+	unsigned char *data;
+	long long n, room;
+
+	room = g_peermax - len - 3;
+	if (room > g_maxpacket - len - 3) room = g_maxpacket - len - 3;
+	n = g_getlen - g_getpos;
+	if (n > room) n = room;
+	if (g_getfd >= 0) {
+		n = read(g_getfd, chunk, n);
+		if (n <= 0) {
+			/* file shrunk under us */
+			get_end();
+			respond(0xd0);
+			return;
+		}
+		data = chunk;
+	} else {
+		data = g_getbuf + g_getpos;
+	}
+	append_hdr(p, &len, (g_getpos + n == g_getlen) ? 0x49 : 0x48, data, n);
+	g_getpos += n;
+	p[0] = (g_getpos == g_getlen) ? 0xa0 : 0x90;
+	send_response(p, len);
+	if (g_getpos == g_getlen)
+		get_end();
+}
+
+static void do_get(headers *h, unsigned char *p) {
+
+	char name[512], rel[MAXPATH], path[MAXPATH], found[256];
+	unsigned char parm[16];
+	long long v, offset = 0;
+	int len = 3, fd, i;
+	struct stat st;
+
+	if (h->name == NULL && h->type == NULL && h->appparm == NULL) {
+		if (g_getbuf == NULL && g_getfd < 0) {
+			respond(0xc3);
+			return;
+		}
+		get_continue(p, 3);
+		return;
+	}
+
+	get_end();
+
+	/* capacity queries */
+	if (h->appparm && h->appparmlen >= 3 && h->appparm[0] == 0x32 && h->name == NULL) {
+		v = capacity(h->appparm[2] == 0x01);
+		parm[0] = 0x32;
+		if (v >= 0x100000000LL) {
+			parm[1] = 8;
+			for (i=0; i<8; i++) parm[2+i] = v >> (56 - 8*i);
+		} else {
+			parm[1] = 4;
+			for (i=0; i<4; i++) parm[2+i] = v >> (24 - 8*i);
+		}
+		p[0] = 0xa0;
+		append_hdr(p, &len, 0x4c, parm, parm[1] + 2);
+		send_response(p, len);
+		return;
+	}
+
+	if (h->type && strncmp((char *)h->type, "x-obex/folder-listing", 21) == 0) {
+		g_getbuf = listing(g_cwd, &g_getlen);
+		if (g_getbuf == NULL) {
+			respond(0xc4);
+			return;
+		}
+		g_getpos = 0;
+		get_continue(p, 3);
+		return;
+	}
+
+	if (h->name == NULL) {
+		respond(0xc0);
+		return;
+	}
+
+	uni2str(h->name, h->namelen, name, sizeof(name));
+	if (lookup(g_cwd, name, found) < 0) {
+		respond(0xc4);
+		return;
+	}
+	fd = -1;
+	if (hostpath(path, join(rel, g_cwd, found)) != NULL)
+		fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0 || S_ISDIR(st.st_mode)) {
+		if (fd >= 0) close(fd);
+		respond(0xc4);
+		return;
+	}
+
+	if (h->appparm && h->appparmlen >= 6 && h->appparm[0] == 0x37) {
+		for (i=0; i<4; i++)
+			offset = (offset << 8) | h->appparm[2+i];
+		if (h->appparm[1] == 8 && h->appparmlen >= 10)
+			for (offset=0, i=0; i<8; i++)
+				offset = (offset << 8) | h->appparm[2+i];
+	}
+	if (offset > st.st_size) offset = st.st_size;
+
+	/* large files are sent straight from the disk */
+	g_getlen = st.st_size - offset;
+	g_getpos = 0;
+	lseek(fd, offset, SEEK_SET);
+	g_getfd = fd;
+
+	/* Length is left out for objects it can't express */
+	v = st.st_size;
+	if (v < 0x100000000LL) {
+		p[len] = 0xc3;
+		p[len+1] = (v >> 24) & 0xff;
+		p[len+2] = (v >> 16) & 0xff;
+		p[len+3] = (v >> 8) & 0xff;
+		p[len+4] = v & 0xff;
+		len += 5;
+	}
+	get_continue(p, len);
+}
+
+static long parse_time(unsigned char *t, int len) {
+
+	char buf[32];
+	struct tm tm;
+
+	if (len < 15) return 0;
+	memcpy(buf, t, 15);
+	buf[15] = '\0';
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(buf, "%4d%2d%2dT%2d%2d%2d", &tm.tm_year, &tm.tm_mon,
+		&tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		return 0;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+static void put_finish() {
+
+	char path[MAXPATH];
+	struct timeval tv[2];
+
+	fclose(g_put);
+	g_put = NULL;
+	if (g_putmtime && hostpath(path, g_putname) != NULL) {
+		tv[0].tv_sec = tv[1].tv_sec = g_putmtime;
+		tv[0].tv_usec = tv[1].tv_usec = 0;
+		utimes(path, tv);
+	}
+}
+
+static void do_move(headers *h) {
+
+	char src[512], dst[512], rsrc[MAXPATH], rdir[MAXPATH], p1[MAXPATH], p2[MAXPATH];
+	unsigned char *a = h->appparm, *e = h->appparm + h->appparmlen;
+	char *s;
+
+	*src = *dst = '\0';
+	while (a + 2 <= e) {
+		if (a[0] == 0x35) uni2str(a+2, a[1], src, sizeof(src));
+		if (a[0] == 0x36) uni2str(a+2, a[1], dst, sizeof(dst));
+		a += a[1] + 2;
+	}
+
+	if (resolve(src, rsrc) < 0) {
+		respond(0xc4);
+		return;
+	}
+	/* destination folder must exist */
+	s = strrchr(dst, '/');
+	if (s) *s = '\0';
+	if (resolve(s ? dst : "", rdir) < 0) {
+		respond(0xc4);
+		return;
+	}
+	if (hostpath(p1, rsrc) == NULL || hostpath(rdir, join(p2, rdir, s ? s+1 : dst)) == NULL ||
+		rename(p1, rdir) != 0)
+	{
+		respond(0xc3);
+		return;
+	}
+	respond(0xa0);
+}
+
+static void do_put(int final, headers *h, unsigned char *p) {
+
+	char name[512], found[256], rel[MAXPATH], path[MAXPATH];
+
+	if (final && h->appparm && h->appparmlen > 6 && h->appparm[0] == 0x34 &&
+		memcmp(h->appparm+2, "move", 4) == 0)
+	{
+		do_move(h);
+		return;
+	}
+
+	if (h->name != NULL) {
+		if (g_put) put_finish();
+		uni2str(h->name, h->namelen, name, sizeof(name));
+
+		if (final && h->body == NULL && h->appparm == NULL) {
+			/* delete */
+			if (lookup(g_cwd, name, found) < 0) {
+				respond(0xc4);
+				return;
+			}
+			if (hostpath(path, join(rel, g_cwd, found)) == NULL) {
+				respond(0xc4);
+				return;
+			}
+			if (unlink(path) != 0 && rmdir(path) != 0) {
+				respond(errno == ENOTEMPTY ? 0xc3 : 0xc1);
+				return;
+			}
+			respond(0xa0);
+			return;
+		}
+
+		if (h->appparm && h->appparmlen >= 2 && h->appparm[0] == 0x38) {
+			/* chmod: accepted and ignored */
+			respond(0xa0);
+			return;
+		}
+
+		if (h->has_length && h->length > capacity(0)) {
+			respond(0xe0);
+			return;
+		}
+
+		if (lookup(g_cwd, name, found) == 0)
+			strcpy(name, found);
+		if (hostpath(path, join(g_putname, g_cwd, name)) != NULL)
+			g_put = fopen(path, "wb");
+		if (g_put == NULL) {
+			respond(0xc1);
+			return;
+		}
+		g_putmtime = h->time ? parse_time(h->time, h->timelen) : 0;
+		g_putlen = h->has_length ? h->length : -1;
+	}
+
+	if (g_put == NULL) {
+		respond(0xc0);
+		return;
+	}
+	if (h->body && h->bodylen > 0)
+		fwrite(h->body, 1, h->bodylen, g_put);
+
+	if (final) {
+		put_finish();
+		respond(0xa0);
+	} else {
+		respond(0x90);
+	}
+}
+
+static void do_setpath(unsigned char *pkt, int len) {
+
+	headers h;
+	char name[512], found[256], rel[MAXPATH], path[MAXPATH];
+	int flags = pkt[3];
+	char *s;
+
+	parse_headers(pkt + 5, pkt + len, &h);
+
+	if (flags & 0x01) {
+		/* up */
+		if (! *g_cwd) {
+			respond(0xc4);
+			return;
+		}
+		s = strrchr(g_cwd, '/');
+		if (s) *s = '\0'; else *g_cwd = '\0';
+		respond(0xa0);
+		return;
+	}
+
+	if (h.name == NULL || h.namelen == 0) {
+		*g_cwd = '\0';
+		respond(0xa0);
+		return;
+	}
+
+	uni2str(h.name, h.namelen, name, sizeof(name));
+	if (lookup(g_cwd, name, found) < 0) {
+		if (flags & 0x02) {
+			respond(0xc4);
+			return;
+		}
+		strcpy(found, name);
+		if (hostpath(path, join(rel, g_cwd, found)) == NULL || mkdir(path, 0755) != 0) {
+			respond(0xc1);
+			return;
+		}
+	}
+	if (join(rel, g_cwd, found) == NULL) {
+		respond(0xc4);
+		return;
+	}
+	strcpy(g_cwd, rel);
+	respond(0xa0);
+}
+
+/* IrMC sync */
+
+static void sync_change(int db, char type, const char *luid) {
+
+	syncchange *c;
+
+	if (g_db[db].loglen == SYNC_LOG) {
+		/* forget the older half */
+		g_db[db].loglen = SYNC_LOG / 2;
+		g_db[db].logfrom = g_db[db].log[SYNC_LOG / 2 - 1].cc;
+		memmove(g_db[db].log, g_db[db].log + SYNC_LOG / 2, (SYNC_LOG / 2) * sizeof(syncchange));
+	}
+	c = &g_db[db].log[g_db[db].loglen++];
+	c->type = type;
+	c->cc = ++g_db[db].cc;
+	snprintf(c->luid, sizeof(c->luid), "%s", luid);
+}
+
+/* compare the record files with what they were last time */
+static void sync_scan(int db) {
+
+	char dir[MAXPATH], fp[MAXPATH + 256], luid[64], *e;
+	DIR *d;
+	struct dirent *de;
+	struct stat st;
+	syncrec *r;
+	int i;
+
+	for (i=0; i<g_db[db].count; i++)
+		g_db[db].recs[i].seen = 0;
+
+	snprintf(dir, sizeof(dir), "%s/telecom/%s", g_root, g_dbname[db]);
+	d = opendir(dir);
+	while (d != NULL && (de = readdir(d)) != NULL) {
+		e = strrchr(de->d_name, '.');
+		if (e == NULL || strcasecmp(e + 1, g_dbext[db]) != 0 || e - de->d_name >= sizeof(luid))
+			continue;
+		snprintf(fp, sizeof(fp), "%s/%s", dir, de->d_name);
+		if (stat(fp, &st) != 0 || ! S_ISREG(st.st_mode))
+			continue;
+		snprintf(luid, sizeof(luid), "%.*s", (int)(e - de->d_name), de->d_name);
+
+		for (i=0; i<g_db[db].count && strcmp(g_db[db].recs[i].luid, luid) != 0; i++);
+		if (i == g_db[db].count) {
+			if (g_db[db].count == g_db[db].size) {
+				g_db[db].size = g_db[db].size ? 2 * g_db[db].size : 256;
+				g_db[db].recs = realloc(g_db[db].recs, g_db[db].size * sizeof(syncrec));
+			}
+			r = &g_db[db].recs[g_db[db].count++];
+			strcpy(r->luid, luid);
+			r->mtime = -1;
+		}
+		r = &g_db[db].recs[i];
+		r->seen = 1;
+		if (r->mtime != st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec || r->size != st.st_size) {
+			if (g_db[db].scanned)
+				sync_change(db, 'M', luid);
+			r->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+			r->size = st.st_size;
+		}
+	}
+	if (d != NULL) closedir(d);
+
+	for (i=0; i<g_db[db].count; i++) {
+		if (g_db[db].recs[i].seen) continue;
+		sync_change(db, 'H', g_db[db].recs[i].luid);
+		g_db[db].count--;
+		g_db[db].recs[i] = g_db[db].recs[g_db[db].count];
+		i--;
+	}
+	g_db[db].scanned = 1;
+}
+
+static char *slurp(const char *path, long long *len) {
+
+	struct stat st;
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+	buf = malloc(st.st_size + 1);
+	*len = read(fd, buf, st.st_size);
+	close(fd);
+	if (*len < 0) {
+		free(buf);
+		return NULL;
+	}
+	buf[*len] = '\0';
+	return buf;
+}
+
+/* the whole database, each record with its luid as phones send it */
+static char *sync_dump(int db, long long *len) {
+
+	char fp[MAXPATH], *buf, *rec, *s, *e, *end;
+	long long l, size = 4096;
+	int i;
+
+	buf = malloc(size);
+	*len = sprintf(buf, "%s", (db == 1) ? "BEGIN:VCALENDAR\r\nVERSION:1.0\r\n" : "");
+	for (i=0; i<g_db[db].count; i++) {
+		snprintf(fp, sizeof(fp), "%s/telecom/%s/%s.%s", g_root, g_dbname[db],
+			g_db[db].recs[i].luid, g_dbext[db]);
+		if ((rec = slurp(fp, &l)) == NULL)
+			continue;
+		s = strstr(rec, (db == 1) ? "BEGIN:VEVENT" : "BEGIN:VCARD");
+		if (s == NULL && db == 1)
+			s = strstr(rec, "BEGIN:VTODO");
+		e = (s == NULL) ? NULL : strchr(s, '\n');
+		end = (s == NULL) ? NULL : strstr(s, (db == 1) ? (s[7] == 'E' ? "END:VEVENT" : "END:VTODO") : "END:VCARD");
+		if (e == NULL || end == NULL) {
+			free(rec);
+			continue;
+		}
+		end = strchr(end, '\n') ? strchr(end, '\n') + 1 : end + strlen(end);
+		e++;
+		if (*len + (end - s) + 128 > size) {
+			size = 2 * size + (end - s) + 128;
+			buf = realloc(buf, size);
+		}
+		memcpy(buf + *len, s, e - s);
+		*len += e - s;
+		*len += sprintf(buf + *len, "X-IRMC-LUID:%s\r\n", g_db[db].recs[i].luid);
+		memcpy(buf + *len, e, end - e);
+		*len += end - e;
+		free(rec);
+	}
+	if (db == 1) {
+		buf = realloc(buf, *len + 32);
+		*len += sprintf(buf + *len, "END:VCALENDAR\r\n");
+	}
+	return buf;
+}
+
+/* the change log since cc */
+static char *sync_log(int db, long cc, long long *len) {
+
+	char *buf;
+	int i;
+
+	buf = malloc(256 + g_db[db].loglen * 100);
+	*len = sprintf(buf, "SN:SIEEMU\r\nDID:%lx\r\nTotal-Records:%i\r\nMaximum-Records:%i\r\n",
+		g_did, g_db[db].count, 5000);
+	if (cc < g_db[db].logfrom || cc > g_db[db].cc) {
+		*len += sprintf(buf + *len, "*\r\n");
+		return buf;
+	}
+	for (i=0; i<g_db[db].loglen; i++)
+		if (g_db[db].log[i].cc > cc)
+			*len += sprintf(buf + *len, "%c:%li::%s\r\n", g_db[db].log[i].type,
+				g_db[db].log[i].cc, g_db[db].log[i].luid);
+	return buf;
+}
+
+static void do_sync_get(headers *h, unsigned char *p) {
+
+	char name[512], path[MAXPATH], obj[80], *s;
+	int db;
+
+	if (h->name == NULL) {
+		if (g_getbuf == NULL) {
+			respond(0xc3);
+			return;
+		}
+		get_continue(p, 3);
+		return;
+	}
+	get_end();
+
+	uni2str(h->name, h->namelen, name, sizeof(name));
+	for (db=0; db<2; db++) {
+		snprintf(path, sizeof(path), "telecom/%s", g_dbname[db]);
+		if (strncasecmp(name, path, strlen(path)) == 0)
+			break;
+	}
+	if (db == 2) {
+		respond(0xc4);
+		return;
+	}
+	sync_scan(db);
+
+	s = name + strlen(path);
+	if (*s == '.' && strcasecmp(s + 1, g_dbext[db]) == 0) {
+		g_getbuf = (unsigned char *)sync_dump(db, &g_getlen);
+	} else if (strcasecmp(s, "/luid/cc.log") == 0) {
+		g_getbuf = malloc(32);
+		g_getlen = sprintf((char *)g_getbuf, "%li", g_db[db].cc);
+	} else if (strncasecmp(s, "/luid/", 6) == 0 && strlen(s) < sizeof(obj) + 6) {
+		strcpy(obj, s + 6);
+		s = strrchr(obj, '.');
+		if (s != NULL && strcasecmp(s, ".log") == 0) {
+			g_getbuf = (unsigned char *)sync_log(db, strtol(obj, NULL, 10), &g_getlen);
+		} else if (s != NULL && strcasecmp(s + 1, g_dbext[db]) == 0) {
+			snprintf(path, sizeof(path), "%s/telecom/%s/%s", g_root, g_dbname[db], obj);
+			g_getbuf = (unsigned char *)slurp(path, &g_getlen);
+		}
+	}
+	if (g_getbuf == NULL) {
+		respond(0xc4);
+		return;
+	}
+	g_getpos = 0;
+	get_continue(p, 3);
+}
+
+static void obex_request(unsigned char *pkt, int len) {
+
+	static unsigned char *resp = NULL;
+	headers h;
+	int op = pkt[0];
+
+	if (resp == NULL) resp = malloc(MAXPACKET + 16);
+	g_stats.requests++;
+	if ((g_dropevery > 0 && g_stats.requests % g_dropevery == 0) ||
+		(g_dropevery < 0 && g_stats.requests == -g_dropevery))
+	{
+		replug();
+		return;
+	}
+	if (g_verbose) fprintf(stderr, "sieemu: request %02x, %i bytes\n", op, len);
+
+	switch (op) {
+
+		case 0x80:	/* connect */
+			parse_headers(pkt + 7, pkt + len, &h);
+			g_sync = (h.target != NULL && h.targetlen == 9 && memcmp(h.target, "IRMC-SYNC", 9) == 0);
+			g_peermax = (pkt[5] << 8) + pkt[6];
+			if (g_peermax > g_maxpacket) g_peermax = g_maxpacket;
+			*g_cwd = '\0';
+			resp[0] = 0xa0;
+			resp[3] = 0x10;
+			resp[4] = 0x00;
+			resp[5] = g_peermax >> 8;
+			resp[6] = g_peermax & 0xff;
+			send_response(resp, 7);
+			break;
+
+		case 0x81:	/* disconnect */
+			respond(0xa0);
+			break;
+
+		case 0x85:	/* setpath */
+			do_setpath(pkt, len);
+			break;
+
+		case 0x03:
+		case 0x83:	/* get */
+			parse_headers(pkt + 3, pkt + len, &h);
+			if (g_sync)
+				do_sync_get(&h, resp);
+			else
+				do_get(&h, resp);
+			break;
+
+		case 0x02:
+		case 0x82:	/* put */
+			parse_headers(pkt + 3, pkt + len, &h);
+			do_put(op == 0x82, &h, resp);
+			break;
+
+		case 0xff:	/* abort */
+			get_end();
+			if (g_put) put_finish();
+			respond(0xa0);
+			break;
+
+		default:
+			respond(0xd1);
+			break;
+	}
+}
+
+/* AT command mode */
+static void at_mode() {
+
+	char line[256];
+	int c, n = 0;
+
+	while ((c = rx()) >= 0) {
+		if (c == '\n') continue;
+		if (c != '\r') {
+			if (n < sizeof(line) - 1) line[n++] = c;
+			continue;
+		}
+		line[n] = '\0';
+		n = 0;
+		if (g_verbose) fprintf(stderr, "sieemu: %s\n", line);
+
+		if (strcasecmp(line, "at^sbfb=1") == 0) {
+			tx("\r\nOK\r\n", 6);
+			g_mode = MODE_BFB;
+			g_seq = 0;
+			g_iseq = -1;
+			return;
+		} else if (strcasecmp(line, "at^sqwe=3") == 0) {
+			if (! g_qwe3) {
+				tx("\r\nERROR\r\n", 9);
+				continue;
+			}
+			tx("\r\nOK\r\n", 6);
+			g_mode = MODE_QWE3;
+			return;
+		} else if (strncasecmp(line, "at", 2) == 0) {
+			tx("\r\nOK\r\n", 6);
+		} else if (n > 0) {
+			tx("\r\nERROR\r\n", 9);
+		}
+	}
+}
+
+static int rxn(unsigned char *buf, int n) {
+
+	int i, c;
+
+	for (i=0; i<n; i++) {
+		if ((c = rx()) < 0) return -1;
+		buf[i] = c;
+	}
+	return 0;
+}
+
+static void bfb_mode() {
+
+	static unsigned char frame[MAXPACKET + 16];
+	unsigned char hdr[3], data[0x20];
+	int flen = 0, fpos = 0, l;
+	unsigned short csum;
+
+	while (g_mode == MODE_BFB) {
+		if (rxn(hdr, 3) < 0) return;
+		l = hdr[1];
+		if ((hdr[0] ^ l) != hdr[2] || l == 0) {
+			/* out of sync, skip a byte */
+			fpos = 0;
+			continue;
+		}
+		if (rxn(data, l) < 0) return;
+
+		switch (hdr[0]) {
+
+			case 0x02:	/* ping */
+				if (l == 1 && data[0] == 0x14)
+					tx("\x02\x02\x00\x14\xaa", 5);
+				break;
+
+			case 0x01:	/* speed change: accepted */
+				data[0] = 0xcc;
+				bfb_block(0x01, data, l);
+				break;
+
+			case 0x06:	/* at command */
+				if (l >= 9 && strncasecmp((char *)data, "at^sbfb=0", 9) == 0) {
+					g_mode = MODE_AT;
+					return;
+				}
+				break;
+
+			case 0x16:
+				if (l == 2 && data[0] == 0x01 && data[1] == 0xfe) {
+					acked();
+					break;
+				}
+				if (fpos == 0) {
+					if (l < 5 || (data[0] | 1) != 0x03) break;
+					flen = ((data[3] << 8) | data[4]) + 7;
+				}
+				if (fpos + l > flen) {
+					fpos = 0;
+					break;
+				}
+				memcpy(frame + fpos, data, l);
+				fpos += l;
+				if (fpos < flen) break;
+				fpos = 0;
+
+				csum = frame[flen-2] | (frame[flen-1] << 8);
+				if (csum != crc16(frame+2, flen-4)) {
+					if (g_verbose) fprintf(stderr, "sieemu: crc error\n");
+					break;
+				}
+				tx("\x16\x02\x14\x01\xfe", 5);
+				acked();	/* a new request acks our last response */
+				if (frame[0] == 0x03 && frame[2] == g_iseq)
+					break;	/* repeated, our ack got lost */
+				g_iseq = frame[2];
+				obex_request(frame + 5, flen - 7);
+				break;
+		}
+	}
+}
+
+static void qwe_mode() {
+
+	static unsigned char pkt[MAXPACKET + 16];
+	int len;
+
+	while (g_mode == MODE_QWE3) {
+		if (rxn(pkt, 3) < 0) return;
+		len = (pkt[1] << 8) + pkt[2];
+		if (len < 3) continue;
+		if (rxn(pkt + 3, len - 3) < 0) return;
+		if (pkt[0] == 0x81 && len == 3) {
+			/* tra_close leaves qwe mode this way */
+			respond(0xa0);
+			g_mode = MODE_AT;
+			return;
+		}
+		obex_request(pkt, len);
+	}
+}
+
+int main(int argc, char **argv) {
+
+	int c;
+
+	while ((c = getopt(argc, argv, "l:b:t:m:c:x:qv")) != -1) {
+		switch (c) {
+			case 'l': g_link = optarg; break;
+			case 'x': g_dropevery = atoi(optarg); break;
+			case 'b': g_baud = atoi(optarg); break;
+			case 't': g_latency = atoi(optarg); break;
+			case 'm': g_maxpacket = atoi(optarg); break;
+			case 'c': g_capacity = parse_size(optarg); break;
+			case 'q': g_qwe3 = 1; break;
+			case 'v': g_verbose = 1; break;
+			default: usage();
+		}
+	}
+	if (optind >= argc) usage();
+	g_root = argv[optind];
+	g_did = (long)time(NULL) ^ getpid();
+	if (g_maxpacket < 255 || g_maxpacket > MAXPACKET) g_maxpacket = MAXPACKET;
+
+	plug();
+	printf("%s\n", g_link);
+	fflush(stdout);
+
+	while (! g_closed) {
+		switch (g_mode) {
+			case MODE_AT: at_mode(); break;
+			case MODE_BFB: bfb_mode(); break;
+			case MODE_QWE3: qwe_mode(); break;
+		}
+	}
+
+	close(g_sfd);
+	unlink(g_link);
+	return 0;
+}
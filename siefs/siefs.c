@@ -7,7 +7,7 @@
     See the file COPYING.
 */
 
-#include <fuse/fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,552 +16,2847 @@
 #include <dirent.h>
 #include <errno.h>
 #include <time.h>
-#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <pthread.h>
+#include <signal.h>
 #include "obex.h"
+#include "sched.h"
+#include "dircache.h"
+#include "comm.h"
+#include "stats.h"
+#include "trace.h"
+#include "inode.h"
+#include "charset.h"
+#include "irmc.h"
 
 #include "config.h"
 
-//#define DBG(x...) fprintf(stderr, x); 
-#define DBG(x...)
-
 #define SIEFS_IDLE 0
 #define SIEFS_GET 1
 #define SIEFS_PUT 2
 
-#define MOUNTPROG			FUSEINST "/bin/fusermount"
-
-static obexsession *g_os;
+#define STATE_DOWN 0
+#define STATE_CONNECTING 1
+#define STATE_READY 2
+
+#define FREE_TTL			60	/* seconds a free space value is trusted */
+#define KERNEL_TTL			600	/* ... the kernel may keep names and attributes */
+#define DIR_TTL				2	/* seconds a listing is trusted when idle */
+#define DIR_TTL_BUSY		5	/* ... and during a transfer */
+#define PREFETCH_DEPTH		16
+#define DIRCACHE_SIZE		32	/* directories kept in the listing cache */
+#define CTL_DIR				"/.siefs"	/* virtual control files */
+#define TRACE_FILE			"/tmp/siefs.trace"	/* default for trace dumps */
+#define PATH_LEN			1024	/* longest path, in utf-8 */
+#define IO_SIZE				(128*1024)	/* largest FUSE read and write */
+#define READAHEAD_KB		512		/* kernel read-ahead, see set_readahead() */
+#define PUT_DELAY			1000	/* ms a closed file waits, see put_pending() */
+
+/* options, the same for all mounts */
 static char *comm_device;
 static char *g_iocharset = "utf8";
 static int g_baudrate;
 static int g_uid, g_gid, g_umask;
 static int g_hidetc;
-static char *g_currentdir = NULL;
-static char *g_currentfile = NULL;
-static int g_operation = SIEFS_IDLE;
-static int g_currentpos = 0;
-static int g_dirsize = 0;
-static obexdirentry *g_dirlist = NULL;
-static time_t g_lastscan = 0;
-static pthread_mutex_t smx = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t gmx = PTHREAD_MUTEX_INITIALIZER;
+static int g_bgrefresh = 0;
+static char *g_tracefile = TRACE_FILE;
+static int g_irmc = 0;
+static char *g_irmcdir = NULL;
+static struct stat dir_st, file_st;
+static pthread_t g_main;
+
+/* a path the kernel is told to forget, see kernel_inval() */
+typedef struct _inval {
+
+	char *path;
+	int gone;		/* the name goes, not just the inode */
+	struct _inval *next;
+
+} inval;
+
+/*
+ * A mounted phone. Each has its own link, scheduler thread,
+ * caches and FUSE session, and shares nothing with the others
+ * but the options and the trace.
+ */
+typedef struct _mount {
+
+	char *device;
+	char *mntpoint;
+	obexsession *os;
+	const charset *cs;		/* of the local names */
+	scheduler *sched;
+	dircache *dircache;
+	itable *inodes;
+	ststats *stats;
+	struct fuse_session *se;
+	pthread_t loop, connector;
+	int running;			/* 1: connector started, 2: and the loop */
+
+	/* only one file can be open at a time */
+	int session;
+	pthread_mutex_t smx;
+	pthread_cond_t scv;
+	char *currentfile;
+	int operation;
+	off_t currentpos;
+
+	/* writes go to a spool, sent after close (see put_pending()) */
+	FILE *spool;
+	int dirty;			/* spool not sent yet */
+	long putmtime;			/* time set while open, 0 if none */
+	long long putroom;		/* space the file may take, -1 if not known */
+	long long putold;		/* size of the copy on the phone it replaces */
+	char *sentfile;			/* last file sent, spool kept (under smx) */
+	long long sentsize;		/* its size and time */
+	long sentmtime;
+	int pending;			/* sentfile isn't sent yet */
+	int refused;			/* errno the phone refused it with, 0 if none */
+	long long putdue;		/* ms it goes at the latest, 0: none (under rmx) */
+
+	/* small adjacent writes are gathered here, IO_SIZE bytes */
+	pthread_mutex_t wmx;
+	char *wbuf;
+	off_t wboff;
+	int wblen;
+
+	/* link readiness, maintained by the connector thread */
+	int state;
+	int kick;			/* connect as soon as possible */
+	int reset;			/* drop the link first */
+	int present;			/* device node exists */
+	int stop;
+	pthread_mutex_t rmx;
+	pthread_cond_t rcv;
+	long long t0;			/* mount time */
+	long long tready;		/* ms until the link was up */
+	long long tlisting;		/* ms until the first listing */
+
+	/* statfs cache: capacity lives as long as the connection, free
+	   space is refreshed after freettl and adjusted locally in between */
+	long long capacity;
+	long long free;
+	int spacegen;
+	time_t freetime;
+	pthread_mutex_t fmx;
+
+	/* for the kernel, sent by the connector thread (under rmx) */
+	inval *inval, **invaltail;
+
+	/* tunables, see ctl_command() */
+	int baudrate;
+	int dirsize;
+	int dirttl, dirttl_busy;
+	int freettl;
+	int kernelttl;
+
+	/* phone book and calendar by IrMC sync, NULL without the irmc
+	   option; only used in the scheduler thread */
+	irmcstore *irmc[IRMC_STORES];
+
+	struct _mount *next;
+
+} mount;
+
+static mount *g_mounts = NULL;
+
+/* arguments of a request passed to the scheduler thread */
+typedef struct _fsreq {
+
+	mount *m;
+	const char *path;
+	const char *path2;
+	char **names;		/* several paths, size of them */
+	char *buf;
+	size_t size;
+	off_t offset;
+	time_t mtime;
+	int mode;		/* SIEFS_GET or SIEFS_PUT, or a speed */
+
+} fsreq;
+
+static int start_session(mount *m) {
+
+	struct timespec ts;
+	int r = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 1;
+
+	pthread_mutex_lock(&m->smx);
+	while (m->session && r == 0)
+		r = pthread_cond_timedwait(&m->scv, &m->smx, &ts);
+	if (m->session) {
+		pthread_mutex_unlock(&m->smx);
+		return -1;
+	}
+	m->session = 1;
+	pthread_mutex_unlock(&m->smx);
+
+	return 0;
+}
+
+static void end_session(mount *m) {
+
+	pthread_mutex_lock(&m->smx);
+	m->session = 0;
+	pthread_cond_signal(&m->scv);
+	pthread_mutex_unlock(&m->smx);
+}
+
+static int put_pending(mount *m);
+
+/*
+ * The following are called from jobs only, ie. in the scheduler
+ * thread. A quick request suspends a running transfer, the
+ * transfer is resumed lazily by its next job, so a burst of
+ * quick requests costs one abort/resume pair. A file closed but
+ * not sent yet goes first.
+ */
+static void link_quick(mount *m) {
+	put_pending(m);
+	if (m->operation != SIEFS_IDLE) obex_suspend(m->os);
+}
+
+static int link_xfer(mount *m) {
+	if (m->os->suspended && obex_resume(m->os) < 0) return -1;
+	return 0;
+}
+
+static long long now_ms() {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Wait until the connector thread has the phone connected. A
+ * request finding the link down asks for a new attempt, but
+ * never probes the phone itself.
+ */
+static int wait_ready(mount *m) {
+
+	int r;
+
+	pthread_mutex_lock(&m->rmx);
+	if (m->state == STATE_DOWN && m->present && ! m->kick) {
+		m->kick = 1;
+		pthread_cond_broadcast(&m->rcv);
+	}
+	while ((m->kick || m->state == STATE_CONNECTING) && ! m->stop)
+		pthread_cond_wait(&m->rcv, &m->rmx);
+	r = (m->state == STATE_READY) ? 0 : -1;
+	pthread_mutex_unlock(&m->rmx);
+
+	if (r < 0) errno = EIO;
+	return r;
+}
+
+#define STARTSESSION start_session(m)
+#define ENDSESSION   end_session(m)
+#define CALL(c, f, r) call(m, (c), (f), (r))
+
+/*
+ * A job found the link dead. The connector sets it up again; the
+ * next requests wait for that instead of driving the AT/BFB probe
+ * themselves (os->probe is off).
+ */
+static void link_lost(mount *m) {
+
+	pthread_mutex_lock(&m->rmx);
+	if (m->state == STATE_READY) {
+		TRACE(TR_LINK, TR_DOWN, NULL, 0, -1, 0);
+		m->state = STATE_DOWN;
+		m->reset = 1;
+		m->kick = m->present;
+		pthread_cond_broadcast(&m->rcv);
+	}
+	pthread_mutex_unlock(&m->rmx);
+}
+
+/* run a job once the link is ready */
+static int call(mount *m, int class, sched_fn fn, void *arg) {
+
+	int r, er;
+
+	if (wait_ready(m) < 0)
+		return -1;
+	r = sched_call(m->sched, class, fn, arg);
+	if (r < 0 && ! m->os->connected) {
+		er = errno;
+		link_lost(m);
+		errno = er;
+	}
+	return r;
+}
+
+static void invalidate(mount *m) {
+	dc_invalidate(m->dircache, NULL);
+}
+
+/* account locally for space taken or released by our own operations */
+static void space_adjust(mount *m, long long delta) {
+
+	pthread_mutex_lock(&m->fmx);
+	if (m->freetime != 0) {
+		m->free += delta;
+		if (m->free < 0) m->free = 0;
+		if (m->free > m->capacity) m->free = m->capacity;
+	}
+	pthread_mutex_unlock(&m->fmx);
+}
+
+/* forget free space, next statfs will ask the phone */
+static void space_stale(mount *m) {
+
+	pthread_mutex_lock(&m->fmx);
+	m->freetime = 0;
+	pthread_mutex_unlock(&m->fmx);
+}
+
+/* set the last file sent, NULL drops its spool too, and with it
+   a file not sent yet */
+static void set_sent(mount *m, char *path) {
+
+	pthread_mutex_lock(&m->smx);
+	free(m->sentfile);
+	m->sentfile = path;
+	pthread_mutex_unlock(&m->smx);
+	if (path == NULL && m->spool) {
+		fclose(m->spool);
+		m->spool = NULL;
+		m->pending = 0;
+		m->refused = 0;
+	}
+}
+
+static int is_sent(mount *m, const char *path) {
+
+	int r;
+
+	pthread_mutex_lock(&m->smx);
+	r = (m->sentfile != NULL && strcasecmp(path, m->sentfile) == 0);
+	pthread_mutex_unlock(&m->smx);
+
+	return r;
+}
+
+/* copy the directory part of path to dir (PATH_LEN bytes), returns
+   the name in it or NULL if there is none */
+static const char *split(const char *path, char *dir) {
+
+	const char *s = strrchr(path, '/');
+	int l;
+
+	if (s == NULL || (l = s - path) >= PATH_LEN)
+		return NULL;
+	if (l == 0)
+		l++;		/* "/" */
+	memcpy(dir, path, l);
+	dir[l] = '\0';
+
+	return s + 1;
+}
+
+/* path was deleted: drop it from its parent's listing */
+static void forget(mount *m, const char *path) {
+
+	char dir[PATH_LEN];
+	const char *name;
+
+	if ((name = split(path, dir)) == NULL)
+		invalidate(m);
+	else
+		dc_forget(m->dircache, dir, name);
+}
+
+/* size of a file from the directory cache, -1 if not known */
+static long long cached_size(mount *m, const char *path) {
+
+	char dir[PATH_LEN];
+	const char *name;
+	dcentry *d;
+	obexdirentry *de;
+	long long r = -1;
+
+	if ((name = split(path, dir)) == NULL)
+		return -1;
+
+	d = dc_peek(m->dircache, dir);
+	if (d != NULL) {
+		de = dc_find(d, name);
+		if (de != NULL)
+			r = de->isdir ? 0 : de->size;
+		dc_unlock(m->dircache);
+	}
+
+	return r;
+}
+
+static char *new_ascii2utf(mount *m, const char *s) {
+
+	int size = strlen(s) * 3;
+	char *r = malloc(size + 1);
+	return cs_to_utf(m->cs, s, r, size);
+
+}
+
+/* path of name in dir, malloc'ed */
+static char *join(const char *dir, const char *name) {
+
+	char *s;
+
+	s = (char *) malloc(strlen(dir) + strlen(name) + 2);
+	sprintf(s, "%s/%s", (strcmp(dir, "/") == 0) ? "" : dir, name);
+	return s;
+}
+
+static void fill_stat(obexdirentry *de, struct stat *stbuf) {
+
+	*stbuf = de->isdir ? dir_st : file_st;
+	stbuf->st_size = de->size;
+	stbuf->st_blocks = stbuf->st_size / 512;
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = de->mtime;
+}
+
+/* an open directory: a snapshot of its listing, readdir offsets index it */
+typedef struct _dirhandle {
+
+	char *path;
+	obexdirentry *list;
+	char **names;		/* of list, in the local charset */
+	int size;
+
+} dirhandle;
+
+/* arguments and result of a directory listing job */
+typedef struct _dirreq {
+
+	mount *m;
+	const char *path;
+	obexdirentry *list;
+	int size;
+
+} dirreq;
+
+/*
+ * With the irmc option telecom also has the phone book and the
+ * calendar as pb.vcf and cal.vcs, served from the IrMC stores (see
+ * irmc_open()). Listing them brings the stores up to date, which
+ * costs a change log query when nothing changed.
+ */
+static void irmc_list(mount *m, dirreq *r) {
+
+	irmcstore *s;
+	obexdirentry *de;
+	int db, i;
+
+	for (db=0; db<IRMC_STORES; db++) {
+		s = m->irmc[db];
+		if (irmc_sync(s, m->os) < 0 && s->cc < 0)
+			continue;
+
+		/* replaces the phone's own file of that name */
+		for (i=0; i<r->size && strcasecmp(r->list[i].name, irmc_file(db)) != 0; i++);
+		if (i == r->size)
+			r->list = (obexdirentry *) realloc(r->list, ++r->size * sizeof(obexdirentry));
+		de = &r->list[i];
+		memset(de, 0, sizeof(obexdirentry));
+		strcpy(de->name, irmc_file(db));
+		de->size = irmc_size(s);
+		de->mtime = s->changed;
+		de->mode = 0100000;
+	}
+}
+
+static int do_readdir(void *arg) {
+
+	dirreq *r = arg;
+	mount *m = r->m;
+	int allocd = 0, irmc;
+	obexdirentry *de;
+
+	link_quick(m);
+	irmc = m->irmc[0] != NULL && strcasecmp(r->path, "/telecom") == 0;
+	r->list = NULL;
+	r->size = 0;
+	if (obex_readdir(m->os, (char *)r->path) < 0) {
+		if (! irmc)
+			return -1;
+	} else {
+		while((de = obex_nextentry(m->os)) != NULL) {
+			if (r->size >= allocd) {
+				allocd += 16;
+				r->list = (obexdirentry *) realloc(r->list, allocd * sizeof(obexdirentry));
+			}
+			memcpy(&r->list[r->size++], de, sizeof(obexdirentry));
+		}
+	}
+	if (irmc)
+		irmc_list(m, r);
+
+	return 0;
+}
+
+/* called by the directory cache on a miss, once for all waiting threads */
+static int fetch_dir(const char *path, obexdirentry **list, int *size, void *arg) {
+
+	mount *m = arg;
+	dirreq r;
+	long long t0 = stats_now();
+	int res;
+
+	r.m = m;
+	r.path = path;
+	res = CALL(SCHED_META, do_readdir, &r);
+	TRACE(TR_READDIR, 0, path, (res < 0) ? 0 : r.size, (res < 0) ? -errno : 0, stats_now() - t0);
+	if (res < 0)
+		return -1;
+
+	if (m->tlisting < 0) {
+		m->tlisting = now_ms() - m->t0;
+		fprintf(stderr, "siefs: %s: first listing %lli ms after mount\n", m->mntpoint, m->tlisting);
+	}
+
+	*list = r.list;
+	*size = r.size;
+	return 0;
+}
+
+/* a background refresh of an expired listing */
+typedef struct _revreq {
+
+	mount *m;
+	char *path;
+	int gen;
+
+} revreq;
+
+static int do_revalidate(void *arg) {
+
+	revreq *r = arg;
+	mount *m = r->m;
+	dirreq d;
+	long long t0 = stats_now();
+	int n;
+
+	d.m = m;
+	d.path = r->path;
+	d.list = NULL;
+	if (m->operation != SIEFS_IDLE) {
+		/* not now, the next lookup will ask again */
+		dc_update(m->dircache, r->path, r->gen, NULL, 0);
+	} else if (do_readdir(&d) < 0) {
+		dc_update(m->dircache, r->path, r->gen, NULL, 0);
+	} else {
+		n = dc_update(m->dircache, r->path, r->gen, d.list, d.size);
+		TRACE(TR_REVALIDATE, 0, r->path, d.size, n, stats_now() - t0);
+	}
+
+	free(r->path);
+	free(r);
+	return 0;
+}
+
+/* called by the directory cache with its lock held */
+static void revalidate(const char *path, int gen, void *arg) {
+
+	revreq *r;
+
+	r = (revreq *) malloc(sizeof(revreq));
+	if (r == NULL) return;
+	r->m = arg;
+	r->path = strdup(path);
+	r->gen = gen;
+	sched_post(r->m->sched, SCHED_BACKGROUND, do_revalidate, r);
+}
+
+/*
+ * Kernel caches: names, attributes and pages are granted for
+ * kernelttl seconds, and whatever a new listing shows different
+ * is dropped from them. The kernel may be waiting on us while
+ * holding its locks, so the connector thread tells it.
+ */
+
+static void kernel_inval(mount *m, const char *path, int gone) {
+
+	inval *n;
+
+	n = (inval *) malloc(sizeof(inval));
+	if (n == NULL) return;
+	n->path = strdup(path);
+	n->gone = gone;
+	n->next = NULL;
+	pthread_mutex_lock(&m->rmx);
+	*m->invaltail = n;
+	m->invaltail = &n->next;
+	pthread_cond_broadcast(&m->rcv);
+	pthread_mutex_unlock(&m->rmx);
+}
+
+/* called by the directory cache with its lock held */
+static void changed(const char *dir, const char *name, int gone, void *arg) {
+
+	char *path = join(dir, name);
+
+	kernel_inval(arg, path, gone);
+	free(path);
+}
+
+static void send_inval(mount *m, inval *n) {
+
+	fuse_ino_t ino, parent;
+	char *s, name[256];
+	int r = 0;
+
+	ino = it_peek(m->inodes, n->path);
+	if (n->gone) {
+		s = strrchr(n->path, '/');
+		*s = '\0';
+		parent = it_peek(m->inodes, (s == n->path) ? "/" : n->path);
+		*s = '/';
+		if (parent != 0) {
+			cs_from_utf(m->cs, s + 1, name, sizeof(name) - 1);
+			r = fuse_lowlevel_notify_inval_entry(m->se, parent, name, strlen(name));
+			stats_count(ST_KERNEL_INVALS, 1);
+		}
+	}
+	if (ino != 0) {
+		r = fuse_lowlevel_notify_inval_inode(m->se, ino, 0, 0);
+		stats_count(ST_KERNEL_INVALS, 1);
+	}
+	TRACE(TR_INVAL, n->gone, n->path, 0, r, 0);
+}
+
+/* the oldest queued invalidation or NULL, called with m->rmx held */
+static inval *take_inval(mount *m) {
+
+	inval *n = m->inval;
+
+	if (n != NULL) {
+		m->inval = n->next;
+		if (m->inval == NULL)
+			m->invaltail = &m->inval;
+	}
+	return n;
+}
+
+/* get a listing with the cache locked, path is in utf-8 */
+static dcentry *getdir(mount *m, const char *path) {
+
+	/* rescan sooner when idle, the phone is cheap to ask then */
+	return dc_get(m->dircache, path,
+		(m->operation == SIEFS_IDLE) ? m->dirttl : m->dirttl_busy,
+		fetch_dir, m);
+}
+
+/*
+ * Control files: /.siefs is served locally, it isn't listed in /.
+ * stats shows counters and latencies; ctl shows the tunables as
+ * commands and takes commands, one per line (see ctl_command()).
+ */
+
+typedef struct _ctlfile {
+
+	char *data;
+	int len;
+
+} ctlfile;
+
+static int is_ctl(const char *path) {
+
+	return strncmp(path, CTL_DIR, sizeof(CTL_DIR)-1) == 0 &&
+		(path[sizeof(CTL_DIR)-1] == '\0' || path[sizeof(CTL_DIR)-1] == '/');
+}
+
+static char *ctl_text(mount *m, int *plen) {
+
+	char *s, *pins, *p, *q;
+	int len, state;
+
+	pthread_mutex_lock(&m->rmx);
+	state = m->state;
+	pthread_mutex_unlock(&m->rmx);
+
+	pins = dc_pinned(m->dircache);
+	s = (char *) malloc(384 + 4 * strlen(pins));
+	len = sprintf(s, "# link %s, %i baud\n"
+		"# ready %lli ms, first listing %lli ms after mount (-1: not yet)\n"
+		"baud %i\nttl %i %i\nfreettl %i\nkernelttl %i\ncachesize %i\ntrace %s\n",
+		(state == STATE_READY) ? "ready" : (state == STATE_DOWN) ? "down" : "connecting",
+		m->os->b->speed, m->tready, m->tlisting,
+		m->baudrate, m->dirttl, m->dirttl_busy, m->freettl, m->kernelttl, m->dirsize,
+		trace_on ? "on" : "off");
+	for (p = pins; *p != '\0'; p = q + 1) {
+		q = strchr(p, '\n');
+		*q = '\0';
+		len += sprintf(s + len, "pin ");
+		cs_from_utf(m->cs, p, s + len, 2 * strlen(p));
+		len += strlen(s + len);
+		s[len++] = '\n';
+		s[len] = '\0';
+	}
+	free(pins);
+
+	if (plen) *plen = len;
+	return s;
+}
+
+static int ctl_getattr(mount *m, const char *path, struct stat *stbuf)
+{
+	char *s;
+	int len;
+
+	if (strcmp(path, CTL_DIR) == 0) {
+		*stbuf = dir_st;
+		stbuf->st_mode = 0040555;
+		return 0;
+	}
+
+	if (strcmp(path, CTL_DIR "/stats") == 0)
+		s = stats_text(m->stats, &len);
+	else if (strcmp(path, CTL_DIR "/ctl") == 0)
+		s = ctl_text(m, &len);
+	else
+		return -ENOENT;
+	free(s);
+
+	*stbuf = file_st;
+	stbuf->st_mode = (path[sizeof(CTL_DIR)] == 's') ? 0100444 : 0100644;
+	stbuf->st_size = len;
+	stbuf->st_mtime = time(NULL);
+	return 0;
+}
+
+static int ctl_opendir(const char *path, dirhandle *dh)
+{
+	if (strcmp(path, CTL_DIR) != 0)
+		return -ENOTDIR;
+	dh->list = (obexdirentry *) calloc(2, sizeof(obexdirentry));
+	dh->names = (char **) malloc(2 * sizeof(char *));
+	strcpy(dh->list[0].name, "ctl");
+	strcpy(dh->list[1].name, "stats");
+	dh->names[0] = dh->list[0].name;
+	dh->names[1] = dh->list[1].name;
+	dh->size = 2;
+	return 0;
+}
+
+static int ctl_open(mount *m, const char *path, struct fuse_file_info *finfo)
+{
+	ctlfile *f;
+	int ctl;
+
+	ctl = (strcmp(path, CTL_DIR "/ctl") == 0);
+	if (! ctl && strcmp(path, CTL_DIR "/stats") != 0)
+		return -ENOENT;
+	if (! ctl && (finfo->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	/* a snapshot, so the numbers add up within one read */
+	f = (ctlfile *) malloc(sizeof(ctlfile));
+	f->data = ctl ? ctl_text(m, &f->len) : stats_text(m->stats, &f->len);
+	finfo->fh = (unsigned long) f;
+	return 0;
+}
+
+static int ctl_read(char *buf, size_t size, off_t offset, struct fuse_file_info *finfo)
+{
+	ctlfile *f = (ctlfile *) finfo->fh;
+
+	if (f == NULL)
+		return -EBADF;
+	if (offset >= f->len)
+		return 0;
+	if (size > f->len - offset)
+		size = f->len - offset;
+	memcpy(buf, f->data + offset, size);
+	return size;
+}
+
+static int ctl_close(struct fuse_file_info *finfo)
+{
+	ctlfile *f = (ctlfile *) finfo->fh;
+
+	if (f != NULL) {
+		free(f->data);
+		free(f);
+		finfo->fh = 0;
+	}
+	return 0;
+}
+
+/* store of an IrMC file, see irmc_list(); -1 if path isn't one */
+static int irmc_db(mount *m, const char *path) {
+
+	int db;
+
+	if (m->irmc[0] == NULL || strncasecmp(path, "/telecom/", 9) != 0)
+		return -1;
+	for (db=0; db<IRMC_STORES; db++)
+		if (strcasecmp(path + 9, irmc_file(db)) == 0)
+			return db;
+	return -1;
+}
+
+static int do_irmc(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+	irmcstore *s = m->irmc[r->mode];
+	long long len;
+
+	/* the last copy will do if the phone can't be asked */
+	link_quick(m);
+	if (irmc_sync(s, m->os) < 0 && s->cc < 0)
+		return -1;
+	r->buf = irmc_text(s, &len);
+	if (r->buf == NULL)
+		return -1;
+	r->size = len;
+	return 0;
+}
+
+/*
+ * An IrMC file is read from a copy of the store made at open, like
+ * a control file, without taking the session; writes still go to
+ * the phone's file system.
+ */
+static int irmc_open(mount *m, const char *path, int db, struct fuse_file_info *finfo)
+{
+	ctlfile *f;
+	fsreq r;
+	char dir[PATH_LEN];
+	long long size;
+
+	r.m = m;
+	r.path = path;
+	r.mode = db;
+	if (CALL(SCHED_META, do_irmc, &r) < 0)
+		return -errno;
+
+	/* the listing has the size of the last sync */
+	size = cached_size(m, path);
+	if (size >= 0 && size != r.size && split(path, dir) != NULL)
+		dc_invalidate(m->dircache, dir);
+
+	f = (ctlfile *) malloc(sizeof(ctlfile));
+	f->data = r.buf;
+	f->len = r.size;
+	finfo->fh = (unsigned long) f;
+	return 0;
+}
+
+/* list path and its subdirectories, down to depth levels, into the cache */
+static int prefetch(mount *m, const char *path, int depth) {
+
+	dcentry *d;
+	char **sub, *s;
+	int i, n = 0, r = 0;
+
+	d = getdir(m, path);
+	if (d == NULL)
+		return -1;
+	sub = (char **) malloc((d->size + 1) * sizeof(char *));
+	for (i=0; i<d->size; i++) {
+		if (! d->list[i].isdir) continue;
+		s = malloc(strlen(path) + strlen(d->list[i].name) + 2);
+		sprintf(s, "%s/%s", (strcmp(path, "/") == 0) ? "" : path, d->list[i].name);
+		sub[n++] = s;
+	}
+	dc_unlock(m->dircache);
+
+	for (i=0; i<n; i++) {
+		if (r == 0 && depth > 0 && prefetch(m, sub[i], depth - 1) < 0)
+			r = -1;
+		free(sub[i]);
+	}
+	free(sub);
+
+	return r;
+}
+
+static int do_reconnect(void *arg) {
+
+	mount *m = arg;
+
+	link_quick(m);
+	return obex_reconnect(m->os);
+}
+
+static int do_baud(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+
+	link_quick(m);
+	return obex_setspeed(m->os, r->mode);
+}
+
+/* drop the link and wait for the connector to set it up again */
+static int reconnect(mount *m) {
+
+	int r;
+
+	pthread_mutex_lock(&m->rmx);
+	m->reset = 1;
+	m->kick = 1;
+	m->present = 1;
+	pthread_cond_broadcast(&m->rcv);
+	while ((m->kick || m->state == STATE_CONNECTING) && ! m->stop)
+		pthread_cond_wait(&m->rcv, &m->rmx);
+	r = (m->state == STATE_READY) ? 0 : -1;
+	pthread_mutex_unlock(&m->rmx);
+
+	if (r < 0) errno = EIO;
+	return r;
+}
+
+static int do_rmtree(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+	int res, er;
+
+	link_quick(m);
+	set_sent(m, NULL);
+	res = obex_rmtree(m->os, (char *)r->path);
+	er = errno;
+	space_stale(m);
+	if (res == 0)
+		forget(m, r->path);
+	else
+		invalidate(m);
+	kernel_inval(m, r->path, 1);
+	errno = er;
+	return res;
+}
+
+static int do_mkdirs(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+	int res;
+
+	link_quick(m);
+	res = obex_mkdirs(m->os, r->names, r->size);
+	invalidate(m);
+	return res;
+}
+
+/* an absolute path from a ctl line, without trailing slashes */
+static char *ctl_path(mount *m, const char *s) {
+
+	char *path;
+	int n;
+
+	if (s[0] != '/')
+		return NULL;
+	path = new_ascii2utf(m, s);
+	n = strlen(path);
+	while (n > 1 && path[n-1] == '/')
+		path[--n] = '\0';
+	return path;
+}
+
+/* mkdirs: the folders are the argc words in argv */
+static int ctl_mkdirs(mount *m, char **argv, int argc) {
+
+	char **names;
+	fsreq b;
+	int i, n, r = -1, er = EINVAL;
+
+	names = malloc(argc * sizeof(char *));
+	if (names == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (n = 0; n < argc; n++)
+		if ((names[n] = ctl_path(m, argv[n])) == NULL)
+			goto out;
+
+	b.m = m;
+	b.names = names;
+	b.size = n;
+	r = CALL(SCHED_META, do_mkdirs, &b);
+	er = errno;
+out:
+	for (i=0; i<n; i++)
+		free(names[i]);
+	free(names);
+	errno = er;
+	return r;
+}
+
+/*
+ * One line written to ctl:
+ *
+ *	flush [dir]		forget cached listings (and free space)
+ *	prefetch <dir> [depth]	list dir and its subdirectories
+ *	rmtree <path>		delete path and everything below it
+ *	mkdirs <dir...>		create dirs and their missing parents
+ *	pin <dir>, unpin <dir>	keep a listing until it changes
+ *	baud <rate>		switch the line speed
+ *	ttl <idle> [busy]	seconds listings are trusted
+ *	freettl <seconds>	seconds free space is trusted
+ *	kernelttl <seconds>	seconds the kernel may cache names and attributes
+ *	cachesize <dirs>	directories kept besides the pinned ones
+ *	reconnect		drop the link and set it up again
+ *	trace on|off		switch event tracing
+ *	trace dump [file]	write the trace out now
+ *
+ * Returns 0 or -1 with errno set.
+ */
+static int ctl_command(mount *m, char *line) {
+
+	char **argv, *path = NULL, *s, *save;
+	fsreq b;
+	long long t0 = stats_now();
+	int argc = 0, r = 0;
+
+	/* a word takes at least two characters with its separator */
+	argv = malloc((strlen(line) / 2 + 1) * sizeof(char *));
+	if (argv == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (s = strtok_r(line, " \t\r", &save); s != NULL; s = strtok_r(NULL, " \t\r", &save))
+		argv[argc++] = s;
+	if (argc == 0 || argv[0][0] == '#') {
+		free(argv);
+		return 0;
+	}
+
+	if (argc > 1)
+		path = ctl_path(m, argv[1]);
+
+	errno = EINVAL;
+	if (strcmp(argv[0], "flush") == 0 && argc == 1) {
+		dc_invalidate(m->dircache, NULL);
+		space_stale(m);
+	} else if (strcmp(argv[0], "flush") == 0 && path != NULL) {
+		dc_invalidate(m->dircache, path);
+		kernel_inval(m, path, 0);
+	} else if (strcmp(argv[0], "prefetch") == 0 && path != NULL) {
+		r = prefetch(m, path, (argc > 2) ? atoi(argv[2]) : PREFETCH_DEPTH);
+	} else if (strcmp(argv[0], "rmtree") == 0 && path != NULL && strcmp(path, "/") != 0) {
+		b.m = m;
+		b.path = path;
+		r = CALL(SCHED_META, do_rmtree, &b);
+	} else if (strcmp(argv[0], "mkdirs") == 0 && path != NULL) {
+		r = ctl_mkdirs(m, argv + 1, argc - 1);
+	} else if (strcmp(argv[0], "pin") == 0 && path != NULL) {
+		r = (getdir(m, path) == NULL) ? -1 : 0;
+		if (r == 0) {
+			dc_unlock(m->dircache);
+			r = dc_pin(m->dircache, path, 1);
+		}
+	} else if (strcmp(argv[0], "unpin") == 0 && path != NULL) {
+		r = dc_pin(m->dircache, path, 0);
+	} else if (strcmp(argv[0], "baud") == 0 && argc == 2) {
+		b.m = m;
+		b.mode = atoi(argv[1]);
+		r = sched_call(m->sched, SCHED_META, do_baud, &b);
+		if (r == 0) m->baudrate = b.mode;
+	} else if (strcmp(argv[0], "ttl") == 0 && argc >= 2 && atoi(argv[1]) >= 0) {
+		m->dirttl = atoi(argv[1]);
+		m->dirttl_busy = (argc > 2) ? atoi(argv[2]) : m->dirttl;
+	} else if (strcmp(argv[0], "freettl") == 0 && argc == 2 && atoi(argv[1]) >= 0) {
+		m->freettl = atoi(argv[1]);
+	} else if (strcmp(argv[0], "kernelttl") == 0 && argc == 2 && atoi(argv[1]) >= 0) {
+		m->kernelttl = atoi(argv[1]);
+	} else if (strcmp(argv[0], "cachesize") == 0 && argc == 2 && atoi(argv[1]) > 0) {
+		m->dirsize = atoi(argv[1]);
+		dc_resize(m->dircache, m->dirsize);
+	} else if (strcmp(argv[0], "reconnect") == 0 && argc == 1) {
+		r = reconnect(m);
+	} else if (strcmp(argv[0], "trace") == 0 && argc >= 2 && strcmp(argv[1], "dump") == 0) {
+		r = trace_dump((argc > 2) ? argv[2] : g_tracefile);
+	} else if (strcmp(argv[0], "trace") == 0 && argc == 2 && strcmp(argv[1], "on") == 0) {
+		trace_enable(1);
+	} else if (strcmp(argv[0], "trace") == 0 && argc == 2 && strcmp(argv[1], "off") == 0) {
+		trace_enable(0);
+	} else {
+		r = -1;
+	}
+
+	TRACE(TR_CTL, 0, argv[0], 0, r, stats_now() - t0);
+	free(path);
+	free(argv);
+	return r;
+}
+
+static int ctl_write(mount *m, const char *buf, size_t size)
+{
+	char *cmds, *line, *next;
+	int res = size;
+
+	/* each write is a complete set of commands */
+	cmds = malloc(size + 1);
+	memcpy(cmds, buf, size);
+	cmds[size] = '\0';
+	for (line = cmds; line != NULL && res >= 0; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL) *(next++) = '\0';
+		if (ctl_command(m, line) < 0)
+			res = -errno;
+	}
+	free(cmds);
+
+	return res;
+}
+
+static int siefs_opendir(mount *m, const char *path, dirhandle *dh)
+{
+	int i, l = 0, topdir;
+	dcentry *d;
+	char *s;
+
+	dh->list = NULL;
+	dh->names = NULL;
+	dh->size = 0;
+	if (is_ctl(path))
+		return ctl_opendir(path, dh);
+	d = getdir(m, path);
+	if (d == NULL)
+		return -errno;
+
+	/* the local names are kept with the listing, copy them along */
+	for (i=0; i<d->size; i++)
+		l += strlen(dc_name(d, i)) + 1;
+	dh->list = (obexdirentry *) malloc((d->size + 1) * sizeof(obexdirentry));
+	dh->names = (char **) malloc((d->size + 1) * sizeof(char *) + l);
+	s = (char *) (dh->names + d->size + 1);
+	topdir = (strcmp(path, "/") == 0);
+	for (i=0; i<d->size; i++) {
+		if (topdir && g_hidetc && strcasecmp(d->list[i].name, "telecom") == 0)
+			continue;
+		dh->list[dh->size] = d->list[i];
+		dh->names[dh->size++] = strcpy(s, dc_name(d, i));
+		s += strlen(s) + 1;
+	}
+	dc_unlock(m->dircache);
+
+	return 0;
+}
+
+static int siefs_getattr(mount *m, const char *path, struct stat *stbuf)
+{
+	int res = 0;
+	char dir[PATH_LEN];
+	const char *item;
+	dcentry *d;
+	obexdirentry *de;
+
+	if (is_ctl(path))
+		return ctl_getattr(m, path, stbuf);
+	if (*path == '/' && *(path+1) == '\0') {
+
+		/* root node is always a directory, isn't it? */
+		*stbuf = dir_st;
+
+	} else if (dc_isdir(m->dircache, path)) {
+
+		/* listed nodes and their parents are also a directories */
+		*stbuf = dir_st;
+
+	} else {
+
+		if ((item = split(path, dir)) == NULL)
+			return -ENOENT;
+
+		d = getdir(m, dir);
+		if (d != NULL) {
+			res = -ENOENT;
+			de = dc_find(d, item);
+			if (de != NULL) {
+				res = 0;
+				fill_stat(de, stbuf);
+			}
+			dc_unlock(m->dircache);
+		} else {
+			res = -errno;
+		}
+	}
+
+	return res;
+}
+
+static int do_mkdir(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+	int res;
+
+	link_quick(m);
+	res = obex_mkdir(m->os, (char *)r->path);
+	invalidate(m);
+	return res;
+}
+
+static int siefs_mkdir(mount *m, const char *path, mode_t mode)
+{
+	int res = 0;
+	fsreq r;
+
+	if (is_ctl(path))
+		return -EACCES;
+	r.m = m;
+	r.path = path;
+	if (CALL(SCHED_META, do_mkdir, &r) < 0)
+		res = -errno;
+
+    return res;
+}
+
+static int do_unlink(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+	long long size;
+	int res;
+
+	link_quick(m);
+	if (is_sent(m, r->path)) set_sent(m, NULL);
+	size = cached_size(m, r->path);
+	res = obex_delete(m->os, (char *)r->path);
+	if (res == 0 && size >= 0)
+		space_adjust(m, size);
+	else if (res == 0)
+		space_stale(m);
+	if (res == 0)
+		forget(m, r->path);
+	else
+		invalidate(m);
+	return res;
+}
+
+static int siefs_unlink(mount *m, const char *path)
+{
+	int res = 0;
+	fsreq r;
+
+	if (is_ctl(path))
+		return -EACCES;
+	if (irmc_db(m, path) >= 0)
+		return -EROFS;
+	r.m = m;
+	r.path = path;
+	if (CALL(SCHED_META, do_unlink, &r) < 0)
+		res = -errno;
+
+    return res;
+}
+
+static int siefs_rmdir(mount *m, const char *path)
+{
+	dcentry *d;
+	int full = 0;
+
+	/* the phone would only say it's forbidden */
+	if ((d = dc_peek(m->dircache, path)) != NULL) {
+		full = (d->time != 0 && d->size > 0);
+		dc_unlock(m->dircache);
+	}
+	if (full)
+		return -ENOTEMPTY;
+
+    return siefs_unlink(m, path);
+}
+
+static int do_truncate(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+	long long oldsize;
+	int er, res = -1;
+
+	link_quick(m);
+	if (is_sent(m, r->path)) set_sent(m, NULL);
+	oldsize = cached_size(m, r->path);
+	if (obex_delete(m->os, (char *)r->path) == 0 &&
+		obex_put(m->os, (char *)r->path, 0, 0, NULL) == 0)
+	{
+		obex_close(m->os);
+		res = 0;
+	}
+	er = errno;
+	if (res == 0 && oldsize >= 0)
+		space_adjust(m, oldsize);
+	else
+		space_stale(m);
+	invalidate(m);
+	errno = er;
+	return res;
+}
+
+/* into the spool, currentpos is the size of the file */
+static int do_write(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+	int n;
+
+	if (m->putroom >= 0 && r->offset + (long long)r->size > m->putroom) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	n = pwrite(fileno(m->spool), r->buf, r->size, r->offset);
+	if (n < 0)
+		return -1;
+	if (r->offset + n > m->currentpos)
+		m->currentpos = r->offset + n;
+	m->dirty = 1;
+
+	return n;
+}
+
+/* hand the gathered writes over to the spool, with wmx held */
+static int spool_gathered(mount *m) {
+
+	fsreq r;
+	int n;
+
+	if (m->wblen == 0)
+		return 0;
+	r.m = m;
+	r.buf = m->wbuf;
+	r.size = m->wblen;
+	r.offset = m->wboff;
+	n = sched_call(m->sched, SCHED_BACKGROUND, do_write, &r);
+	m->wblen = 0;
+
+	return (n < 0) ? -1 : 0;
+}
+
+/* before anything else looks at the spool */
+static int flush_gathered(mount *m) {
+
+	int r;
+
+	pthread_mutex_lock(&m->wmx);
+	r = spool_gathered(m);
+	pthread_mutex_unlock(&m->wmx);
+
+	return r;
+}
+
+/* resize the file being written */
+static int do_resize(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+
+	if (m->putroom >= 0 && r->offset > m->putroom) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (ftruncate(fileno(m->spool), r->offset) < 0)
+		return -1;
+	m->currentpos = r->offset;
+	m->dirty = 1;
+
+	return 0;
+}
+
+static int siefs_truncate(mount *m, const char *path, off_t size)
+{
+	int res = 0;
+	fsreq r;
+
+	if (is_ctl(path))
+		return (strcmp(path, CTL_DIR "/ctl") == 0) ? 0 : -EACCES;
+	if (irmc_db(m, path) >= 0)
+		return -EROFS;
+	r.m = m;
+	r.path = path;
+	r.offset = size;
+	if (m->operation == SIEFS_PUT && strcasecmp(path, m->currentfile) == 0) {
+		if (flush_gathered(m) < 0 ||
+			sched_call(m->sched, SCHED_BACKGROUND, do_resize, &r) < 0)
+			res = -errno;
+	} else if (CALL(SCHED_META, do_truncate, &r) < 0) {
+		res = -errno;
+	}
+
+    return res;
+}
+
+static int do_rename(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+	int res;
+
+	link_quick(m);
+	res = obex_move(m->os, (char *)r->path, (char *)r->path2);
+	if (res == 0 && is_sent(m, r->path))
+		set_sent(m, strdup(r->path2));
+	invalidate(m);
+	return res;
+}
+
+static int siefs_rename(mount *m, const char *from, const char *to)
+{
+	int res = 0;
+	fsreq r;
+
+	if (is_ctl(from) || is_ctl(to))
+		return -EACCES;
+	if (irmc_db(m, from) >= 0 || irmc_db(m, to) >= 0)
+		return -EROFS;
+	r.m = m;
+	r.path = from;
+	r.path2 = to;
+	if (CALL(SCHED_META, do_rename, &r) < 0)
+		res = -errno;
+
+    return res;
+}
+
+static int do_create(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+	int res;
+
+	link_quick(m);
+	if (is_sent(m, r->path)) set_sent(m, NULL);
+	res = obex_put(m->os, (char *)r->path, 0, 0, NULL);
+	if (res == 0)
+		obex_close(m->os);
+	invalidate(m);
+	return res;
+}
+
+static int siefs_mknod(mount *m, const char *path, mode_t mode, dev_t rdev)
+{
+	int res = 0;
+	long t;
+	fsreq r;
+
+	t = mode & S_IFMT;
+	if (t != 0 && t != 0100000)
+    	return -EPERM;
+	if (is_ctl(path))
+		return -EACCES;
+	if (irmc_db(m, path) >= 0)
+		return -EROFS;
+
+	if (STARTSESSION != 0)
+		return -EBUSY;
+
+	r.m = m;
+	r.path = path;
+	if (CALL(SCHED_META, do_create, &r) < 0)
+		res = -errno;
+	ENDSESSION;
+
+	return res;
+}
+
+/*
+ * A file open for writing is kept in a local spool and sent to the
+ * phone in one PUT on flush, with its size and time: a phone short
+ * of space refuses it before the body, and the file gets the time
+ * it had at the source. The phone can't append anyway, and writes
+ * can come at any offset.
+ */
+static int send_spool(mount *m, const char *path, long long size, long mtime, long long old) {
+
+	char buf[MAXPACKETSIZE];
+	long long done = 0;
+	int n, l, er, res = -1;
+
+	if (m->putroom >= 0 && size > m->putroom) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	link_quick(m);
+	if (obex_put(m->os, (char *)path, size, mtime, m->spool) < 0) {
+		er = errno;
+		invalidate(m);
+		errno = er;
+		return -1;
+	}
+
+	/* not preempted: a PUT can't be resumed, only sent again from
+	   the start, so requests coming in meanwhile wait for it */
+	while (done < size) {
+		l = obex_room(m->os);
+		if (l > sizeof(buf)) l = sizeof(buf);
+		if (l > size - done) l = size - done;
+		n = pread(fileno(m->spool), buf, l, done);
+		if (n <= 0) {
+			errno = EIO;
+			break;
+		}
+		if (obex_write(m->os, buf, n) < 0)
+			break;
+		done += n;
+	}
+
+	if (done == size && obex_close(m->os) == 0) {
+		space_adjust(m, old - size);
+		res = 0;
+	} else {
+		er = errno;
+		obex_close(m->os);
+		space_stale(m);
+		errno = er;
+	}
+	er = errno;
+	invalidate(m);
+	errno = er;
+	return res;
+}
+
+static int do_open(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+	long long size;
+
+	/* the spool is kept for the file sent last only while nothing
+	   else is open; one the link lost on the way is kept for later */
+	if (put_pending(m) < 0 && ! m->os->connected)
+		return -1;
+	set_sent(m, NULL);
+	if (r->mode == SIEFS_GET) {
+		if (obex_get(m->os, (char *)r->path, 0) < 0)
+			return -1;
+	} else {
+		m->spool = tmpfile();
+		if (m->spool == NULL)
+			return -1;
+		m->dirty = 0;
+		m->putmtime = 0;
+
+		/* the file may take the free space and what it has now */
+		size = cached_size(m, r->path);
+		m->putold = (size > 0) ? size : 0;
+		pthread_mutex_lock(&m->fmx);
+		m->putroom = (m->freetime == 0) ? -1 : m->free + m->putold;
+		pthread_mutex_unlock(&m->fmx);
+	}
+
+	free(m->currentfile);
+	m->currentfile = strdup(r->path);
+	m->operation = r->mode;
+	m->currentpos = 0;
+	return 0;
+}
+
+static int siefs_open(mount *m, const char *path, struct fuse_file_info *finfo)
+{
+	int res = 0, db;
+	fsreq r;
+
+	if (is_ctl(path))
+		return ctl_open(m, path, finfo);
+	finfo->fh = 0;
+	if ((db = irmc_db(m, path)) >= 0)
+		return ((finfo->flags & O_ACCMODE) == O_RDONLY) ? irmc_open(m, path, db, finfo) : -EROFS;
+	switch (finfo->flags & O_ACCMODE) {
+		case O_RDONLY:
+		case O_WRONLY:
+			if (STARTSESSION != 0) {
+				res = -EBUSY;
+				break;
+			}
+			r.m = m;
+			r.path = path;
+			if ((finfo->flags & O_ACCMODE) == O_RDONLY) {
+				r.mode = SIEFS_GET;
+				res = CALL(SCHED_READ, do_open, &r);
+			} else {
+				r.mode = SIEFS_PUT;
+				res = CALL(SCHED_BACKGROUND, do_open, &r);
+				if (res == 0) {
+					m->wbuf = malloc(IO_SIZE);
+					m->wblen = 0;
+				}
+			}
+			if (res < 0) {
+				res = -errno;
+				ENDSESSION;
+			} else {
+				res = 0;
+			}
+			break;
+
+		default:
+			res = -EPERM;
+			break;
+	}
+
+	return res;
+}
+
+/*
+ * A file written is sent PUT_DELAY ms after it is closed, or before
+ * anything else goes to the phone if that comes first: rsync, tar
+ * and unison set the time right after close, and it goes with the
+ * file instead of sending the file twice. A time set then sends it
+ * at once, and utime() gets the result; so does fsync(). A file
+ * whose time was set while open is sent on flush, see siefs_flush().
+ *
+ * A file the phone refuses otherwise is counted in put_errors of
+ * .siefs/stats and keeps its spool: fsync() or a utime() on it try
+ * again, the next open drops it. Called from jobs only.
+ */
+static int put_pending(mount *m) {
+
+	int res;
+
+	if (! m->pending || m->refused || m->os == NULL)
+		return 0;
+	m->pending = 0;
+	pthread_mutex_lock(&m->rmx);
+	m->putdue = 0;
+	pthread_mutex_unlock(&m->rmx);
+
+	res = send_spool(m, m->sentfile, m->sentsize, m->sentmtime, m->putold);
+	if (res < 0 && ! m->os->connected) {
+		/* again when the link is back */
+		link_lost(m);
+		m->pending = 1;
+		pthread_mutex_lock(&m->rmx);
+		m->putdue = now_ms() + PUT_DELAY;
+		pthread_mutex_unlock(&m->rmx);
+	} else if (res < 0) {
+		stats_count(ST_PUT_ERRORS, 1);
+		m->pending = 1;
+		m->refused = errno;
+	}
+	return res;
+}
+
+/* the file open for writing goes now, as it is; close() has nothing
+   left to send unless it is written to again */
+static int send_open(mount *m) {
+
+	int res;
+
+	if (! m->dirty)
+		return 0;
+	res = send_spool(m, m->currentfile, m->currentpos, m->putmtime, m->putold);
+	if (res == 0)
+		m->putold = m->currentpos;
+	if (res == 0 || m->os->connected)
+		m->dirty = 0;	/* a refusal was told to the caller */
+	return res;
+}
+
+static int do_fsync(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+
+	if (m->operation == SIEFS_PUT && strcasecmp(r->path, m->currentfile) == 0)
+		return send_open(m);
+	if (m->pending && is_sent(m, r->path)) {
+		m->refused = 0;
+		return put_pending(m);
+	}
+	return 0;
+}
+
+/* posted by the connector thread when a file has waited long enough */
+static int do_pending(void *arg) {
+
+	mount *m = arg;
+
+	put_pending(m);
+	return 0;
+}
+
+/* close(), the data gathered goes to the spool. A file whose time
+   was set while open (cp -p does) expects no utime after close, so
+   it is sent here and close() gets the result */
+static int siefs_flush(mount *m, const char *path, struct fuse_file_info *finfo)
+{
+	fsreq r;
+
+	if (is_ctl(path) || finfo->fh != 0 || m->operation != SIEFS_PUT)
+		return 0;
+	if (flush_gathered(m) < 0)
+		return -errno;
+	if (m->putmtime == 0)
+		return 0;
+
+	r.m = m;
+	r.path = path;
+	if (CALL(SCHED_BACKGROUND, do_fsync, &r) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* the file goes to the phone now, with the result */
+static int siefs_fsync(mount *m, const char *path, struct fuse_file_info *finfo)
+{
+	fsreq r;
+
+	if (is_ctl(path) || finfo->fh != 0)
+		return 0;
+	if (m->operation == SIEFS_PUT && strcasecmp(path, m->currentfile) == 0 &&
+		flush_gathered(m) < 0)
+		return -errno;
+
+	r.m = m;
+	r.path = path;
+	if (CALL(SCHED_BACKGROUND, do_fsync, &r) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int do_close(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+
+	if (m->operation == SIEFS_IDLE || strcasecmp(r->path, m->currentfile) != 0)
+		return -1;
+
+	if (m->operation == SIEFS_GET) {
+		obex_close(m->os);
+		free(m->currentfile);
+	} else {
+		/* sent a moment later, see put_pending(); the spool is
+		   kept for a time set after that, see do_utime() */
+		m->sentsize = m->currentpos;
+		m->sentmtime = m->putmtime;
+		set_sent(m, m->currentfile);
+		if (m->dirty) {
+			m->dirty = 0;
+			m->pending = 1;
+			pthread_mutex_lock(&m->rmx);
+			m->putdue = now_ms() + PUT_DELAY;
+			pthread_cond_broadcast(&m->rcv);
+			pthread_mutex_unlock(&m->rmx);
+		}
+	}
+	m->currentfile = NULL;
+	m->operation = SIEFS_IDLE;
+	invalidate(m);
+	return 0;
+}
+
+static int siefs_close(mount *m, const char *path, struct fuse_file_info *finfo) 
+{
+	fsreq r;
+	int c;
+
+	if (is_ctl(path) || finfo->fh != 0)
+		return ctl_close(finfo);
+	if (m->wbuf != NULL && strcasecmp(path, m->currentfile) == 0) {
+		flush_gathered(m);
+		free(m->wbuf);
+		m->wbuf = NULL;
+	}
+	r.m = m;
+	r.path = path;
+	c = (m->operation == SIEFS_GET) ? SCHED_READ : SCHED_BACKGROUND;
+	if (CALL(c, do_close, &r) == 0)
+		ENDSESSION;
+
+    return 0;
+}
+
+static int do_read(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+	int n, l, done = 0;
+
+	if (r->offset != m->currentpos) {
+		obex_close(m->os);
+		if (obex_get(m->os, (char *)r->path, r->offset) < 0)
+			return -1;
+		m->currentpos = r->offset;
+	}
+
+	/* one packet at a time, let metadata requests in between */
+	while (done < r->size) {
+		if (done > 0)
+			sched_preempt(m->sched, SCHED_READ);
+		if (link_xfer(m) < 0)
+			return -1;
+
+		l = obex_buffered(m->os);
+		if (l == 0 || l > r->size - done)
+			l = (l == 0) ? 1 : r->size - done;
+		n = obex_read(m->os, r->buf + done, l);
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		done += n;
+		m->currentpos += n;
+	}
+
+	return done;
+}
+
+static int siefs_read(mount *m, const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *finfo)
+{
+	int n;
+	fsreq r;
+
+	if (is_ctl(path) || finfo->fh != 0)
+		return ctl_read(buf, size, offset, finfo);
+	r.m = m;
+	r.path = path;
+
+	if (m->operation != SIEFS_GET || strcasecmp(r.path, m->currentfile) != 0) {
+    	return -EBADF;
+	}
+
+	r.buf = buf;
+	r.size = size;
+	r.offset = offset;
+	n = CALL(SCHED_READ, do_read, &r);
+	if (n < 0)
+		n = -errno;
+
+	return n;
+}
+
+/*
+ * Writes smaller than IO_SIZE that follow each other are gathered
+ * and go to the spool together, so a program writing in small
+ * pieces costs one job per IO_SIZE instead of one per write.
+ */
+static int siefs_write(mount *m, const char *path, const char *buf, size_t size,
+                     off_t offset, struct fuse_file_info *finfo)
+{
+	int n = size;
+	fsreq r;
+
+	if (is_ctl(path))
+		return ((finfo->flags & O_ACCMODE) == O_RDONLY) ? -EBADF : ctl_write(m, buf, size);
+	r.m = m;
+	r.path = path;
+
+	if (m->operation != SIEFS_PUT || strcasecmp(r.path, m->currentfile) != 0) {
+    	return -EBADF;
+	}
+
+	/* checked here, the spool gets the data later */
+	if (m->putroom >= 0 && offset + (long long)size > m->putroom)
+		return -ENOSPC;
+
+	pthread_mutex_lock(&m->wmx);
+	if (m->wblen > 0 && (offset != m->wboff + m->wblen || m->wblen + size > IO_SIZE) &&
+		spool_gathered(m) < 0)
+	{
+		n = -errno;
+	} else if (size >= IO_SIZE || m->wbuf == NULL) {
+		r.buf = (char *)buf;
+		r.size = size;
+		r.offset = offset;
+		n = sched_call(m->sched, SCHED_BACKGROUND, do_write, &r);
+		if (n < 0)
+			n = -errno;
+	} else {
+		if (m->wblen == 0)
+			m->wboff = offset;
+		memcpy(m->wbuf + m->wblen, buf, size);
+		m->wblen += size;
+	}
+	pthread_mutex_unlock(&m->wmx);
+
+	return n;
+	
+}
+
+/*
+ * The phone keeps the time a file was sent with, it can't be
+ * changed later. A time set on a file open for writing, or closed
+ * but not sent yet, goes with it; set on the file sent last, the
+ * file is sent again from its spool.
+ */
+static int do_utime(void *arg) {
+
+	fsreq *r = arg;
+	mount *m = r->m;
+
+	if (m->operation == SIEFS_PUT && strcasecmp(r->path, m->currentfile) == 0) {
+		if (m->putmtime != r->mtime && m->currentpos > 0)
+			m->dirty = 1;
+		m->putmtime = r->mtime;
+		return 0;
+	}
+
+	if (m->operation != SIEFS_IDLE || ! is_sent(m, r->path) ||
+		m->spool == NULL || m->sentmtime == r->mtime)
+		return 0;
+
+	/* nothing more is waited for, the file goes now with its time;
+	   one sent already is replaced */
+	m->sentmtime = r->mtime;
+	if (! m->pending) {
+		m->putold = m->sentsize;
+		m->putroom = -1;
+		m->pending = 1;
+	}
+	m->refused = 0;
+
+	return put_pending(m);
+}
+
+static int siefs_utime(mount *m, const char *path, time_t mtime)
+{
+	int res = 0;
+	fsreq r;
+
+	if (is_ctl(path))
+		return 0;
+	r.m = m;
+	r.path = path;
+	r.mtime = mtime;
+	if (m->operation == SIEFS_PUT && strcasecmp(path, m->currentfile) == 0)
+		return (sched_call(m->sched, SCHED_BACKGROUND, do_utime, &r) < 0) ? -errno : 0;
+	if (! is_sent(m, path))
+		return 0;
+
+	if (STARTSESSION != 0)
+		return -EBUSY;
+	if (CALL(SCHED_BACKGROUND, do_utime, &r) < 0)
+		res = -errno;
+	ENDSESSION;
+
+	return res;
+}
+
+typedef struct _spacereq {
+
+	mount *m;
+	long long capacity;
+	long long avail;
+	int gen;
+
+} spacereq;
+
+static int do_space(void *arg) {
+
+	spacereq *r = arg;
+	mount *m = r->m;
+
+	/* obex_available() reconnects if needed, so capacity is only
+	   fetched again for a new connection */
+	link_quick(m);
+	r->avail = obex_available(m->os);
+	r->gen = m->os->conngen;
+	r->capacity = (r->gen == m->spacegen) ? m->capacity : 0;
+	if (r->capacity == 0 && r->avail > 0)
+		r->capacity = obex_capacity(m->os);
 
-static struct stat dir_st, file_st;
+	return 0;
+}
 
-static int start_session() {
+static int siefs_statfs(mount *m, struct statvfs *fst)
+{
+	spacereq r;
 
-	int i;
+	bzero(fst, sizeof(struct statvfs));
+	r.m = m;
 
-	for (i=0; i<10; i++) {
-		if (pthread_mutex_trylock(&smx) == 0)
-			return 0;
-		usleep(100000);
+	pthread_mutex_lock(&m->fmx);
+	if (m->freetime == 0 || time(NULL) - m->freetime >= m->freettl ||
+		m->spacegen != m->os->conngen)
+	{
+		/* stale - ask the phone */
+		stats_count(ST_SPACE_MISSES, 1);
+		pthread_mutex_unlock(&m->fmx);
+		CALL(SCHED_META, do_space, &r);
+		pthread_mutex_lock(&m->fmx);
+		if (r.capacity > 0) {
+			m->capacity = r.capacity;
+			m->free = r.avail;
+			m->spacegen = r.gen;
+			m->freetime = time(NULL);
+		}
+	} else {
+		stats_count(ST_SPACE_HITS, 1);
 	}
 
-	return -1;
-}
+	if (m->freetime != 0) {
+		fst->f_bsize = fst->f_frsize = 512;
+		fst->f_blocks = m->capacity / 512;
+		fst->f_bfree = fst->f_bavail = m->free / 512;
+		fst->f_namemax = 255;
+	}
+	pthread_mutex_unlock(&m->fmx);
 
-static void end_session() {
-	pthread_mutex_unlock(&smx);
+    return 0;
 }
 
-static void start_freq() {
-	pthread_mutex_lock(&gmx);
-	if (g_operation != SIEFS_IDLE) obex_suspend(g_os);
-}
+/*
+ * The kernel side: low-level FUSE, nodes are named by inode number
+ * (see inode.h). Names are converted from iocharset once, on
+ * lookup; readdirplus hands out the attributes with the listing,
+ * so a listing costs no getattr calls.
+ */
 
-static void end_freq() {
-	if (g_operation != SIEFS_IDLE) obex_resume(g_os);
-	pthread_mutex_unlock(&gmx);
-}
+/* a per-thread buffer for replies, grown as needed and freed with
+   the thread */
+typedef struct _replybuf {
 
-static void start_xfer() {
-	pthread_mutex_lock(&gmx);
-}
+	size_t size;
+	char data[0];
 
-static void end_xfer() {
-	pthread_mutex_unlock(&gmx);
-}
+} replybuf;
+
+static pthread_key_t g_replybuf;
 
-#define STARTSESSION start_session()
-#define ENDSESSION   end_session()
-#define STARTFREQ    start_freq()
-#define ENDFREQ      end_freq()
-#define STARTXFER    start_xfer()
-#define ENDXFER      end_xfer()
+static char *readbuf(size_t size) {
 
-static void invalidate() {
-	g_lastscan = 0;
+	replybuf *b = pthread_getspecific(g_replybuf);
+
+	if (b == NULL || b->size < size) {
+		free(b);
+		b = (replybuf *) malloc(sizeof(replybuf) + size);
+		b->size = size;
+		pthread_setspecific(g_replybuf, b);
+	}
+	return b->data;
 }
 
-static char *new_ascii2utf(char *s) {
+/* latency of every operation goes to its histogram and the trace */
+static void timed(int hist, int op, const char *path, int bytes, int res, long long t0) {
 
-	int size = strlen(s) * 3;
-	char *r = malloc(size + 1);
-	return ascii2utf(s, r, size);
+	long long dt = stats_now() - t0;
 
+	stats_time(hist, dt);
+	TRACE(op, 0, path, bytes, res, dt);
 }
 
-static void refill(fuse_dirh_t h, fuse_dirfil_t filler) {
+/* the mount a request is for, its events are counted there */
+static mount *mount_of(fuse_req_t req) {
 
-	int i, topdir;
-	obexdirentry *de;
-	char buf[256];
+	mount *m = fuse_req_userdata(req);
 
-	topdir = (strcmp(g_currentdir, "/") == 0);
-	if (filler) {
-		for (i=0; i<g_dirsize; i++) {
-			de = &g_dirlist[i];
-			if (topdir && g_hidetc && strcasecmp(de->name, "telecom") == 0)
-				continue;
-			utf2ascii(de->name, buf, 255);
-        	if (filler(h, buf, de->isdir ? 04 : 010, 0) != 0)
-            	break;
-		}
-    }
+	stats_use(m->stats);
+	return m;
 }
 
-static int getdir(const char *path, fuse_dirh_t h, fuse_dirfil_t filler) {
+/* how long the kernel may keep names and attributes */
+static double ttl(mount *m, const char *path) {
 
-	time_t t;
-	int d, n, allocd;
-	obexdirentry *de;
-	int res = 0;
+	return is_ctl(path) ? 0 : m->kernelttl;
+}
 
-	path = new_ascii2utf(path);
+/* path of ino into path (PATH_LEN bytes); if there is none,
+   answers the request and returns -1 */
+static int node(fuse_req_t req, fuse_ino_t ino, char *path) {
 
-	d = (g_operation == SIEFS_IDLE) ? 2 : 5;
-	t = time(NULL);
-	if (g_currentdir && strcasecmp(path, g_currentdir) == 0 && t-g_lastscan < d)
-	{
-		refill(h, filler);
-		free(path);
-		return 0;
-	}
+	mount *m = fuse_req_userdata(req);
 
-	STARTFREQ;
-	res = obex_readdir(g_os, (char *)path);
-	if (res < 0) {
-		ENDFREQ;
-		free(path);
-		return -errno;
+	if (it_path(m->inodes, ino, path, PATH_LEN) < 0) {
+		fuse_reply_err(req, errno);
+		return -1;
 	}
+	return 0;
+}
 
-	free(g_currentdir);
-	g_currentdir = strdup(path);
-	free(g_dirlist);
-	g_dirlist = NULL;
-	g_dirsize = allocd = 0;
-    while((de = obex_nextentry(g_os)) != NULL) {
-		if (g_dirsize >= allocd) {
-			allocd += 16;
-			g_dirlist = (obexdirentry *) realloc(g_dirlist, allocd * sizeof(obexdirentry));
-		}
-		memcpy(&g_dirlist[g_dirsize++], de, sizeof(obexdirentry));
-	}
+/* path of name in parent, converted to utf-8, see node() */
+static int child(fuse_req_t req, fuse_ino_t parent, const char *name, char *path) {
 
-	refill(h, filler);
+	mount *m = fuse_req_userdata(req);
+	int l;
 
-	g_lastscan = time(NULL);
-	ENDFREQ;
-	free(path);
+	if (node(req, parent, path) < 0)
+		return -1;
+	l = (path[1] == '\0') ? 0 : strlen(path);
+	/* a byte takes up to 3 in utf-8 */
+	if (l + 1 + 3 * strlen(name) >= PATH_LEN) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return -1;
+	}
+	path[l] = '/';
+	cs_to_utf(m->cs, name, path + l + 1, PATH_LEN - l - 2);
 	return 0;
 }
 
-static int siefs_getdir(const char *path, fuse_dirh_t h, fuse_dirfil_t filler)
-{
-    int res;
+/* attributes of path, counting a lookup for the kernel */
+static int entry(mount *m, const char *path, struct fuse_entry_param *e) {
 
-	DBG("[getdir %s ..", path);
-	path = new_ascii2utf(path);
-	res = getdir(path, h, filler);
-	free(path);
-	DBG(" = %i]\n", res);
+	int res;
 
-	return res;
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	res = siefs_getattr(m, path, &e->attr);
+	if (res != 0)
+		return res;
+	e->ino = it_lookup(m->inodes, path);
+	e->attr.st_ino = e->ino;
+	e->attr_timeout = e->entry_timeout = ttl(m, path);
+
+	return 0;
 }
 
-static int siefs_getattr(const char *path, struct stat *stbuf)
-{
-	int i, l;
-    int res = 0;
-	char *s, *newdir, *item;
+static void reply_entry(fuse_req_t req, struct fuse_entry_param *e, int res) {
 
-	path = new_ascii2utf(path);
-	l = strlen(path);
-	if (*path == '/' && *(path+1) == '\0') {
+	if (res == 0)
+		fuse_reply_entry(req, e);
+	else
+		fuse_reply_err(req, -res);
+}
 
-		/* root node is always a directory, isn't it? */
-		*stbuf = dir_st;
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	/* always, the attributes come with the listing anyway */
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+	conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+	/* pages go when a file's size or time is seen changed */
+	if (conn->capable & FUSE_CAP_AUTO_INVAL_DATA)
+		conn->want |= FUSE_CAP_AUTO_INVAL_DATA;
+	/* big requests, in order: a read out of order restarts the GET */
+	conn->want &= ~FUSE_CAP_ASYNC_READ;
+	conn->max_write = IO_SIZE;
+	conn->max_read = IO_SIZE;
+	conn->max_readahead = READAHEAD_KB * 1024;
+}
 
-	} else if (g_currentdir && strncasecmp(g_currentdir, path, l) == 0 &&
-		(g_currentdir[l] == '\0' || g_currentdir[l] == '/'))
-	{
-		/* current and higher nodes are also a directories */
-		*stbuf = dir_st;
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	mount *m = mount_of(req);
+	struct fuse_entry_param e;
+	long long t0 = stats_now();
+	char path[PATH_LEN];
+	int res;
+
+	if (child(req, parent, name, path) < 0)
+		return;
+	res = entry(m, path, &e);
+	timed(ST_FUSE_LOOKUP, TR_LOOKUP, path, 0, res, t0);
+	reply_entry(req, &e, res);
+}
 
-	} else {
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	mount *m = mount_of(req);
 
-		newdir = strdup(path);
-		s = strrchr(newdir, '/');
-		*s = '\0';
-		item = s+1;
-		s = (s == newdir) ? "/" : newdir;
+	it_forget(m->inodes, ino, nlookup);
+	fuse_reply_none(req);
+}
 
-		res = getdir(s, 0, NULL);
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	mount *m = mount_of(req);
+	size_t i;
 
-		if (res == 0) {
-			res = -ENOENT;
-			for (i=0; i<g_dirsize; i++) {
-				if (strcasecmp(item, g_dirlist[i].name) == 0) {
-					res = 0;
-					*stbuf = g_dirlist[i].isdir ? dir_st : file_st;
-					stbuf->st_size = g_dirlist[i].size;
-					stbuf->st_blocks = stbuf->st_size / 512;
-					stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime =
-						g_dirlist[i].mtime;
-					break;
-				}
-			}
-		}
-		free(newdir);
-	}
-	free(path);
+	for (i=0; i<count; i++)
+		it_forget(m->inodes, forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
 
-	return res;
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	mount *m = mount_of(req);
+	struct stat st;
+	long long t0 = stats_now();
+	char path[PATH_LEN];
+	int res;
+
+	if (node(req, ino, path) < 0)
+		return;
+	res = siefs_getattr(m, path, &st);
+	st.st_ino = ino;
+	timed(ST_FUSE_GETATTR, TR_GETATTR, path, 0, res, t0);
+	if (res == 0)
+		fuse_reply_attr(req, &st, ttl(m, path));
+	else
+		fuse_reply_err(req, -res);
 }
 
-static int siefs_mkdir(const char *path, mode_t mode)
+/* size and modification time can be changed, mode and owner are ignored */
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
 {
+	mount *m = mount_of(req);
+	struct stat st;
+	long long t0 = stats_now();
+	char path[PATH_LEN];
 	int res = 0;
 
-	DBG("[mkdir %s ..", path);
-	path = new_ascii2utf(path);
-	STARTFREQ;
-	if (obex_mkdir(g_os, (char *)path) < 0)
-		res = -errno;
-	invalidate();
-	ENDFREQ;
-	free(path);
-	DBG(" = %i]\n", res);
-
-    return res;
+	if (node(req, ino, path) < 0)
+		return;
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		res = siefs_truncate(m, path, attr->st_size);
+		timed(ST_FUSE_TRUNCATE, TR_TRUNCATE, path, attr->st_size, res, t0);
+	}
+	if (res == 0 && (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)))
+		res = siefs_utime(m, path, (to_set & FUSE_SET_ATTR_MTIME_NOW) ? time(NULL) : attr->st_mtime);
+	if (res == 0)
+		res = siefs_getattr(m, path, &st);
+	st.st_ino = ino;
+	if (res == 0)
+		fuse_reply_attr(req, &st, ttl(m, path));
+	else
+		fuse_reply_err(req, -res);
 }
 
-static int siefs_unlink(const char *path)
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
 {
-	int res = 0;
-
-	DBG("[unlink %s ..", path);
-	path = new_ascii2utf(path);
-	STARTFREQ;
-	if (obex_delete(g_os, (char *)path) < 0)
-		res = -errno;
-	invalidate();
-	ENDFREQ;
-	free(path);
-	DBG(" = %i]\n", res);
+	mount *m = mount_of(req);
+	struct fuse_entry_param e;
+	long long t0 = stats_now();
+	char path[PATH_LEN];
+	int res;
+
+	if (child(req, parent, name, path) < 0)
+		return;
+	res = siefs_mknod(m, path, mode, rdev);
+	timed(ST_FUSE_MKNOD, TR_MKNOD, path, 0, res, t0);
+	if (res == 0)
+		res = entry(m, path, &e);
+	reply_entry(req, &e, res);
+}
 
-    return res;
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	mount *m = mount_of(req);
+	struct fuse_entry_param e;
+	long long t0 = stats_now();
+	char path[PATH_LEN];
+	int res;
+
+	if (child(req, parent, name, path) < 0)
+		return;
+	res = siefs_mkdir(m, path, mode);
+	timed(ST_FUSE_MKDIR, TR_MKDIR, path, 0, res, t0);
+	if (res == 0)
+		res = entry(m, path, &e);
+	reply_entry(req, &e, res);
 }
 
-static int siefs_rmdir(const char *path)
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    return siefs_unlink(path);
+	mount *m = mount_of(req);
+	long long t0 = stats_now();
+	char path[PATH_LEN];
+	int res;
+
+	if (child(req, parent, name, path) < 0)
+		return;
+	res = siefs_unlink(m, path);
+	timed(ST_FUSE_UNLINK, TR_UNLINK, path, 0, res, t0);
+	if (res == 0)
+		it_unlink(m->inodes, path);
+	fuse_reply_err(req, -res);
 }
 
-static int siefs_truncate(const char *path, off_t size)
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	int res = 0;
+	mount *m = mount_of(req);
+	long long t0 = stats_now();
+	char path[PATH_LEN];
+	int res;
+
+	if (child(req, parent, name, path) < 0)
+		return;
+	res = siefs_rmdir(m, path);
+	timed(ST_FUSE_RMDIR, TR_RMDIR, path, 0, res, t0);
+	if (res == 0)
+		it_unlink(m->inodes, path);
+	fuse_reply_err(req, -res);
+}
 
-	DBG("[truncate %s=%i ..", path, (int)size);
-	path = new_ascii2utf(path);
-	STARTFREQ;
-	if (obex_delete(g_os, (char *)path) != 0) {
-		res = -errno;
-	} else if (obex_put(g_os, (char *)path) < 0) {
-		res = -errno;
-	} else {
-		obex_close(g_os);
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+	fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	mount *m = mount_of(req);
+	long long t0 = stats_now();
+	char from[PATH_LEN], to[PATH_LEN];
+	int res;
+
+	if (flags != 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
 	}
-	invalidate();
-	ENDFREQ;
-	free(path);
-	DBG(" = %i]\n", res);
+	if (child(req, parent, name, from) < 0 || child(req, newparent, newname, to) < 0)
+		return;
+	res = siefs_rename(m, from, to);
+	timed(ST_FUSE_RENAME, TR_RENAME, from, 0, res, t0);
+	if (res == 0)
+		it_rename(m->inodes, from, to);
+	fuse_reply_err(req, -res);
+}
 
-    return res;
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+	fuse_reply_err(req, EPERM);
 }
 
-static int siefs_rename(const char *from, const char *to)
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
 {
-	int res = 0;
+	fuse_reply_err(req, EPERM);
+}
 
-	DBG("[rename %s->%s ..", from, to);
-	from = new_ascii2utf(from);
-	to = new_ascii2utf(to);
-	STARTFREQ;
-	if (obex_move(g_os, (char *)from, (char *)to) < 0)
-		res = -errno;
-	invalidate();
-	ENDFREQ;
-	free(from);
-	free(to);
-	DBG(" = %i]\n", res);
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	mount *m = mount_of(req);
+	long long t0 = stats_now();
+	char path[PATH_LEN];
+	int res;
+
+	if (node(req, ino, path) < 0)
+		return;
+	res = siefs_open(m, path, fi);
+	timed(ST_FUSE_OPEN, TR_OPEN, path, fi->flags, res, t0);
+	if (is_ctl(path) || fi->fh != 0)
+		fi->direct_io = 1;	/* the size isn't known in advance */
+	else
+		fi->keep_cache = 1;	/* changes are invalidated, see changed() */
+	if (res == 0)
+		fuse_reply_open(req, fi);
+	else
+		fuse_reply_err(req, -res);
+}
 
-    return res;
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	mount *m = mount_of(req);
+	long long t0 = stats_now();
+	char path[PATH_LEN], *buf;
+	int n;
+
+	if (node(req, ino, path) < 0)
+		return;
+	buf = readbuf(size);
+	n = siefs_read(m, path, buf, size, off, fi);
+	timed(ST_FUSE_READ, TR_READ, path, size, n, t0);
+	if (n >= 0)
+		fuse_reply_buf(req, buf, n);
+	else
+		fuse_reply_err(req, -n);
 }
 
-static int siefs_mknod(const char *path, mode_t mode, dev_t rdev)
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
 {
-	int res = 0;
-	long t;
+	mount *m = mount_of(req);
+	long long t0 = stats_now();
+	char path[PATH_LEN];
+	int n;
 
-	t = mode & S_IFMT;
-	if (t != 0 && t != 0100000)
-    	return -EPERM;
+	if (node(req, ino, path) < 0)
+		return;
+	n = siefs_write(m, path, buf, size, off, fi);
+	timed(ST_FUSE_WRITE, TR_WRITE, path, size, n, t0);
+	if (n >= 0)
+		fuse_reply_write(req, n);
+	else
+		fuse_reply_err(req, -n);
+}
 
-	if (STARTSESSION != 0)
-		return -EBUSY;
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	mount *m = mount_of(req);
+	long long t0 = stats_now();
+	char path[PATH_LEN];
+	int res;
+
+	if (node(req, ino, path) < 0)
+		return;
+	res = siefs_flush(m, path, fi);
+	timed(ST_FUSE_FLUSH, TR_FLUSH, path, 0, res, t0);
+	fuse_reply_err(req, -res);
+}
 
-	DBG("[mknod %s(%08o)..", path, mode);
-	path = new_ascii2utf(path);
-	STARTXFER;
-	if (obex_put(g_os, (char *)path) < 0) {
-		res = -errno;
-	} else {
-		obex_close(g_os);
-	}
-	invalidate();
-	ENDXFER;
-	free(path);
-	ENDSESSION;
-	DBG(" = %i]\n", res);
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	mount *m = mount_of(req);
+	long long t0 = stats_now();
+	char path[PATH_LEN];
+	int res;
+
+	if (node(req, ino, path) < 0)
+		return;
+	res = siefs_fsync(m, path, fi);
+	timed(ST_FUSE_FSYNC, TR_FSYNC, path, 0, res, t0);
+	fuse_reply_err(req, -res);
+}
 
-	return res;
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	mount *m = mount_of(req);
+	long long t0 = stats_now();
+	char path[PATH_LEN];
+	int res;
+
+	if (node(req, ino, path) < 0)
+		return;
+	res = siefs_close(m, path, fi);
+	timed(ST_FUSE_RELEASE, TR_RELEASE, path, 0, res, t0);
+	fuse_reply_err(req, -res);
 }
 
-static int siefs_open(const char *path, struct fuse_file_info *finfo)
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	int res = 0;
+	mount *m = mount_of(req);
+	long long t0 = stats_now();
+	dirhandle *dh;
+	char path[PATH_LEN];
+	int res;
+
+	if (node(req, ino, path) < 0)
+		return;
+	dh = (dirhandle *) malloc(sizeof(dirhandle));
+	res = siefs_opendir(m, path, dh);
+	timed(ST_FUSE_OPENDIR, TR_OPENDIR, path, dh->size, res, t0);
+	if (res != 0) {
+		free(dh);
+		fuse_reply_err(req, -res);
+		return;
+	}
+	dh->path = strdup(path);
+	fi->fh = (unsigned long) dh;
+	fuse_reply_open(req, fi);
+}
 
-	DBG("[open %s,%04x ..", path, finfo->flags);
-	path = new_ascii2utf(path);
-	switch (finfo->flags & O_ACCMODE) {
-		case O_RDONLY:
-			if (STARTSESSION != 0) {
-				res = -EBUSY;
+/* entries of an open directory from offset off on, with their
+   attributes and a lookup each if plus is set */
+static void dirfill(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi, int plus)
+{
+	mount *m = mount_of(req);
+	dirhandle *dh = (dirhandle *) fi->fh;
+	struct fuse_entry_param e;
+	char path[PATH_LEN], *buf;
+	size_t pos = 0, l;
+	int i, n;
+
+	buf = readbuf(size);
+	n = (dh->path[1] == '\0') ? 0 : strlen(dh->path);
+	memcpy(path, dh->path, n);
+	path[n++] = '/';
+	for (i = off; i < dh->size; i++) {
+		if (n + strlen(dh->list[i].name) >= PATH_LEN)
+			continue;
+		strcpy(path + n, dh->list[i].name);
+		memset(&e, 0, sizeof(e));
+		if (is_ctl(path))
+			ctl_getattr(m, path, &e.attr);
+		else
+			fill_stat(&dh->list[i], &e.attr);
+
+		if (plus) {
+			l = fuse_add_direntry_plus(req, NULL, 0, dh->names[i], NULL, 0);
+			if (pos + l > size)
 				break;
-			}
-			STARTXFER;
-			if (obex_get(g_os, (char *)path, 0) < 0) {
-				res = -errno;
-				ENDXFER;
-				ENDSESSION;
+			e.ino = it_lookup(m->inodes, path);
+			e.attr.st_ino = e.ino;
+			e.attr_timeout = e.entry_timeout = ttl(m, path);
+			fuse_add_direntry_plus(req, buf + pos, size - pos, dh->names[i], &e, i + 1);
+		} else {
+			e.attr.st_ino = it_peek(m->inodes, path);
+			if (e.attr.st_ino == 0)
+				e.attr.st_ino = -1;	/* not known yet */
+			l = fuse_add_direntry(req, buf + pos, size - pos, dh->names[i], &e.attr, i + 1);
+			if (pos + l > size)
 				break;
-			}
-			free(g_currentfile);
-			g_currentfile = strdup(path);
-			g_operation = SIEFS_GET;
-			g_currentpos = 0;
-			ENDXFER;
-			break;
+		}
+		pos += l;
+	}
 
-		case O_WRONLY:
-			if (STARTSESSION != 0) {
-				res = -EBUSY;
-				break;
-			}
-			STARTXFER;
-			if (obex_put(g_os, (char *)path) < 0) {
-				res = -errno;
-				ENDXFER;
-				ENDSESSION;
-				break;
-			}
-			free(g_currentfile);
-			g_currentfile = strdup(path);
-			g_operation = SIEFS_PUT;
-			g_currentpos = 0;
-			ENDXFER;
-			break;
+	fuse_reply_buf(req, buf, pos);
+}
 
-		default:
-			res = -EPERM;
-			break;
-	}
-	free(path);
-	DBG("]\n");
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	dirfill(req, size, off, fi, 0);
+}
 
-	return res;
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	dirfill(req, size, off, fi, 1);
 }
 
-static int siefs_close(const char *path, struct fuse_file_info *finfo) 
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	DBG("[close %s ..", path);
-	path = new_ascii2utf(path);
-	if (g_operation != SIEFS_IDLE && strcasecmp(path, g_currentfile) == 0) {
-		STARTXFER;
-		obex_close(g_os);
-		free(g_currentfile);
-		g_currentfile = NULL;
-		g_operation = SIEFS_IDLE;
-		invalidate();
-		ENDXFER;
-		ENDSESSION;
-	}
-	free(path);
-	DBG("]\n");
+	dirhandle *dh = (dirhandle *) fi->fh;
 
-    return 0;
+	free(dh->path);
+	free(dh->list);
+	free(dh->names);
+	free(dh);
+	fuse_reply_err(req, 0);
 }
 
-static int siefs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *finfo)
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-	int n, position;
-	int r=0;
+	mount *m = mount_of(req);
+	struct statvfs st;
+	long long t0 = stats_now();
+	int res;
+
+	res = siefs_statfs(m, &st);
+	timed(ST_FUSE_STATFS, TR_STATFS, NULL, 0, res, t0);
+	fuse_reply_statfs(req, &st);
+}
+
+static struct fuse_lowlevel_ops siefs_oper = {
+    init:		ll_init,
+    lookup:		ll_lookup,
+    forget:		ll_forget,
+    forget_multi:	ll_forget_multi,
+    getattr:	ll_getattr,
+    setattr:	ll_setattr,
+    mknod:		ll_mknod,
+    mkdir:		ll_mkdir,
+    unlink:		ll_unlink,
+    rmdir:		ll_rmdir,
+    symlink:	ll_symlink,
+    rename:     ll_rename,
+    link:		ll_link,
+    open:		ll_open,
+    read:		ll_read,
+    write:		ll_write,
+    flush:		ll_flush,
+    fsync:		ll_fsync,
+    release:	ll_release,
+    opendir:	ll_opendir,
+    readdir:	ll_readdir,
+    readdirplus:	ll_readdirplus,
+    releasedir:	ll_releasedir,
+    statfs:		ll_statfs,
+};
 
-	DBG("[read %s,%i ..", path, size);
-	path = new_ascii2utf(path);
+static int do_connect(void *arg) {
 
-	if (g_operation != SIEFS_GET || strcasecmp(path, g_currentfile) != 0) {
-		free(path);
-    	return -EBADF;
-	}
+	mount *m = arg;
+
+	return obex_connect(m->os);
+}
+
+/* the first job of a mount, its scheduler thread counts there */
+static int do_stats(void *arg) {
+
+	mount *m = arg;
+
+	stats_use(m->stats);
+	return 0;
+}
+
+/*
+ * Connect right after mount and again whenever the device node
+ * comes back (eg. a USB cable replugged), so requests find the
+ * link ready instead of paying for the AT/BFB setup. In between,
+ * pass invalidations on to the kernel.
+ */
+static void *connector(void *arg) {
+
+	mount *m = arg;
+	struct stat st, last;
+	struct timespec ts;
+	const char *node;
+	inval *n;
+	int (*job)(void *);
+	long long t0;
+	int r;
+
+	stats_use(m->stats);
+
+	/* network devices have nothing to watch, a job finding the link dead
+	   has them reconnected (see link_lost()) */
+	node = comm_node(m->device);
+	memset(&last, 0, sizeof(last));
+	if (node != NULL) stat(node, &last);
+
+	pthread_mutex_lock(&m->rmx);
+	while (! m->stop) {
+
+		if (m->kick && m->present) {
+			m->state = STATE_CONNECTING;
+			job = m->reset ? do_reconnect : do_connect;
+			m->reset = 0;
+			pthread_mutex_unlock(&m->rmx);
+			t0 = stats_now();
+			r = sched_call(m->sched, SCHED_META, job, m);
+			TRACE(TR_LINK, (r == 0) ? TR_UP : TR_DOWN, NULL, 0, r, stats_now() - t0);
+			pthread_mutex_lock(&m->rmx);
+			m->state = (r == 0) ? STATE_READY : STATE_DOWN;
+			m->kick = 0;
+			if (r == 0 && m->tready < 0) {
+				m->tready = now_ms() - m->t0;
+				fprintf(stderr, "siefs: %s: link ready %lli ms after mount\n", m->mntpoint, m->tready);
+			}
+			pthread_cond_broadcast(&m->rcv);
+			continue;
+		}
 
-	STARTXFER;
-	if (offset != g_currentpos) {
-		obex_close(g_os);
-		if (obex_get(g_os, (char *)path, offset) < 0) {
-			ENDXFER;
-			free(path);
-			return -errno;
+		if ((n = take_inval(m)) != NULL) {
+			pthread_mutex_unlock(&m->rmx);
+			send_inval(m, n);
+			free(n->path);
+			free(n);
+			pthread_mutex_lock(&m->rmx);
+			continue;
 		}
-		g_currentpos = offset;
-	}
 
-	n = obex_read(g_os, buf, size);
-	if (n < 0) {
-		r = -errno;
-	} else {
-		g_currentpos += n;
+		/* a closed file waiting to be sent, see put_pending() */
+		if (m->putdue != 0 && now_ms() >= m->putdue) {
+			if (m->state == STATE_READY) {
+				m->putdue = 0;
+				pthread_mutex_unlock(&m->rmx);
+				sched_post(m->sched, SCHED_BACKGROUND, do_pending, m);
+				pthread_mutex_lock(&m->rmx);
+				continue;
+			}
+			m->putdue = now_ms() + PUT_DELAY;
+			if (m->state == STATE_DOWN && m->present) {
+				m->kick = 1;
+				continue;
+			}
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		if (m->putdue != 0 && m->putdue - now_ms() < 1000) {
+			ts.tv_nsec += (m->putdue - now_ms()) * 1000000;
+			ts.tv_sec += ts.tv_nsec / 1000000000;
+			ts.tv_nsec %= 1000000000;
+		} else {
+			ts.tv_sec += 1;
+		}
+		pthread_cond_timedwait(&m->rcv, &m->rmx, &ts);
+		if (m->kick || node == NULL) continue;
+
+		if (stat(node, &st) != 0) {
+			if (m->present) TRACE(TR_LINK, TR_GONE, node, 0, 0, 0);
+			m->present = 0;
+			m->state = STATE_DOWN;
+		} else if (! m->present || st.st_ino != last.st_ino || st.st_rdev != last.st_rdev) {
+			TRACE(TR_LINK, TR_BACK, node, 0, 0, 0);
+			last = st;
+			m->present = 1;
+			m->state = STATE_DOWN;
+			m->kick = 1;
+		}
 	}
-	ENDXFER;
-	free(path);
-	DBG(" = %i]\n", n);
+	pthread_mutex_unlock(&m->rmx);
 
-	return n;
+	return NULL;
 }
 
-static int siefs_write(const char *path, const char *buf, size_t size,
-                     off_t offset, struct fuse_file_info *finfo)
-{
-	int n;
+static int g_live = 0;		/* mounts whose FUSE loop runs */
 
-	DBG("[write %s,%i ..", path, size);
-	path = new_ascii2utf(path);
+/* serve the kernel until the filesystem is unmounted, then wake main() */
+static void *loop(void *arg) {
 
-	if (g_operation != SIEFS_PUT || strcasecmp(path, g_currentfile) != 0) {
-		free(path);
-    	return -EBADF;
-	}
+	mount *m = arg;
+
+	fuse_session_loop_mt(m->se, 0);
+	if (__sync_sub_and_fetch(&g_live, 1) == 0)
+		pthread_kill(g_main, SIGTERM);
 
-	if (offset != g_currentpos) {
-		free(path);
-		return -ESPIPE;
+	return NULL;
+}
+
+/*
+ * The stores are kept as <dir>/<mountpoint>.pb.irmc and .cal.irmc,
+ * slashes in the mount point made underscores; without a dir they
+ * live as long as the mount.
+ */
+static void irmc_stores(mount *m) {
+
+	char *file = NULL, *p;
+	int db;
+
+	for (db=0; db<IRMC_STORES; db++) {
+		if (g_irmcdir != NULL) {
+			file = (char *) malloc(strlen(g_irmcdir) + strlen(m->mntpoint) + 16);
+			sprintf(file, "%s/", g_irmcdir);
+			for (p = m->mntpoint; *p == '/'; p++);
+			p = strcpy(file + strlen(file), p);
+			for (; *p != '\0'; p++)
+				if (*p == '/') *p = '_';
+			sprintf(p, ".%s.irmc", (db == IRMC_CAL) ? "cal" : "pb");
+		}
+		m->irmc[db] = irmc_create(db, file);
+		free(file);
 	}
+}
 
-	STARTXFER;
-	n = obex_write(g_os, (char *)buf, size);
-	if (n < 0) {
-		n = -errno;
-	} else {
-		g_currentpos += n;
+/* a mount with its link open, or NULL; nothing runs yet */
+static mount *mount_new(char *device, char *mntpoint) {
+
+	mount *m;
+
+	m = (mount *) calloc(1, sizeof(mount));
+	if (m == NULL)
+		return NULL;
+	m->device = device;
+	m->mntpoint = mntpoint;
+	m->os = obex_startup(device, g_baudrate);
+	if (m->os == NULL) {
+		free(m);
+		return NULL;
 	}
-	ENDXFER;
-	free(path);
-	DBG(" = %i]\n", n);
+	m->os->probe = 0;	/* the connector does that */
+	m->cs = charset_find(g_iocharset);
+	m->operation = SIEFS_IDLE;
+	pthread_mutex_init(&m->smx, NULL);
+	pthread_cond_init(&m->scv, NULL);
+	m->state = STATE_DOWN;
+	m->kick = 1;		/* connect as soon as possible */
+	m->present = 1;
+	pthread_mutex_init(&m->rmx, NULL);
+	pthread_cond_init(&m->rcv, NULL);
+	m->tready = m->tlisting = -1;
+	m->spacegen = -1;
+	pthread_mutex_init(&m->fmx, NULL);
+	pthread_mutex_init(&m->wmx, NULL);
+	m->invaltail = &m->inval;
+	m->baudrate = g_baudrate;
+	m->dirsize = DIRCACHE_SIZE;
+	m->dirttl = DIR_TTL;
+	m->dirttl_busy = DIR_TTL_BUSY;
+	m->freettl = FREE_TTL;
+	m->kernelttl = KERNEL_TTL;
+	if (g_irmc)
+		irmc_stores(m);
+
+	return m;
+}
 
-	return n;
-	
+/*
+ * The kernel offers no more read-ahead than its default (128 KB)
+ * at mount time, it can only be raised afterwards, on the mount's
+ * bdi. Needs root, a failure is harmless.
+ */
+static void set_readahead(mount *m) {
+
+	char name[64];
+	struct stat st;
+	FILE *f;
+
+	if (stat(m->mntpoint, &st) != 0)
+		return;
+	sprintf(name, "/sys/class/bdi/%u:%u/read_ahead_kb", major(st.st_dev), minor(st.st_dev));
+	f = fopen(name, "w");
+	if (f == NULL)
+		return;
+	fprintf(f, "%i\n", READAHEAD_KB);
+	fclose(f);
 }
 
-static int siefs_statfs(const char *buf, struct statfs *fst)
-{
-	int n;
+/* start the threads of m and mount it, returns -1 on failure */
+static int mount_start(mount *m, char *prog) {
 
-	DBG("[statfs ..");
+	char *fargv[] = { prog, "-omax_read=131072", NULL };	/* IO_SIZE */
+	struct fuse_args args = FUSE_ARGS_INIT(2, fargv);
 
-	STARTFREQ;
-	bzero(fst, sizeof(struct statfs));
-	n = obex_capacity(g_os);
-	if (n > 0) {
-		fst->f_bsize = 512;
-		fst->f_blocks = n / 512;
-		fst->f_bfree = obex_available(g_os) / 512;
-		fst->f_namelen = 255;
+	m->dircache = dc_create(m->dirsize);
+	m->sched = sched_start();
+	m->inodes = it_create();
+	m->stats = stats_create();
+	if (m->dircache == NULL || m->sched == NULL || m->inodes == NULL || m->stats == NULL) {
+		perror("siefs: cannot start scheduler");
+		return -1;
+	}
+	sched_call(m->sched, SCHED_META, do_stats, m);
+	if (g_bgrefresh)
+		dc_background(m->dircache, revalidate, m);
+	dc_notify(m->dircache, changed, m);
+	if (m->cs->c2u != NULL)
+		dc_charset(m->dircache, m->cs);
+
+	m->t0 = now_ms();
+	if (pthread_create(&m->connector, NULL, connector, m) != 0) {
+		perror("siefs: cannot start connector");
+		return -1;
+	}
+	m->running = 1;
+
+	/* fuse_session_new() takes the options it knows out of args,
+	   so every mount needs a list of its own */
+	m->se = fuse_session_new(&args, &siefs_oper, sizeof(siefs_oper), m);
+	fuse_opt_free_args(&args);
+	if (m->se == NULL) {
+		fprintf(stderr, "siefs: cannot start fuse session\n");
+		return -1;
+	}
+	if (fuse_session_mount(m->se, m->mntpoint) != 0) {
+		fprintf(stderr, "siefs: cannot mount %s\n", m->mntpoint);
+		return -1;
 	}
-	ENDFREQ;
-	DBG("]\n");
 
-    return 0;
-}
+	__sync_add_and_fetch(&g_live, 1);
+	if (pthread_create(&m->loop, NULL, loop, m) != 0) {
+		__sync_sub_and_fetch(&g_live, 1);
+		perror("siefs: cannot start fuse loop");
+		return -1;
+	}
+	m->running = 2;
+	set_readahead(m);
 
-static int siefs_chmod(const char *path, mode_t mode)
-{
-    return 0;
+	return 0;
 }
 
-static int siefs_chown(const char *path, uid_t uid, gid_t gid)
-{
-    return 0;
-}
+/* the link says goodbye to the phone, the last job of a mount */
+static int do_shutdown(void *arg) {
 
-static int siefs_utime(const char *path, struct utimbuf *buf)
-{
-    return 0;
-}
+	mount *m = arg;
 
-static int siefs_readlink(const char *path, char *buf, size_t size)
-{
-    return -EPERM;
+	put_pending(m);
+	obex_shutdown(m->os);
+	m->os = NULL;
+	return 0;
 }
 
-static int siefs_link(const char *from, const char *to)
-{
-    return -EPERM;
+/* stop the threads mount_start() started, after the unmount; the
+   link is closed in the background, phones take a while each */
+static void mount_stop(mount *m) {
+
+	if (m->running >= 2)
+		pthread_join(m->loop, NULL);
+	if (m->running >= 1) {
+		pthread_mutex_lock(&m->rmx);
+		m->stop = 1;
+		pthread_cond_broadcast(&m->rcv);
+		pthread_mutex_unlock(&m->rmx);
+		pthread_join(m->connector, NULL);
+	}
+	if (m->se != NULL)
+		fuse_session_destroy(m->se);
+	if (m->sched)
+		sched_post(m->sched, SCHED_META, do_shutdown, m);
 }
 
-static int siefs_symlink(const char *from, const char *to)
-{
-    return -EPERM;
-}
+/* wait for mount_stop() to finish and free m */
+static void mount_free(mount *m) {
 
-static struct fuse_operations siefs_oper = {
-    getattr:	siefs_getattr,
-    readlink:	siefs_readlink,
-    getdir:     siefs_getdir,
-    mknod:		siefs_mknod,
-    mkdir:		siefs_mkdir,
-    symlink:	siefs_symlink,
-    unlink:		siefs_unlink,
-    rmdir:		siefs_rmdir,
-    rename:     siefs_rename,
-    link:		siefs_link,
-    chmod:		siefs_chmod,
-    chown:		siefs_chown,
-    truncate:	siefs_truncate,
-    utime:		siefs_utime,
-    open:		siefs_open,
-    read:		siefs_read,
-    write:		siefs_write,
-    statfs:		siefs_statfs,
-    release:	siefs_close,
-};
+	inval *n;
+	int i;
+
+	if (m->sched) sched_stop(m->sched);
+	if (m->os) obex_shutdown(m->os);
+	if (m->dircache) dc_destroy(m->dircache);
+	if (m->inodes) it_destroy(m->inodes);
+	for (i=0; i<IRMC_STORES; i++)
+		irmc_free(m->irmc[i]);
+	stats_free(m->stats);
+	while ((n = take_inval(m)) != NULL) {
+		free(n->path);
+		free(n);
+	}
+	free(m->currentfile);
+	set_sent(m, NULL);
+	free(m);
+}
 
 void usage() {
 
-	fprintf(stderr, "Usage: mount -t siefs [-o options] comm_device mountpoint\n\n");
+	fprintf(stderr, "Usage: mount -t siefs [-o options] comm_device mountpoint\n");
+	fprintf(stderr, "       siefs [-o options] comm_device mountpoint [comm_device mountpoint]...\n\n");
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "\tuid=<value>\t\towner id\n");
 	fprintf(stderr, "\tgid=<value>\t\tgroup id\n");
@@ -569,13 +2864,18 @@ void usage() {
 	fprintf(stderr, "\tbaudrate=<value>\t\tcommunication speed\n");
 	fprintf(stderr, "\tdevice=<device>\t\tcommunication device (for use in fstab)\n");
 	fprintf(stderr, "\tnohide\t\t\tdon't hide `telecom' directory\n");
+	fprintf(stderr, "\tbgrefresh\t\tshow expired listings at once, refresh them in background\n");
+	fprintf(stderr, "\tirmc[=<dir>]\t\tshow phone book and calendar as telecom/pb.vcf and cal.vcs,\n"
+		"\t\t\t\tkept up to date by IrMC sync; copies are kept in dir\n");
+	fprintf(stderr, "\ttrace[=<file>]\t\trecord events, SIGUSR2 writes them to file (" TRACE_FILE ")\n");
+	fprintf(stderr, "\tfault=<spec>\t\tinject line errors, for testing (eg. seed=1:corrupt=1e-4)\n");
+	fprintf(stderr, "\nDevice may be a tty or tcp:host:port, rfc2217:host:port, unix:/path, pty:/dev/pts/N\n");
+	fprintf(stderr, "\nSeveral phones may be served by one process, the options apply to all of them\n");
+	fprintf(stderr, "Link and latency statistics are in <mountpoint>/.siefs/stats (SIGUSR1 prints them)\n");
+	fprintf(stderr, "Caches and the link can be tuned by writing to <mountpoint>/.siefs/ctl\n");
 	exit(1);
 }
 
-void cleanup() {
-	obex_shutdown(g_os);
-}
-
 void parse_options(char *p)
 {
 	while (p && *p) {
@@ -592,9 +2892,29 @@ void parse_options(char *p)
 			*(g_iocharset + strcspn(g_iocharset, ",")) = '\0';
 		} else if (strncmp(p, "nohide", 6) == 0) {
 			g_hidetc = 0;
+		} else if (strncmp(p, "bgrefresh", 9) == 0) {
+			g_bgrefresh = 1;
+		} else if (strncmp(p, "irmc", 4) == 0) {
+			g_irmc = 1;
+			if (p[4] == '=') {
+				g_irmcdir = strdup(p+5);
+				*(g_irmcdir + strcspn(g_irmcdir, ",")) = '\0';
+			}
 		} else if (strncmp(p, "device=", 7) == 0) {
 			comm_device = strdup(p+7);
 			*(comm_device + strcspn(comm_device, ",")) = '\0';
+		} else if (strncmp(p, "trace", 5) == 0) {
+			trace_enable(1);
+			if (p[5] == '=') {
+				g_tracefile = strdup(p+6);
+				*(g_tracefile + strcspn(g_tracefile, ",")) = '\0';
+			}
+		} else if (strncmp(p, "fault=", 6) == 0) {
+			/* picked up by comm_open() */
+			char *f = strdup(p+6);
+			*(f + strcspn(f, ",")) = '\0';
+			setenv("SIEFS_FAULT", f, 1);
+			free(f);
 		}
 		p = strchr(p, ',');
 		if (p) p++;
@@ -604,13 +2924,14 @@ void parse_options(char *p)
 
 int main(int argc, char *argv[])
 {
-	char *mountprog = MOUNTPROG;
-	char **fuse_argv = (char **) malloc(3 + argc + 1);
-	char *p, *pp, *env_path;
-	int i, j, path_size;
+	char *p, *env_path;
+	int path_size, i, sig, r;
 	pid_t pid;
 	char default_comm[] = "/dev/mobile";
-	char *mntpoint;
+	char *single[2], **pairs;		/* device, mountpoint, ... */
+	int npairs;
+	mount *m, **pm;
+	sigset_t set;
 
 	p = strrchr(argv[0], '/');
 	p = (p == NULL) ? argv[0] : p+1;
@@ -620,18 +2941,14 @@ int main(int argc, char *argv[])
 		if (argc < 3)
 			usage();
 
-		comm_device = argv[1];
-		mntpoint = argv[2];
+		pairs = argv + 1;
+		npairs = 1;
 		if ((argc>3) && (strncmp(argv[3],"-o", 2) == 0))
 			parse_options(argv[4]);
 	}
 	else {
 
-		/* recall from fusermount, "mount.siefs /dev/ttyS0 ..." */
-		if ((argc != 2) && (argc < 4))
-			usage();
-
-		comm_device = argv[1];
+		/* "siefs [-o ...] mountpoint", or device and mountpoint pairs */
 		g_baudrate = -1;
 		g_uid = getuid();
 		g_gid = getgid();
@@ -639,16 +2956,23 @@ int main(int argc, char *argv[])
 		g_hidetc = 1;
 		umask(g_umask);
 
-		if (argc == 2) {
-			comm_device = default_comm;
-			mntpoint = argv[1];
+		argv++;
+		argc--;
+		if (argc >= 2 && strncmp(argv[0], "-o", 2) == 0) {
+			parse_options(argv[1]);
+			argv += 2;
+			argc -= 2;
 		}
-		else if (argc >= 4) {
-			if ( strncmp(argv[1], "-o", 2) == 0) {
-				parse_options(argv[2]);
-				mntpoint = argv[3];
-			}
+		if (argc == 1) {
+			single[0] = comm_device ? comm_device : default_comm;
+			single[1] = argv[0];
+			argv = single;
+			argc = 2;
 		}
+		if (argc < 2 || argc % 2 != 0)
+			usage();
+		pairs = argv;
+		npairs = argc / 2;
 	}
 
 	bzero(&dir_st, sizeof(dir_st));
@@ -660,16 +2984,21 @@ int main(int argc, char *argv[])
 	dir_st.st_uid = file_st.st_uid = g_uid;
 	dir_st.st_gid = file_st.st_gid = g_gid;
 
-	if (! init_charset(g_iocharset)) {
+	if (charset_find(g_iocharset) == NULL) {
 		fprintf(stderr, "siefs: unknown charset %s\n", g_iocharset);
 		exit(1);
 	}
 
 	if (g_baudrate == -1) g_baudrate = 115200;
-	g_os = obex_startup(comm_device, g_baudrate);
-	if (g_os == NULL) {
-		perror("siefs: cannot open communication port");
-		exit(1);
+	pm = &g_mounts;
+	for (i=0; i<npairs; i++) {
+		*pm = mount_new(pairs[2*i], pairs[2*i + 1]);
+		if (*pm == NULL) {
+			fprintf(stderr, "siefs: cannot open communication port %s: %s\n",
+				pairs[2*i], strerror(errno));
+			exit(1);
+		}
+		pm = &(*pm)->next;
 	}
 
 	pid = fork();
@@ -689,7 +3018,18 @@ int main(int argc, char *argv[])
 	/* child process */
 	setsid();
 
-	atexit(cleanup);
+	pthread_key_create(&g_replybuf, free);
+
+	/* the signals are taken by the main thread only, see below */
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	g_main = pthread_self();
 
 	env_path = getenv("PATH");
 	path_size = env_path ? strlen(env_path) : 0;
@@ -698,12 +3038,42 @@ int main(int argc, char *argv[])
 	setenv("PATH", p, 1);
 	free(p);
 
-	fuse_argv[0] = argv[0];
-	fuse_argv[1] = mntpoint;
-	fuse_argv[2] = NULL;
-	fuse_main(2, fuse_argv, &siefs_oper);
+	/* a phone that can't be mounted doesn't keep the others down */
+	for (m = g_mounts; m != NULL; m = m->next)
+		mount_start(m, argv[0]);
+	r = (g_live > 0) ? 0 : 1;
+
+	/* until all are unmounted or we are told to stop */
+	while (g_live > 0 && sigwait(&set, &sig) == 0) {
+		if (sig == SIGUSR1) {
+			for (m = g_mounts; m != NULL; m = m->next) {
+				fprintf(stderr, "siefs: %s on %s\n", m->device, m->mntpoint);
+				stats_dump(m->stats, stderr);
+			}
+		} else if (sig == SIGUSR2) {
+			if (trace_dump(g_tracefile) == 0)
+				fprintf(stderr, "siefs: trace written to %s\n", g_tracefile);
+			else
+				fprintf(stderr, "siefs: %s: %s\n", g_tracefile, strerror(errno));
+		} else {
+			break;
+		}
+	}
+
+	/* the kernel ends the connection, which ends the loops */
+	for (m = g_mounts; m != NULL; m = m->next) {
+		if (m->se != NULL) {
+			fuse_session_exit(m->se);
+			fuse_session_unmount(m->se);
+		}
+	}
+	for (m = g_mounts; m != NULL; m = m->next)
+		mount_stop(m);
+	while ((m = g_mounts) != NULL) {
+		g_mounts = m->next;
+		mount_free(m);
+	}
 
-	return 0;
+	return r;
 
 }
-
@@ -0,0 +1,185 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* sietrace.c - print event traces (see trace.h) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+
+typedef struct _name {
+
+	unsigned int hash;
+	char *path;
+	struct _name *next;
+
+} name;
+
+static name *names = NULL;
+
+static int load_names(const char *file) {
+
+	FILE *f;
+	char line[1024];
+	name *n;
+	int l;
+
+	f = fopen(file, "r");
+	if (f == NULL) {
+		perror(file);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		l = strlen(line);
+		while (l > 0 && (line[l-1] == '\n' || line[l-1] == '\r'))
+			line[--l] = '\0';
+		if (l == 0) continue;
+		n = (name *) malloc(sizeof(name));
+		n->path = strdup(line);
+		n->hash = trace_hash(line);
+		n->next = names;
+		names = n;
+	}
+	fclose(f);
+
+	return 0;
+}
+
+static const char *path_of(unsigned int hash) {
+
+	static char buf[16];
+	name *n;
+
+	if (hash == 0) return "";
+	for (n = names; n != NULL; n = n->next) {
+		if (n->hash == hash)
+			return n->path;
+	}
+	sprintf(buf, "#%08x", hash);
+	return buf;
+}
+
+static const char *obexop(int op) {
+
+	switch (op) {
+		case 0x80: return "CONNECT";
+		case 0x81: return "DISCONNECT";
+		case 0x85: return "SETPATH";
+		case 0x03: case 0x83: return "GET";
+		case 0x02: case 0x82: return "PUT";
+		case 0xff: return "ABORT";
+	}
+	return "?";
+}
+
+/* what arg means for the event */
+static void detail(trevent *e, char *buf) {
+
+	static const char *why[] = { "", "crc", "timeout", "noack", "garbage" };
+	static const char *link[] = { "", "gone", "back", "up", "down" };
+
+	buf[0] = '\0';
+	switch (e->op) {
+		case TR_OBEX:
+			sprintf(buf, "%s", obexop(e->arg));
+			break;
+		case TR_EXCHANGE:
+			if (e->arg) sprintf(buf, "%i retries", e->arg);
+			break;
+		case TR_RETRY:
+			sprintf(buf, "%s", (e->arg <= TR_GARBAGE) ? why[e->arg] : "?");
+			break;
+		case TR_LINK:
+			sprintf(buf, "%s", (e->arg <= TR_DOWN) ? link[e->arg] : "?");
+			break;
+	}
+}
+
+static int by_time(const void *a, const void *b) {
+
+	const trevent *x = a, *y = b;
+
+	return (x->ts < y->ts) ? -1 : (x->ts > y->ts);
+}
+
+static void usage() {
+
+	fprintf(stderr, "Usage: sietrace [options] <trace>\n\n"
+		"Prints a trace written by siefs (mount option trace, SIGUSR2\n"
+		"or `trace dump' in .siefs/ctl) or slink (SIEFS_TRACE=<file>).\n\n"
+		"Options:\n"
+		"\t-n <file>\tpaths to show instead of hashes, one per line\n"
+		"\t\t\t(eg. the output of find run in the mount point)\n"
+		"\t-s <ms>\t\tonly events that took longer\n"
+		"\t-o <event>\tonly these events (getattr, read, obex, retry...)\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+
+	FILE *f;
+	char magic[TR_MAGICLEN], arg[32];
+	trevent *ev = NULL;
+	long n = 0, size = 0, i;
+	double slow = -1;
+	const char *only = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:o:")) != -1) {
+		switch (c) {
+			case 'n': if (load_names(optarg) < 0) exit(2); break;
+			case 's': slow = atof(optarg); break;
+			case 'o': only = optarg; break;
+			default: usage();
+		}
+	}
+	if (optind != argc - 1) usage();
+
+	f = fopen(argv[optind], "r");
+	if (f == NULL) {
+		perror(argv[optind]);
+		exit(2);
+	}
+	if (fread(magic, 1, TR_MAGICLEN, f) != TR_MAGICLEN ||
+		memcmp(magic, TR_MAGIC, TR_MAGICLEN) != 0)
+	{
+		fprintf(stderr, "%s: not a trace file\n", argv[optind]);
+		exit(2);
+	}
+	while (1) {
+		if (n == size) {
+			size += 4096;
+			ev = (trevent *) realloc(ev, size * sizeof(trevent));
+		}
+		if (fread(&ev[n], sizeof(trevent), 1, f) != 1)
+			break;
+		n++;
+	}
+	fclose(f);
+
+	/* each thread's events are in order, merge them */
+	qsort(ev, n, sizeof(trevent), by_time);
+
+	printf("%10s %6s %-10s %9s %8s %8s  %s\n",
+		"ms", "tid", "event", "took ms", "bytes", "result", "");
+	for (i=0; i<n; i++) {
+		if (slow >= 0 && ev[i].dur < slow * 1000) continue;
+		if (only && strcmp(only, trace_opname(ev[i].op)) != 0) continue;
+		detail(&ev[i], arg);
+		printf("%10.3f %6u %-10s %9.3f %8i %8i  %s%s%s\n",
+			(ev[i].ts - ev[0].ts) / 1000.0, ev[i].tid,
+			trace_opname(ev[i].op), ev[i].dur / 1000.0,
+			ev[i].bytes, ev[i].result, arg,
+			(arg[0] && ev[i].hash) ? " " : "", path_of(ev[i].hash));
+	}
+
+	free(ev);
+	exit(0);
+}
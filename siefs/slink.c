@@ -15,20 +15,193 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include "obex.h"
+#include "trace.h"
+#include "stats.h"
+#include "irmc.h"
 
 obexsession *os = NULL;
 
 void cleanup() {
+	if (os && os->recoveries > 0)
+		fprintf(stderr, "%i link drops, %.1f ms spent recovering\n",
+			os->recoveries, os->recovery_us / 1000.0);
 	if (os) obex_shutdown(os);
+	if (trace_on && trace_dump(getenv("SIEFS_TRACE")) < 0)
+		perror(getenv("SIEFS_TRACE"));
 }
 
 
+static double now() {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* get path with the given byte error rate on the line, print a report line */
+static void bench(char *path, double rate) {
+
+	char spec[64], buf[4096];
+	long long bytes = 0;
+	double t;
+	int n;
+
+	os->b->retries = 0;
+	os->b->retry_ms = 0;
+	os->recoveries = 0;
+	os->recovery_us = 0;
+	sprintf(spec, "seed=1:corrupt=%g", rate);
+	comm_fault(os->b->h, rate > 0 ? spec : NULL);
+
+	t = now();
+	n = (obex_get(os, path, 0) < 0) ? -1 : 0;
+	while (n >= 0 && (n = obex_read(os, buf, sizeof(buf))) > 0)
+		bytes += n;
+	if (n == 0) obex_close(os);
+	t = now() - t;
+	comm_fault(os->b->h, NULL);
+
+	printf("%9g %9.2f %8i %10.1f %6i %10.1f %s\n", rate,
+		bytes / t / 1024, os->b->retries,
+		os->b->retries ? (double)os->b->retry_ms / os->b->retries : 0.0,
+		os->recoveries, os->recovery_us / 1000.0,
+		n < 0 ? strerror(errno) : "");
+	if (n < 0) {
+		/* get the link back for the next round */
+		obex_connect(os);
+	}
+}
+
+/* operations for a batch, one a line: d <path>, c <path>, m <src> <dest>
+   or a <path> <octal mode>; fields are split at tabs if the line has
+   any (names may have spaces then), else at spaces */
+static int read_ops(char *file, obexop **ops) {
+
+	char line[1100], *sep, *s, *t;
+	FILE *f;
+	int n = 0, size = 0;
+
+	f = (strcmp(file, "-") == 0) ? stdin : fopen(file, "r");
+	if (f == NULL)
+		return -1;
+	*ops = NULL;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#' || line[1] == '\0')
+			continue;
+		if (n == size) {
+			size = size ? 2 * size : 64;
+			*ops = realloc(*ops, size * sizeof(obexop));
+		}
+		memset(&(*ops)[n], 0, sizeof(obexop));
+		sep = strchr(line, '\t') ? "\t" : " ";
+		s = line + 2;
+		t = NULL;
+		if (line[0] == 'm' || line[0] == 'a') {
+			t = strstr(s, sep);
+			if (t == NULL) continue;
+			*(t++) = '\0';
+		}
+		switch (line[0]) {
+			case 'd': (*ops)[n].op = OBEX_OP_DELETE; break;
+			case 'c': (*ops)[n].op = OBEX_OP_MKDIR; break;
+			case 'm': (*ops)[n].op = OBEX_OP_MOVE; (*ops)[n].dest = strdup(t); break;
+			case 'a': (*ops)[n].op = OBEX_OP_CHMOD; (*ops)[n].mode = strtol(t, NULL, 8); break;
+			default: continue;
+		}
+		(*ops)[n++].name = strdup(s);
+	}
+	if (f != stdin) fclose(f);
+
+	return n;
+}
+
+/* run a batch, or its operations one by one, and report */
+static void batch(char *file, int one) {
+
+	static const char *names[] = { "", "d", "c", "m", "a" };
+	obexop *ops;
+	long long rt;
+	double t;
+	int i, n, r = 0, failed = 0;
+
+	n = read_ops(file, &ops);
+	if (n < 0) {
+		perror(file);
+		exit(1);
+	}
+
+	rt = stats_events(NULL, ST_EXCHANGE);
+	t = now();
+	if (! one) {
+		if (obex_batch(os, ops, n) < 0)
+			fprintf(stderr, "link lost\n");
+	} else {
+		for (i=0; i<n; i++) {
+			switch (ops[i].op) {
+				case OBEX_OP_DELETE: r = obex_delete(os, ops[i].name); break;
+				case OBEX_OP_MKDIR: r = obex_mkdir(os, ops[i].name); break;
+				case OBEX_OP_MOVE: r = obex_move(os, ops[i].name, ops[i].dest); break;
+				case OBEX_OP_CHMOD: r = obex_chmod(os, ops[i].name, ops[i].mode); break;
+			}
+			ops[i].result = (r == 0) ? 0 : errno;
+		}
+	}
+	t = now() - t;
+	rt = stats_events(NULL, ST_EXCHANGE) - rt;
+
+	for (i=0; i<n; i++) {
+		printf("%-24s %s %s%s%s\n", ops[i].result ? strerror(ops[i].result) : "ok",
+			names[ops[i].op], ops[i].name, ops[i].dest ? " " : "", ops[i].dest ? ops[i].dest : "");
+		if (ops[i].result) failed++;
+	}
+	printf("%i operations, %i failed, %lli round trips, %.2f s\n", n, failed, rt, t);
+}
+
+/* sync the phone book or calendar into store (if given) and write
+   it out as one file */
+static void sync_db(char *db, char *file, char *store) {
+
+	irmcstore *s;
+	FILE *f;
+	char *t;
+	long long len, rt;
+	double tm;
+	int n;
+
+	s = irmc_create((strcmp(db, "cal") == 0) ? IRMC_CAL : IRMC_PB, store);
+	rt = stats_events(NULL, ST_EXCHANGE);
+	tm = now();
+	n = irmc_sync(s, os);
+	if (n < 0) {
+		perror("irmc_sync");
+		exit(1);
+	}
+	tm = now() - tm;
+	rt = stats_events(NULL, ST_EXCHANGE) - rt;
+
+	t = irmc_text(s, &len);
+	f = (strcmp(file, "-") == 0) ? stdout : fopen(file, "wb");
+	if (f == NULL || fwrite(t, 1, len, f) != len) {
+		perror(file);
+		exit(1);
+	}
+	if (f != stdout) fclose(f);
+	fprintf(stderr, "%i records, %i fetched, %lli round trips, %.2f s\n", s->count, n, rt, tm);
+	free(t);
+	irmc_free(s);
+}
+
 int main(int argc, char **argv) {
 
 	int i, n, h, r;
 	long m;
+	long long size;
+	struct stat st;
 	char buf[4096];
 	char *s, *device;
 	char mode[12] = "----------";
@@ -39,21 +212,37 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "Usage: %s <command> [parameters]\n\n"
 			"Commands:\n"
 			"\tl <path>\t\t\tdirectory listing\n"
-			"\tg <remotepath> <localpath>\tget file\n"
+			"\tg <remotepath> <localpath> [offset]\n"
+			"\t\t\t\tget file, from offset on if given\n"
 			"\tp <localpath> <remotepath>\tput file\n"
-			"\tc <path>\t\t\tcreate directory\n"
+			"\tc <path> [path...]\t\tcreate directories and their parents\n"
 			"\tm <src> <dest>\t\t\trename/move file or directory\n"
 			"\td <path>\t\t\tdelete file\n"
+			"\tr <path>\t\t\tdelete file or directory with its contents\n"
 			"\ti\t\t\t\tdisk information\n"
+			"\tx <file> [one]\t\t\trun the operations in file (- for stdin) as\n"
+			"\t\t\t\tone batch, or one by one, and report round\n"
+			"\t\t\t\ttrips; a line is d <path>, c <path>,\n"
+			"\t\t\t\tm <src> <dest> or a <path> <octal mode>\n"
+			"\ts pb|cal <localpath> [store]\tget phone book or calendar by IrMC sync;\n"
+			"\t\t\t\twith a store only the changes since the\n"
+			"\t\t\t\tlast run are fetched\n"
+			"\tb <remotepath> [rate...]\tget file with line errors (byte error\n"
+			"\t\t\t\trates, default 0 1e-5 1e-4 1e-3 3e-3)\n"
+			"\t\t\t\tand report goodput and retries\n"
 			"\n"
 			"Environment:\n"
-			"\tSLINK_DEVICE\tdevice file for communication (default is /dev/ttyS0)\n"
+			"\tSLINK_DEVICE\tdevice for communication (default is /dev/ttyS0),\n"
+			"\t\t\tor tcp:host:port, rfc2217:host:port, unix:/path, pty:/dev/pts/N\n"
 			"\tSLINK_SPEED\tbaudrate (default is 57600)\n"
+			"\tSIEFS_FAULT\tline errors to inject (see fault.h)\n"
+			"\tSIEFS_TRACE\tfile to write an event trace to (see sietrace)\n"
 			, argv[0]);
 		exit(1);
 	}
 
 	atexit(cleanup);
+	if (getenv("SIEFS_TRACE") != NULL) trace_enable(1);
 	device = getenv("SLINK_DEVICE");
 	if (device == NULL) device = "/dev/ttyS0";
 	s = getenv("SLINK_SPEED");
@@ -78,7 +267,7 @@ int main(int argc, char **argv) {
 				mode[7] = (m & 0004) ? 'r' : '-';
 				mode[8] = (m & 0002) ? 'w' : '-';
 				s = ctime(&(e->mtime));
-				printf("%.10s %9i %.6s %.4s %.5s %s\n", 
+				printf("%.10s %10lli %.6s %.4s %.5s %s\n", 
 					mode,
 					e->size,
 					s+4, s+20, s+11,
@@ -100,7 +289,7 @@ int main(int argc, char **argv) {
 					exit(1);
 				}
 			}
-			if (obex_get(os, argv[2], 0) < 0) {
+			if (obex_get(os, argv[2], (argc > 4) ? strtoll(argv[4], NULL, 0) : 0) < 0) {
 				perror("obex_get");
 				exit(1);
 			}
@@ -129,7 +318,12 @@ int main(int argc, char **argv) {
 					exit(1);
 				}
 			}
-			if (obex_put(os, argv[3]) < 0) {
+			/* size and time go with the file, if known */
+			if (fstat(h, &st) == 0 && S_ISREG(st.st_mode))
+				r = obex_put(os, argv[3], st.st_size, st.st_mtime, NULL);
+			else
+				r = obex_put(os, argv[3], -1, 0, NULL);
+			if (r < 0) {
 				perror("obex_put");
 				exit(1);
 			}
@@ -141,7 +335,10 @@ int main(int argc, char **argv) {
 				}
 			}
 			close(h);
-			obex_close(os);
+			if (obex_close(os) < 0) {
+				perror("obex_close");
+				exit(1);
+			}
 			break;
 
 		case 'm':
@@ -162,19 +359,48 @@ int main(int argc, char **argv) {
 			}
 			break;
 
+		case 'r':
+			if (obex_rmtree(os, argv[2]) < 0) {
+				perror("obex_rmtree");
+				exit(1);
+			}
+			break;
+
 		case 'c':
-			if (obex_mkdir(os, argv[2]) < 0) {
-				perror("obex_mkdir");
+			if (obex_mkdirs(os, argv + 2, argc - 2) < 0) {
+				perror("obex_mkdirs");
 				exit(1);
 			}
 			break;
 
+		case 'b':
+			printf("     rate      KB/s  retries  ms/retry  recov   ms/recov\n");
+			if (argc == 3) {
+				double rates[] = { 0, 1e-5, 1e-4, 1e-3, 3e-3 };
+				for (i=0; i<5; i++) bench(argv[2], rates[i]);
+			}
+			for (i=3; i<argc; i++)
+				bench(argv[2], atof(argv[i]));
+			break;
+
+		case 's':
+			if (argc < 4) {
+				fprintf(stderr, "too few parameters\n");
+				exit(1);
+			}
+			sync_db(argv[2], argv[3], (argc > 4) ? argv[4] : NULL);
+			break;
+
+		case 'x':
+			batch(argv[2], argc > 3 && strcmp(argv[3], "one") == 0);
+			break;
+
 		case 'i':
-			n = obex_capacity(os);
-			if (n != 0) {
-				printf("Capacity:  %7i Kbytes\n", n/1024);
-				n = obex_available(os);
-				printf("Available: %7i Kbytes\n", n/1024);
+			size = obex_capacity(os);
+			if (size != 0) {
+				printf("Capacity:  %10lli Kbytes\n", size/1024);
+				size = obex_available(os);
+				printf("Available: %10lli Kbytes\n", size/1024);
 			}
 			break;
 	}
@@ -0,0 +1,217 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* counters and latency histograms */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "stats.h"
+
+/* histograms are allocated on first use, most mounts never use
+   some of them and an idle one costs little */
+struct _ststats {
+
+	long long counters[ST_COUNTERS];
+	sthist * volatile hists[ST_HISTOGRAMS];
+
+};
+
+static ststats global;
+static __thread ststats *current = NULL;	/* see stats_use() */
+
+static const char *counter_names[ST_COUNTERS] = {
+	"bytes_tx", "bytes_rx", "frames_tx", "frames_rx", "frames_dup",
+	"crc_errors", "timeouts", "retries", "recoveries",
+	"dircache_hits", "dircache_stale", "dircache_shared", "dircache_misses",
+	"statfs_hits", "statfs_misses", "kernel_invals", "put_errors"
+};
+
+static const char *hist_names[ST_HISTOGRAMS] = {
+	"fuse_getattr", "fuse_opendir", "fuse_mknod", "fuse_mkdir",
+	"fuse_unlink", "fuse_rmdir", "fuse_rename", "fuse_truncate",
+	"fuse_open", "fuse_read", "fuse_write", "fuse_statfs", "fuse_release",
+	"fuse_lookup", "fuse_flush", "fuse_fsync",
+	"obex_connect", "obex_disconnect", "obex_setpath", "obex_get",
+	"obex_put", "obex_abort", "obex_other", "exchange"
+};
+
+ststats *stats_create(void) {
+
+	return (ststats *) calloc(1, sizeof(ststats));
+}
+
+void stats_free(ststats *s) {
+
+	int i;
+
+	if (s == NULL) return;
+	for (i=0; i<ST_HISTOGRAMS; i++)
+		free(s->hists[i]);
+	free(s);
+}
+
+void stats_use(ststats *s) {
+
+	current = s;
+}
+
+void stats_count(int counter, long long n) {
+
+	ststats *s = current ? current : &global;
+
+	__sync_fetch_and_add(&s->counters[counter], n);
+}
+
+static int bucket(long long v) {
+
+	int e;
+
+	if (v < (1 << ST_SUBBITS))
+		return (v < 0) ? 0 : v;
+	for (e = ST_SUBBITS; (v >> (e+1)) != 0; e++);
+	e = ((e - ST_SUBBITS + 1) << ST_SUBBITS) + ((v >> (e - ST_SUBBITS)) & ((1 << ST_SUBBITS) - 1));
+
+	return (e < ST_BUCKETS) ? e : ST_BUCKETS - 1;
+}
+
+/* lowest value falling into bucket i */
+static long long bucket_value(int i) {
+
+	int e = i >> ST_SUBBITS;
+	long long sub = i & ((1 << ST_SUBBITS) - 1);
+
+	if (e == 0) return sub;
+	return (sub | (1 << ST_SUBBITS)) << (e - 1);
+}
+
+void stats_time(int hist, long long us) {
+
+	ststats *s = current ? current : &global;
+	sthist *h = s->hists[hist];
+	long long m;
+
+	if (h == NULL) {
+		h = (sthist *) calloc(1, sizeof(sthist));
+		if (h == NULL) return;
+		if (! __sync_bool_compare_and_swap(&s->hists[hist], NULL, h)) {
+			free(h);
+			h = s->hists[hist];
+		}
+	}
+
+	__sync_fetch_and_add(&h->count, 1);
+	__sync_fetch_and_add(&h->sum, us);
+	__sync_fetch_and_add(&h->bucket[bucket(us)], 1);
+	while ((m = h->max) < us && ! __sync_bool_compare_and_swap(&h->max, m, us));
+}
+
+long long stats_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int stats_obexop(int opcode) {
+
+	switch (opcode & 0x7f) {
+		case 0x00: return ST_OBEX_CONNECT;
+		case 0x01: return ST_OBEX_DISCONNECT;
+		case 0x02: return ST_OBEX_PUT;
+		case 0x03: return ST_OBEX_GET;
+		case 0x05: return ST_OBEX_SETPATH;
+		case 0x7f: return ST_OBEX_ABORT;
+	}
+	return ST_OBEX_OTHER;
+}
+
+long long stats_counter(ststats *s, int counter) {
+
+	if (s == NULL) s = &global;
+	return s->counters[counter];
+}
+
+long long stats_events(ststats *s, int hist) {
+
+	if (s == NULL) s = &global;
+	return s->hists[hist] ? s->hists[hist]->count : 0;
+}
+
+/* value at quantile q of a snapshot of h */
+static double percentile(sthist *h, long long count, double q) {
+
+	long long n = 0, want;
+	int i;
+
+	want = (long long)(q * count + 0.5);
+	if (want < 1) want = 1;
+	for (i=0; i<ST_BUCKETS; i++) {
+		n += h->bucket[i];
+		if (n >= want)
+			return bucket_value(i);
+	}
+	return h->max;
+}
+
+static int append(char **buf, int *len, int *size, const char *fmt, ...) {
+
+	va_list ap;
+	int n;
+
+	if (*size - *len < 256) {
+		*size += 4096;
+		*buf = realloc(*buf, *size);
+	}
+	va_start(ap, fmt);
+	n = vsnprintf(*buf + *len, *size - *len, fmt, ap);
+	va_end(ap);
+	if (n > 0 && n < *size - *len) *len += n;
+
+	return n;
+}
+
+char *stats_text(ststats *s, int *plen) {
+
+	char *buf = NULL;
+	int i, len = 0, size = 0;
+	long long c;
+	sthist *h;
+
+	if (s == NULL) s = &global;
+	for (i=0; i<ST_COUNTERS; i++)
+		append(&buf, &len, &size, "%-18s %lli\n", counter_names[i], s->counters[i]);
+
+	append(&buf, &len, &size, "\n%-18s %8s %10s %10s %10s %10s %10s   (ms)\n",
+		"", "count", "mean", "p50", "p90", "p99", "max");
+	for (i=0; i<ST_HISTOGRAMS; i++) {
+		h = s->hists[i];
+		if (h == NULL || (c = h->count) == 0) continue;
+		append(&buf, &len, &size, "%-18s %8lli %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+			hist_names[i], c, h->sum / 1000.0 / c,
+			percentile(h, c, 0.5) / 1000.0, percentile(h, c, 0.9) / 1000.0,
+			percentile(h, c, 0.99) / 1000.0, h->max / 1000.0);
+	}
+
+	if (plen) *plen = len;
+	return buf;
+}
+
+void stats_dump(ststats *s, FILE *f) {
+
+	char *t;
+
+	t = stats_text(s, NULL);
+	if (t == NULL) return;
+	fputs(t, f);
+	fflush(f);
+	free(t);
+}
@@ -0,0 +1,116 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/* counters */
+#define ST_BYTES_TX 0
+#define ST_BYTES_RX 1
+#define ST_FRAMES_TX 2		/* BFB frames sent */
+#define ST_FRAMES_RX 3		/* BFB frames received */
+#define ST_FRAMES_DUP 4		/* repeated frames from the phone */
+#define ST_CRC_ERRORS 5
+#define ST_TIMEOUTS 6
+#define ST_RETRIES 7
+#define ST_RECOVERIES 8		/* link drops survived */
+#define ST_DC_HITS 9		/* directory cache */
+#define ST_DC_STALE 10		/* served expired, refreshed in background */
+#define ST_DC_SHARED 11		/* waited for another caller's fetch */
+#define ST_DC_MISSES 12
+#define ST_SPACE_HITS 13	/* statfs cache */
+#define ST_SPACE_MISSES 14
+#define ST_KERNEL_INVALS 15	/* kernel cache entries dropped */
+#define ST_PUT_ERRORS 16	/* files refused after close */
+#define ST_COUNTERS 17
+
+/* latency histograms */
+#define ST_FUSE_GETATTR 0
+#define ST_FUSE_OPENDIR 1
+#define ST_FUSE_MKNOD 2
+#define ST_FUSE_MKDIR 3
+#define ST_FUSE_UNLINK 4
+#define ST_FUSE_RMDIR 5
+#define ST_FUSE_RENAME 6
+#define ST_FUSE_TRUNCATE 7
+#define ST_FUSE_OPEN 8
+#define ST_FUSE_READ 9
+#define ST_FUSE_WRITE 10
+#define ST_FUSE_STATFS 11
+#define ST_FUSE_RELEASE 12
+#define ST_FUSE_LOOKUP 13
+#define ST_FUSE_FLUSH 14
+#define ST_FUSE_FSYNC 15
+#define ST_OBEX_CONNECT 16	/* request to response */
+#define ST_OBEX_DISCONNECT 17
+#define ST_OBEX_SETPATH 18
+#define ST_OBEX_GET 19
+#define ST_OBEX_PUT 20
+#define ST_OBEX_ABORT 21
+#define ST_OBEX_OTHER 22
+#define ST_EXCHANGE 23		/* one BFB frame and its answer */
+#define ST_HISTOGRAMS 24
+
+/*
+ * Log-linear buckets: exact below 8 us, then 8 per power of two,
+ * so any value is within 12.5% of its bucket.
+ */
+#define ST_SUBBITS 3
+#define ST_BUCKETS (40 << ST_SUBBITS)
+
+typedef struct {
+
+	long long count, sum, max;
+	long long bucket[ST_BUCKETS];
+
+} sthist;
+
+/*
+ * A set of counters and histograms, one per mounted phone.
+ */
+typedef struct _ststats ststats;
+
+ststats *stats_create(void);
+void stats_free(ststats *s);
+
+/*
+ * Count the calling thread's events into s from now on; NULL,
+ * the default, is the process wide set.
+ */
+void stats_use(ststats *s);
+
+/*
+ * Counting is lock free and may be done from any thread.
+ */
+void stats_count(int counter, long long n);
+void stats_time(int hist, long long us);
+long long stats_now(void);	/* monotonic, us */
+
+/*
+ * Text report: counters, then count, mean, percentiles and max of
+ * each histogram used, of s (NULL: the process wide set).
+ * stats_text() returns a malloc'ed string.
+ */
+char *stats_text(ststats *s, int *len);
+void stats_dump(ststats *s, FILE *f);
+
+/*
+ * A counter, and the number of events in a histogram, of s (NULL:
+ * the process wide set).
+ */
+long long stats_counter(ststats *s, int counter);
+long long stats_events(ststats *s, int hist);
+
+/*
+ * Histogram for an OBEX opcode.
+ */
+int stats_obexop(int opcode);
+
+#endif
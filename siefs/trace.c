@@ -0,0 +1,173 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* binary event trace in per-thread rings */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+typedef struct _ring {
+
+	volatile unsigned long head;	/* events written so far */
+	volatile int owner;		/* tid, 0 when free */
+	trevent ev[TR_RING];
+	struct _ring *next;
+
+} ring;
+
+volatile int trace_on = 0;
+
+static ring * volatile rings = NULL;
+static __thread ring *my = NULL;
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static const char *names[TR_OPS] = {
+	NULL, "getattr", "opendir", "mknod", "mkdir", "unlink", "rmdir",
+	"rename", "truncate", "open", "read", "write", "statfs", "release",
+	"lookup", "flush", "fsync", NULL, NULL, NULL,
+	"readdir", "revalidate", "inval",
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+	"obex", "exchange", "retry", "recover", "link", "ctl"
+};
+
+/* a thread is gone: its ring may be taken over, events stay */
+static void release(void *arg) {
+
+	ring *r = arg;
+
+	__sync_synchronize();
+	r->owner = 0;
+}
+
+static void init() {
+
+	pthread_key_create(&key, release);
+}
+
+/* first event of this thread: reuse a free ring or add one */
+static ring *attach() {
+
+	ring *r;
+	int tid = syscall(SYS_gettid), er = errno;
+
+	pthread_once(&once, init);
+	for (r = rings; r != NULL; r = r->next) {
+		if (r->owner == 0 && __sync_bool_compare_and_swap(&r->owner, 0, tid))
+			break;
+	}
+	if (r == NULL) {
+		r = (ring *) calloc(1, sizeof(ring));
+		if (r == NULL) {
+			errno = er;
+			return NULL;
+		}
+		r->owner = tid;
+		do {
+			r->next = rings;
+		} while (! __sync_bool_compare_and_swap(&rings, r->next, r));
+	}
+	pthread_setspecific(key, r);
+	errno = er;
+
+	return r;
+}
+
+void trace_event(int op, int arg, const char *path, int bytes, int result, long long dur) {
+
+	struct timespec ts;
+	trevent *e;
+	ring *r = my;
+
+	if (r == NULL && (r = my = attach()) == NULL)
+		return;
+
+	e = &r->ev[r->head % TR_RING];
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	e->ts = (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	e->dur = (dur < 0) ? 0 : dur;
+	e->hash = path ? trace_hash(path) : 0;
+	e->bytes = bytes;
+	e->result = result;
+	e->op = op;
+	e->arg = arg;
+	e->tid = r->owner;
+
+	/* publish after the event is complete */
+	__sync_synchronize();
+	r->head++;
+}
+
+void trace_enable(int on) {
+
+	trace_on = on;
+}
+
+int trace_dump(const char *file) {
+
+	FILE *f;
+	ring *r;
+	trevent *buf;
+	unsigned long head, first, skip, n, i;
+	int res;
+
+	f = fopen(file, "w");
+	if (f == NULL) return -1;
+	fwrite(TR_MAGIC, 1, TR_MAGICLEN, f);
+
+	buf = (trevent *) malloc(TR_RING * sizeof(trevent));
+	for (r = rings; r != NULL && buf != NULL; r = r->next) {
+		head = r->head;
+		first = (head > TR_RING) ? head - TR_RING : 0;
+		for (i = first; i < head; i++)
+			buf[i - first] = r->ev[i % TR_RING];
+
+		/* drop what the owner overwrote while we were copying,
+		   counting the event it may be writing now */
+		__sync_synchronize();
+		n = r->head + 1;
+		skip = (n > first + TR_RING) ? n - TR_RING - first : 0;
+		if (skip >= head - first)
+			continue;
+		n = head - first - skip;
+		if (fwrite(buf + skip, sizeof(trevent), n, f) != n)
+			break;
+	}
+
+	res = (r != NULL || buf == NULL) ? -1 : 0;
+	free(buf);
+	if (fclose(f) != 0) res = -1;
+	if (res < 0 && errno == 0) errno = EIO;
+
+	return res;
+}
+
+/* FNV-1a */
+unsigned int trace_hash(const char *path) {
+
+	unsigned int h = 2166136261u;
+
+	while (*path)
+		h = (h ^ (unsigned char)*(path++)) * 16777619u;
+
+	return h;
+}
+
+const char *trace_opname(int op) {
+
+	if (op <= 0 || op >= TR_OPS || names[op] == NULL)
+		return "?";
+	return names[op];
+}
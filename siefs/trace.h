@@ -0,0 +1,92 @@
+/*
+    siefs: a virtual filesystem for accessing Siemens mobiles
+    Copyright (C) 2003  Dmitry Zakharov (dmitry-z@mail.ru)
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/* events */
+#define TR_GETATTR 1		/* filesystem operations, bytes is the size */
+#define TR_OPENDIR 2		/* asked for, result is what was returned */
+#define TR_MKNOD 3
+#define TR_MKDIR 4
+#define TR_UNLINK 5
+#define TR_RMDIR 6
+#define TR_RENAME 7
+#define TR_TRUNCATE 8
+#define TR_OPEN 9
+#define TR_READ 10
+#define TR_WRITE 11
+#define TR_STATFS 12
+#define TR_RELEASE 13
+#define TR_LOOKUP 14
+#define TR_FLUSH 15
+#define TR_FSYNC 16
+#define TR_READDIR 20		/* a listing fetched from the phone */
+#define TR_REVALIDATE 21	/* ... in background, result is the changes */
+#define TR_INVAL 22		/* kernel told to drop a name (arg 1) or inode */
+#define TR_OBEX 30		/* arg is the opcode, result the response code */
+#define TR_EXCHANGE 31		/* one BFB frame and its answer */
+#define TR_RETRY 32		/* arg is one of TR_CRC..., bytes the attempt */
+#define TR_RECOVER 33
+#define TR_LINK 34		/* arg is one of TR_GONE... */
+#define TR_CTL 35		/* a command written to the control file */
+#define TR_OPS 36
+
+#define TR_CRC 1
+#define TR_TIMEOUT 2
+#define TR_NOACK 3
+#define TR_GARBAGE 4
+
+#define TR_GONE 1
+#define TR_BACK 2
+#define TR_UP 3
+#define TR_DOWN 4
+
+/*
+ * One event, 32 bytes. The dump file is TR_MAGIC followed by
+ * events in host byte order, grouped by thread.
+ */
+typedef struct {
+
+	unsigned long long ts;	/* monotonic, us, when it ended */
+	unsigned int dur;	/* us */
+	unsigned int hash;	/* of the path, 0 if none */
+	int bytes;
+	int result;
+	unsigned short op;
+	unsigned short arg;
+	unsigned int tid;
+
+} trevent;
+
+#define TR_MAGIC "SIETRC\0\1"
+#define TR_MAGICLEN 8
+#define TR_RING 4096		/* events kept per thread */
+
+extern volatile int trace_on;
+
+/*
+ * Record an event into the calling thread's ring. Lock free, and
+ * a single test when tracing is off.
+ */
+#define TRACE(op, arg, path, bytes, result, dur) \
+	do { if (trace_on) trace_event(op, arg, path, bytes, result, dur); } while (0)
+
+void trace_event(int op, int arg, const char *path, int bytes, int result, long long dur);
+void trace_enable(int on);
+
+/*
+ * Write what the rings hold to file. Returns 0, or -1 with errno
+ * set.
+ */
+int trace_dump(const char *file);
+
+unsigned int trace_hash(const char *path);
+const char *trace_opname(int op);
+
+#endif
@@ -10,13 +10,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include "comm.h"
 #include "crcmodel.h"
 #include "transport.h"
+#include "engine.h"
 
-#define ACKSEQ "\x16\x02\x14\x01\xfe"
-#define ACKLEN 5
+#define REOPEN_TRIES 30	/* 100ms each */
 
 //#define DBG(x...) fprintf(stderr, x); 
 #define DBG(x...)
@@ -151,6 +153,15 @@ tra_connection *tra_open(char *device, int speed, int timeout) {
 	b->timeout = timeout;
 	b->seq = 0;
 	b->iseq = 0xff;
+	b->buffer = NULL;
+	b->buflen = 0;
+	b->obuf = NULL;
+	b->obuflen = 0;
+	b->eng = NULL;
+	b->owneng = 0;
+	b->active = NULL;
+	b->retries = 0;
+	b->retry_ms = 0;
 
 	DBG("OK\n");
 	return b;
@@ -257,8 +268,6 @@ int tra_initiate(tra_connection *b) {
 	b->startup = 0;
 	b->seq = 0;
 	b->iseq = 0xff;
-	b->buffer = NULL;
-	b->buflen = 0;
 	comm_settimeout(h, b->timeout);
 	return 0;
 
@@ -266,6 +275,70 @@ l_err:
 	return -1;
 }
 
+int tra_reconnect(tra_connection *b) {
+
+	hcomm *h = b->h;
+	int i;
+
+	DBG("tra_reconnect... ");
+	if (b->startup || b->linktype == LINK_UNKNOWN) {
+		errno = EIO;
+		return -1;
+	}
+
+	/* the device node may have been replaced, reopen it at the
+	   speed we were talking and see if the phone is still there;
+	   give hotplug a moment if it isn't back yet */
+	for (i=0; comm_restore(h) != 0; i++) {
+		if (i >= REOPEN_TRIES) {
+			DBG("can't reopen\n");
+			errno = EIO;
+			return -1;
+		}
+		usleep(100000);
+	}
+	if (tra_ping(b, 2) != 0)
+		return -1;
+
+	/* start a new frame sequence */
+	b->seq = 0;
+	b->iseq = 0xff;
+	comm_settimeout(h, b->timeout);
+	DBG("OK\n");
+	return 0;
+}
+
+/* change the speed of a working BFB link, otherwise just remember
+   it for the next tra_initiate() */
+int tra_setspeed(tra_connection *b, int speed) {
+
+	unsigned char buf[64];
+	int i;
+
+	for (i=0; rates[i].speed != 0 && rates[i].speed != speed; i++);
+	if (rates[i].speed == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	b->speed0 = speed;
+	if (b->startup || b->linktype != LINK_BFB || b->speed == speed)
+		return 0;
+
+	DBG("tra_setspeed %i... ", speed);
+	comm_tx(b->h, rates[i].string, rates[i].len);
+	if (comm_rx(b->h, buf, sizeof(buf)) != rates[i].len || buf[3] != 0xcc) {
+		DBG("refused\n");
+		errno = EIO;
+		return -1;
+	}
+	usleep(100000);
+	comm_setspeed(b->h, speed);
+	b->speed = speed;
+	DBG("OK\n");
+	return 0;
+}
+
 void tra_close(tra_connection *b) {
 
 	static const char BRESETCMD[] =
@@ -293,219 +366,59 @@ void tra_close(tra_connection *b) {
 
 	}
 
+	if (b->owneng) eng_destroy(b->eng);
 	comm_close(b->h);
+	free(b->buffer);
+	free(b->obuf);
 	free(b);
 	DBG("OK\n");
 }
 
-void sendack(hcomm *h) {
+void tra_attach(tra_connection *b, engine *e) {
 
-	DBG(">ack\n");
-	comm_tx(h, ACKSEQ, ACKLEN);
+	if (b->owneng) eng_destroy(b->eng);
+	b->eng = e;
+	b->owneng = 0;
 }
 
-int waitack(hcomm *h) {
+int tra_submit(tra_connection *b, eng_req *r) {
 
-	unsigned char tbuf[6];
-
-	if (comm_rx(h, tbuf, ACKLEN) < ACKLEN) {
-		DBG("waitack: got no ack\n");
-		return -1;
-	}
-	if (memcmp(tbuf, ACKSEQ, ACKLEN) != 0) {
-		DBG("waitack: garbage\n");
-		return -1;
+	if (b->eng == NULL) {
+		b->eng = eng_create();
+		if (b->eng == NULL) return -1;
+		b->owneng = 1;
 	}
-	DBG("<ack\n");
-	return 0;
 
+	return eng_submit(b->eng, r);
 }
 
-int tra_send(tra_connection *b, void *buf, int len) {
-
-	unsigned char tbuf[4];
-	unsigned char *ws, *p;
-	unsigned short csum;
-	int i, n, l;
-
-	DBG("tra_send (%i bytes)...\n", len);
-
-	if (b->linktype == LINK_QWE3) {
-		if (comm_tx(b->h, buf, len) == len) {
-			DBG("...OK\n");
-			return len;
-		} else {
-			DBG("...failed\n");
-			return -1;
-		}
-	}
-
-	if (b->buflen < len+16) {
-		free(b->buffer);
-		b->buffer = malloc(b->buflen = len+32);
-	}
-	ws = b->buffer;
-	ws[0] = (b->seq == 0) ? 0x02 : 0x03;
-	ws[1] = ~ws[0];
-	ws[2] = (b->seq)++;
-	ws[3] = (unsigned char) (len >> 8);
-	ws[4] = (unsigned char) (len & 0xff);
-	memcpy(ws+5, buf, len);
-	csum = crc16(ws+2, len+3);
-	ws[5+len] = (unsigned char) (csum & 0xff);
-	ws[5+len+1] = (unsigned char) (csum >> 8);
-
-	for (i=0; i<3; i++) {
-
-		if (i > 0) {
-			DBG(" --- trying %i time...\n", i+1);
-			bflush(b);
-			sendack(b->h);
-		}
-
-		p = ws;
-		n = len + 7;
-		while (n > 0) {
-
-			l = (n > 0x20) ? 0x20 : n;
-			tbuf[0] = 0x16;
-			tbuf[1] = l;
-			tbuf[2] = 0x16 ^ l;
-			DBG("tx%i ", l);
-			if (comm_tx(b->h, tbuf, 3) < 3) break;
-			if (comm_tx(b->h, p, l) < l) break;
-			n -= l;
-			p += l;
-
-		}
-
-		if (n == 0 && waitack(b->h) == 0) {
-			DBG("...OK\n");
-			return len;
-		}
-	}
-
-	DBG("...failed\n");
-	return -1;
+int tra_complete(tra_connection *b, eng_req *r) {
 
+	return eng_wait(b->eng, r);
 }
 
-int getblock(hcomm *h, void *buf) {
-
-	unsigned char tbuf[4];
-	int l;
+int tra_send(tra_connection *b, void *buf, int len) {
 
-	if (comm_rx(h, tbuf, 3) < 3) return -1;
-	if (tbuf[0] != 0x16) return -1;
-	l = tbuf[1];
-	if (l < 1 || l > 0x20) return -1;
-	if ((l ^ tbuf[0]) != tbuf[2]) return -1;
+	eng_req r;
 
-	l = comm_rx(h, buf, l);
-	DBG("rx%i ", l);
-	return l;
+	DBG("tra_send (%i bytes)...\n", len);
+	eng_init(&r, b, buf, len, NULL, 0);
+	if (tra_submit(b, &r) < 0)
+		return -1;
 
+	return tra_complete(b, &r);
 }
 
 int tra_recv(tra_connection *b, void *buf, int size) {
 
-	unsigned char tbuf[32];
-	unsigned char *ws, *p;
-	int len, len1, iseq, csum;
-	int i, n, r;
+	eng_req r;
 
 	DBG("tra_recv...\n");
-	if (b->linktype == LINK_QWE3) {
-		p = buf;
-		if (comm_rx(b->h, p, 3) != 3) return -1;
-		len = len1 = (p[1] << 8) + p[2];
-		DBG("len=%i\n", len);
-		if (len > size) {
-			DBG("too small buffer size (%i)\n", size);
-			return -1;
-		}
-
-		p += 3;
-		len -= 3;
-		while (len > 0) {
-			n = comm_rx(b->h, p, len);
-			if (n <= 0) return -1;
-			p += n;
-			len -= n;
-		}
-		return len1;
-	}
-
-
-	r = -1;
-	for (i=0; i<3; i++) {
-
-		if (i > 0) {
-			DBG(" --- trying %i time...\n", i+1);
-			bflush(b);
-		}
-
-		if ((n = getblock(b->h, tbuf)) < 5) {
-			if (tbuf[0] == 0x01) i--;
-			continue;
-		}
-		if ((tbuf[0] | 1) != 0x03) continue;
-		if ((tbuf[0] ^ tbuf[1]) != 0xff) continue;
-		iseq = tbuf[2];
-		if (iseq == b->iseq) {
-			/* it's previous block, just reacknowledge it */
-			DBG("reack prev\n");
-			bflush(b);
-			sendack(b->h);
-			i = -1;
-			continue;
-		}
-
-		len = len1 = (tbuf[3] << 8) + tbuf[4];
-		DBG("len=%i\n", len);
-		if (len > size) {
-			DBG("too small buffer size\n");
-			return -1;
-		}
-		len += 2;	/* add checksum bytes */
-
-		if (b->buflen < len+16) {
-			free(b->buffer);
-			b->buffer = malloc(b->buflen = len+32);
-		}
-		p = ws = b->buffer;
-		if (n >= 5) {
-			memcpy(p, tbuf, n);
-			p += n;
-			len -= (n-5);
-		}
-
-		while (len > 0) {
-			n = getblock(b->h, tbuf);
-			if (n <= 0) break;
-			memcpy(p, tbuf, n);
-			p += n;
-			len -= n;
-		}
-
-		if (len == 0) {
-			csum = (p[-2] & 0xff) + (p[-1] << 8);
-			if (csum == crc16(ws+2, len1+3)) {
-				b->iseq = iseq;
-				sendack(b->h);
-				memcpy(buf, ws+5, len1);
-				r = len1;
-				break;
-			} else {
-				DBG("CRC error\n");
-			}
-		} else {
-			DBG("block read error\n");
-		}
-	}
-
-	return r;
+	eng_init(&r, b, NULL, 0, buf, size);
+	if (tra_submit(b, &r) < 0)
+		return -1;
 
+	return tra_complete(b, &r);
 }
 
 unsigned short crc16(unsigned char *buf, int len) {
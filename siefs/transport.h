@@ -15,6 +15,9 @@
 #define LINK_BFB 1
 #define LINK_QWE3 2
 
+struct _engine;
+struct _eng_req;
+
 typedef struct tra_connection_s {
 
 	hcomm *h;		/* file descriptor */
@@ -27,6 +30,13 @@ typedef struct tra_connection_s {
 	unsigned char iseq;	/* input sequence counter */
 	int buflen;
 	unsigned char *buffer;	/* workspace */
+	int obuflen;
+	unsigned char *obuf;	/* outgoing blocks */
+	struct _engine *eng;	/* engine driving this connection */
+	int owneng;
+	struct _eng_req *active;	/* request in flight */
+	int retries;		/* exchange errors (bad CRC, timeout...) */
+	long long retry_ms;	/* time from first error to success */
 
 } tra_connection;
 
@@ -34,9 +44,22 @@ unsigned short crc16(unsigned char *buf, int len);
 tra_connection *tra_open(char *device, int speed, int timeout);
 int tra_test(tra_connection *b, int cnt);
 int tra_initiate(tra_connection *b);
+int tra_reconnect(tra_connection *b);
+int tra_setspeed(tra_connection *b, int speed);
 int tra_send(tra_connection *b, void *buf, int len);
 int tra_recv(tra_connection *b, void *buf, int size);
 void tra_close(tra_connection *b);
 
+/*
+ * Asynchronous exchange (see engine.h). tra_submit() starts the
+ * request on the connection's engine, tra_complete() waits for
+ * it. tra_send()/tra_recv() are these two in a row. A connection
+ * gets a private engine unless tra_attach() puts it on a shared
+ * one, so one thread can serve several devices.
+ */
+int tra_submit(tra_connection *b, struct _eng_req *r);
+int tra_complete(tra_connection *b, struct _eng_req *r);
+void tra_attach(tra_connection *b, struct _engine *e);
+
 #endif
 